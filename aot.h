@@ -0,0 +1,430 @@
+// Ahead-of-time recompiler: a ROM as C, compiled into a module the emulator loads
+//
+// --aot-emit FILE.c walks the control flow graph of the loaded ROM from
+// 0x200 (jumps, calls and their return sites, both ways out of every skip)
+// and writes one C function per reachable address: the block of
+// instructions starting there, up to the first jump, call, return or skip,
+// like the JIT's. V registers and I become locals the C compiler keeps in
+// host registers. Opcodes with side effects beyond registers, timers and
+// the stack (drawing, FX0A, FX33/FX55, BNNN's computed jump, SCHIP display
+// control) and jumps closing wait loops end a block and are interpreted.
+//
+// The module records the ROM, mode, quirk profile and chip8_t layout it was
+// built for, and --aot refuses it for anything else. A block whose bytes the
+// ROM overwrites is never run again; its address falls back to the
+// interpreter, as does every address no block starts at. CHIP-8 and SCHIP
+// only, XO-CHIP's 4 byte instructions are left to the interpreter.
+
+#include <dlfcn.h>
+
+#define AOT_MAGIC "C8AO"
+#define AOT_VERSION 1
+#define AOT_MAX_BLOCK 32          // max chip8 instructions per block
+
+// a block takes the chip8_t as bytes, the module knows the field offsets it was emitted with
+typedef void (*aot_block_t)(uint8_t *chip8);
+
+// what a module exports as chip8_aot_module; the generated C gets the same text
+#define AOT_MODULE_STRUCT \
+    struct aot_module { \
+        char magic[4]; \
+        uint32_t version; \
+        uint64_t layout; \
+        uint64_t rom_hash; \
+        uint8_t mode; \
+        uint8_t quirks; \
+        uint8_t max_block; \
+        uint8_t reserved[5]; \
+        void (*const *block)(uint8_t *chip8); \
+        const uint8_t *length; \
+    }
+typedef AOT_MODULE_STRUCT aot_module_t;
+#define AOT_STRING(...) #__VA_ARGS__
+#define AOT_EXPAND_STRING(...) AOT_STRING(__VA_ARGS__)
+
+struct aot {
+    void *library;                  // dlopen handle
+    const aot_module_t *module;
+    bool stale[4096];               // block start whose bytes the ROM has overwritten
+};
+
+// hash of the chip8_t fields generated code touches, a module only runs in a matching build
+uint64_t aot_layout(void){
+    const uint32_t layout[] = {
+        sizeof(chip8_t), offsetof(chip8_t, ram), offsetof(chip8_t, stack), offsetof(chip8_t, stack_ptr),
+        offsetof(chip8_t, V), offsetof(chip8_t, I), offsetof(chip8_t, PC), offsetof(chip8_t, delay_timer),
+        offsetof(chip8_t, sound_timer), offsetof(chip8_t, keypad), offsetof(chip8_t, rng_state),
+    };
+    return fnv1a(layout, sizeof layout);
+}
+
+// the ROM as loaded, with anything load_chip8 leaves zero past its end
+uint64_t aot_rom_hash(const chip8_t *chip8){
+    return fnv1a(&chip8->ram[0x200], 0x1000 - 0x200);
+}
+
+enum { AOT_BODY, AOT_END_BEFORE, AOT_END_AFTER };
+
+// one block's C while it is being emitted
+typedef struct {
+    FILE *body;
+    uint16_t used;          // V registers the block reads or writes, loaded on entry
+    uint16_t written;       // stored on exit
+    bool uses_I;
+    bool writes_I;
+    bool uses_rng;          // CXNN, needs a scratch local
+} aot_emit_t;
+
+// where control can go after the instruction at addr, for the reachability walk
+int aot_successors(uint16_t opcode, uint16_t addr, chip8_mode_t mode, uint16_t next[2]){
+    const uint16_t NN = opcode & 0xFF;
+    switch(opcode >> 12){
+        case 0x0:
+            if(opcode == 0x00EE || (mode != MODE_CHIP8 && opcode == 0x00FD)) return 0;
+            break;
+        case 0x1:
+            next[0] = opcode & 0x0FFF;
+            return 1;
+        case 0x2:
+            // the return site too, 00EE ends a path
+            next[0] = opcode & 0x0FFF;
+            next[1] = addr + 2;
+            return 2;
+        case 0x3: case 0x4: case 0x5: case 0x9:
+            next[0] = addr + 2;
+            next[1] = addr + 4;
+            return 2;
+        case 0xB:
+            // computed jump, its targets are left to the interpreter
+            return 0;
+        case 0xE:
+            if(NN == 0x9E || NN == 0xA1){
+                next[0] = addr + 2;
+                next[1] = addr + 4;
+                return 2;
+            }
+            break;
+    }
+    next[0] = addr + 2;
+    return 1;
+}
+
+// PC = cond ? skip : next, as skip_next() outside XO-CHIP
+void aot_skip(aot_emit_t *e, uint16_t addr, const char *cond, uint8_t X, uint8_t Y){
+    e->used |= 1 << X | 1 << Y;
+    fprintf(e->body, "    PC = %s ? 0x%04X : 0x%04X;\n", cond, (uint16_t)(addr + 4), (uint16_t)(addr + 2));
+}
+
+// append the C for one instruction, quirk checks happen here rather than in the emitted code
+int aot_translate(aot_emit_t *e, uint16_t opcode, uint16_t addr, chip8_mode_t mode, const quirks_t *q){
+    const uint8_t X = (opcode >> 8) & 0xF;
+    const uint8_t Y = (opcode >> 4) & 0xF;
+    const uint8_t NN = opcode & 0xFF;
+    const uint16_t NNN = opcode & 0x0FFF;
+    FILE *out = e->body;
+    char cond[32];
+
+    fprintf(out, "    // %03X: %04X\n", addr, opcode);
+    switch(opcode >> 12){
+        case 0x0:
+            if(opcode == 0x00EE){
+                fprintf(out, "    SP = (SP - 1) & 15;\n    PC = STACK(SP);\n");
+                return AOT_END_AFTER;
+            }
+            // 00E0 and SCHIP display control are interpreted, the rest are CHIP-8 no-ops
+            return mode == MODE_CHIP8 && opcode != 0x00E0 ? AOT_BODY : AOT_END_BEFORE;
+        case 0x1:
+            fprintf(out, "    PC = 0x%03X;\n", NNN);
+            return AOT_END_AFTER;
+        case 0x2:
+            fprintf(out, "    STACK(SP & 15) = 0x%04X;\n    SP = (SP + 1) & 15;\n    PC = 0x%03X;\n", (uint16_t)(addr + 2), NNN);
+            return AOT_END_AFTER;
+        case 0x3: case 0x4:
+            snprintf(cond, sizeof cond, "v%X %s 0x%02X", X, (opcode >> 12) == 0x3 ? "==" : "!=", NN);
+            aot_skip(e, addr, cond, X, X);
+            return AOT_END_AFTER;
+        case 0x5: case 0x9:
+            snprintf(cond, sizeof cond, "v%X %s v%X", X, (opcode >> 12) == 0x5 ? "==" : "!=", Y);
+            aot_skip(e, addr, cond, X, Y);
+            return AOT_END_AFTER;
+        case 0x6:
+            fprintf(out, "    v%X = 0x%02X;\n", X, NN);
+            break;
+        case 0x7:
+            fprintf(out, "    v%X += 0x%02X;\n", X, NN);
+            break;
+        case 0x8: {
+            // VF is written before VX like the interpreter, so VX/VY may alias VF
+            const uint8_t src = q->shift_vy ? Y : X;
+            switch(opcode & 0xF){
+                case 0x0: fprintf(out, "    v%X = v%X;\n", X, Y); break;
+                case 0x1: fprintf(out, "    v%X |= v%X;\n", X, Y); break;
+                case 0x2: fprintf(out, "    v%X &= v%X;\n", X, Y); break;
+                case 0x3: fprintf(out, "    v%X ^= v%X;\n", X, Y); break;
+                case 0x4: fprintf(out, "    vF = v%X + v%X > 255;\n    v%X += v%X;\n", X, Y, X, Y); break;
+                case 0x5: fprintf(out, "    vF = v%X >= v%X;\n    v%X -= v%X;\n", X, Y, X, Y); break;
+                case 0x6: fprintf(out, "    vF = v%X & 1;\n    v%X = v%X >> 1;\n", src, X, src); break;
+                case 0x7: fprintf(out, "    vF = v%X >= v%X;\n    v%X = v%X - v%X;\n", Y, X, X, Y, X); break;
+                case 0xE: fprintf(out, "    vF = v%X >> 7;\n    v%X = v%X << 1;\n", src, X, src); break;
+                default: return AOT_BODY;  // no-op
+            }
+            if(q->vf_reset && (opcode & 0xF) >= 0x1 && (opcode & 0xF) <= 0x3){
+                fprintf(out, "    vF = 0;\n");
+            }
+            e->used |= 1 << X | 1 << Y;
+            e->written |= 1 << X;
+            if((opcode & 0xF) != 0x0){
+                e->used |= 1 << 0xF;
+                e->written |= 1 << 0xF;
+            }
+            return AOT_BODY;
+        }
+        case 0xA:
+            fprintf(out, "    i = 0x%03X;\n", NNN);
+            e->uses_I = e->writes_I = true;
+            return AOT_BODY;
+        case 0xC:
+            fprintf(out, "    r = RNG;\n    r ^= r << 13;\n    r ^= r >> 17;\n    r ^= r << 5;\n"
+                         "    RNG = r;\n    v%X = (r >> 24) & 0x%02X;\n", X, NN);
+            e->uses_rng = true;
+            break;
+        case 0xE:
+            if(NN != 0x9E && NN != 0xA1) return AOT_BODY;   // no-op
+            snprintf(cond, sizeof cond, "%sKEY(v%X & 0xF)", NN == 0xA1 ? "!" : "", X);
+            aot_skip(e, addr, cond, X, X);
+            return AOT_END_AFTER;
+        case 0xF:
+            if(mode != MODE_CHIP8 && (NN == 0x30 || NN == 0x75 || NN == 0x85)) return AOT_END_BEFORE;
+            switch(NN){
+                case 0x07:
+                    fprintf(out, "    v%X = DT;\n", X);
+                    break;
+                case 0x15: case 0x18:
+                    fprintf(out, "    %s = v%X;\n", NN == 0x15 ? "DT" : "ST", X);
+                    e->used |= 1 << X;
+                    return AOT_BODY;
+                case 0x1E: case 0x29:
+                    fprintf(out, NN == 0x1E ? "    i += v%X;\n" : "    i = v%X * 5;\n", X);
+                    e->used |= 1 << X;
+                    e->uses_I = e->writes_I = true;
+                    return AOT_BODY;
+                case 0x65:
+                    for(uint8_t r = 0; r <= X; r++){
+                        fprintf(out, "    v%X = RAM((i + %u) & 0xFFF);\n", r, r);
+                        e->used |= 1 << r;
+                        e->written |= 1 << r;
+                    }
+                    if(q->memory_i) fprintf(out, "    i += %u;\n", X + 1);
+                    e->uses_I = true;
+                    e->writes_I |= q->memory_i;
+                    return AOT_BODY;
+                case 0x0A: case 0x33: case 0x55:
+                    return AOT_END_BEFORE;
+                default:
+                    return AOT_BODY;    // no-op
+            }
+            break;
+        default:
+            // BNNN, DXYN
+            return AOT_END_BEFORE;
+    }
+    // single register results: 6XNN, 7XNN, CXNN, FX07
+    e->used |= 1 << X;
+    e->written |= 1 << X;
+    return AOT_BODY;
+}
+
+// emit the block starting at addr as b<addr>(), its length in instructions (0 = none)
+uint8_t aot_emit_block(FILE *out, const chip8_t *chip8, uint16_t addr, uint8_t max_block){
+    char *text = NULL;
+    size_t size = 0;
+    aot_emit_t e = { .body = open_memstream(&text, &size) };
+    if(e.body == NULL) return 0;
+
+    uint8_t count = 0;
+    bool terminated = false;
+    for(uint16_t pc = addr; count < max_block && pc + 1 <= 0x0FFF; pc += 2){
+        const uint16_t opcode = (chip8->ram[pc] << 8) | chip8->ram[pc + 1];
+        // jumps closing a wait loop stay interpreted so op_1NNN can spot the loop
+        if((opcode >> 12) == 0x1 && idle_jump_period(chip8, pc)) break;
+        const long mark = ftell(e.body);
+        const int kind = aot_translate(&e, opcode, pc, chip8->mode, &quirk_table[chip8->quirks]);
+        if(kind == AOT_END_BEFORE){
+            fseek(e.body, mark, SEEK_SET);
+            break;
+        }
+        count++;
+        if(kind == AOT_END_AFTER){
+            terminated = true;
+            break;
+        }
+    }
+    const long length = ftell(e.body);
+    fclose(e.body);
+
+    if(count > 0){
+        fprintf(out, "static void b%03X(uint8_t *restrict m){\n", addr);
+        for(int r = 0; r < 16; r++){
+            if(e.used & (1 << r)) fprintf(out, "    uint8_t v%X = V(%d);\n", r, r);
+        }
+        if(e.uses_I) fprintf(out, "    uint16_t i = I_;\n");
+        if(e.uses_rng) fprintf(out, "    uint32_t r;\n");
+        fwrite(text, 1, length, out);
+        for(int r = 0; r < 16; r++){
+            if(e.written & (1 << r)) fprintf(out, "    V(%d) = v%X;\n", r, r);
+        }
+        if(e.writes_I) fprintf(out, "    I_ = i;\n");
+        // fall through to the instruction after the block
+        if(!terminated) fprintf(out, "    PC = 0x%04X;\n", (uint16_t)(addr + count * 2));
+        fprintf(out, "}\n\n");
+    }
+    free(text);
+    return count;
+}
+
+// write the loaded ROM as a C module for --aot
+bool aot_emit(const chip8_t *chip8, const config_t *config){
+    if(chip8->mode == MODE_XOCHIP){
+        SDL_Log("The AOT compiler does not know XO-CHIP's 4 byte instructions");
+        return false;
+    }
+
+    // reachable code, from the entry point through every direct jump, call and skip
+    // locals, every emit starts from a clean walk
+    bool reachable[4096] = {0};
+    uint16_t work[4096];
+    uint32_t pending = 0, instructions = 0;
+    reachable[0x200] = true;
+    work[pending++] = 0x200;
+    while(pending){
+        const uint16_t addr = work[--pending];
+        instructions++;
+        const uint16_t opcode = (chip8->ram[addr] << 8) | chip8->ram[(addr + 1) & 0x0FFF];
+        uint16_t next[2];
+        const int count = aot_successors(opcode, addr, chip8->mode, next);
+        for(int i = 0; i < count; i++){
+            if(next[i] < 0x200 || next[i] >= 0x0FFF || reachable[next[i]]) continue;
+            reachable[next[i]] = true;
+            work[pending++] = next[i];
+        }
+    }
+
+    FILE *out = fopen(config->aot_emit, "w");
+    if(out == NULL){
+        SDL_Log("Unable to open AOT output: %s", config->aot_emit);
+        return false;
+    }
+
+    // blocks never outlast a frame, or they would never fit what is left of one
+    const uint32_t insts_per_frame = config->instructions_per_second / 60;
+    const uint8_t max_block = insts_per_frame == 0 ? 1 : insts_per_frame < AOT_MAX_BLOCK ? insts_per_frame : AOT_MAX_BLOCK;
+    fprintf(out, "// %s as C, written by chip8 --aot-emit for --aot: do not edit\n"
+                 "// cc -O2 -shared -fPIC %s -o MODULE.so\n"
+                 "#include <stdint.h>\n\n"
+                 "#define V(x) m[%zu + (x)]\n"
+                 "#define I_ (*(uint16_t *)(m + %zu))\n"
+                 "#define PC (*(uint16_t *)(m + %zu))\n"
+                 "#define SP m[%zu]\n"
+                 "#define STACK(x) ((uint16_t *)(m + %zu))[x]\n"
+                 "#define DT m[%zu]\n"
+                 "#define ST m[%zu]\n"
+                 "#define KEY(x) m[%zu + (x)]\n"
+                 "#define RNG (*(uint32_t *)(m + %zu))\n"
+                 "#define RAM(x) m[%zu + (x)]\n\n",
+            chip8->rom_name, config->aot_emit,
+            offsetof(chip8_t, V), offsetof(chip8_t, I), offsetof(chip8_t, PC), offsetof(chip8_t, stack_ptr),
+            offsetof(chip8_t, stack), offsetof(chip8_t, delay_timer), offsetof(chip8_t, sound_timer),
+            offsetof(chip8_t, keypad), offsetof(chip8_t, rng_state), offsetof(chip8_t, ram));
+
+    uint8_t length[4096];
+    uint32_t blocks = 0;
+    for(uint16_t addr = 0x200; addr < 0x0FFF; addr++){
+        length[addr] = reachable[addr] ? aot_emit_block(out, chip8, addr, max_block) : 0;
+        blocks += length[addr] != 0;
+    }
+
+    fprintf(out, "static void (*const block[4096])(uint8_t *) = {\n");
+    for(uint16_t addr = 0x200; addr < 0x0FFF; addr++){
+        if(length[addr]) fprintf(out, "    [0x%03X] = b%03X,\n", addr, addr);
+    }
+    fprintf(out, "};\n\nstatic const uint8_t length[4096] = {\n");
+    for(uint16_t addr = 0x200; addr < 0x0FFF; addr++){
+        if(length[addr]) fprintf(out, "    [0x%03X] = %u,\n", addr, length[addr]);
+    }
+    fprintf(out, "};\n\ntypedef %s aot_module_t;\n\n", AOT_EXPAND_STRING(AOT_MODULE_STRUCT));
+    fprintf(out, "const aot_module_t chip8_aot_module = {\n"
+                 "    \"%s\", %u, 0x%016" PRIX64 "ULL, 0x%016" PRIX64 "ULL, %u, %u, %u, {0}, block, length,\n};\n",
+            AOT_MAGIC, AOT_VERSION, aot_layout(), aot_rom_hash(chip8), chip8->mode, chip8->quirks, max_block);
+
+    const bool ok = fclose(out) == 0;
+    fprintf(stderr, "aot: %u reachable instructions, %u blocks written to %s\n", instructions, blocks, config->aot_emit);
+    return ok;
+}
+
+// load a module built from aot_emit's output, NULL (interpret) if it is not for this machine
+aot_t *aot_load(const chip8_t *chip8, const char *path){
+    // a bare file name would be looked up in the library path
+    char local[4096];
+    snprintf(local, sizeof local, "%s%s", strchr(path, '/') ? "" : "./", path);
+    void *library = dlopen(local, RTLD_NOW | RTLD_LOCAL);
+    if(library == NULL){
+        SDL_Log("Unable to load AOT module, interpreting: %s", dlerror());
+        return NULL;
+    }
+
+    const aot_module_t *module = dlsym(library, "chip8_aot_module");
+    const char *wrong = module == NULL ? "not an AOT module" :
+                        memcmp(module->magic, AOT_MAGIC, 4) != 0 || module->version != AOT_VERSION ? "wrong version" :
+                        module->layout != aot_layout() ? "emitted by another build" :
+                        module->rom_hash != aot_rom_hash(chip8) ? "emitted from another ROM" :
+                        module->mode != chip8->mode || module->quirks != chip8->quirks ? "emitted for another mode or quirk profile" : NULL;
+    aot_t *aot = wrong ? NULL : calloc(1, sizeof(aot_t));
+    if(aot == NULL){
+        SDL_Log("AOT module %s: %s, interpreting", path, wrong ? wrong : "out of memory");
+        dlclose(library);
+        return NULL;
+    }
+    aot->library = library;
+    aot->module = module;
+    return aot;
+}
+
+void aot_destroy(aot_t *aot){
+    if(aot == NULL) return;
+    dlclose(aot->library);
+    free(aot);
+}
+
+// ram[addr, addr+len) was written by the guest, retire every block translated from it
+void aot_invalidate(aot_t *aot, uint16_t addr, uint16_t len){
+    for(uint32_t i = 0; i < len; i++){
+        const uint16_t at = (addr + i) & 0x0FFF;
+        for(uint32_t start = at >= 2 * AOT_MAX_BLOCK ? at - 2 * AOT_MAX_BLOCK + 1 : 0; start <= at; start++){
+            if(start + 2 * aot->module->length[start] > at) aot->stale[start] = true;
+        }
+    }
+}
+
+// Emulate count instructions, running compiled blocks where possible
+uint32_t aot_run(chip8_t *chip8, const config_t *config, uint32_t count){
+    const aot_t *aot = chip8->aot;
+    const aot_module_t *module = aot->module;
+    const uint32_t total = count;
+    while(count > 0){
+        const uint16_t addr = chip8->PC & 0x0FFF;
+
+        // a block only runs if it fits in what is left of this frame
+        if(module->length[addr] && module->length[addr] <= count && !aot->stale[addr]){
+            count -= module->length[addr];
+            module->block[addr]((uint8_t *)chip8);
+        }
+        else{
+            // 00FD is interpreted, only the interpreter can exit
+            run_instructions(chip8, config, 1);
+            count--;
+            if(chip8->state == QUIT) return total - count;
+            count -= idle_skip(chip8, count);
+        }
+    }
+    return total;
+}
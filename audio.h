@@ -0,0 +1,211 @@
+// Beeper: the sound timer as audio, through an SDL callback or into a WAV file
+//
+// The emulation loop calls audio_frame() once per emulated frame. Whether
+// sound_timer was running (plus XO-CHIP's audio pattern, if a ROM loaded one)
+// goes through a lock-free single-producer single-consumer queue to the SDL
+// audio callback, which plays AUDIO_FRAME_SAMPLES samples of tone or silence
+// for each frame, so a beep lasts exactly sound_timer frames and the main loop
+// never waits on the audio device. The tone is read from a precomputed
+// one-period wavetable with a phase accumulator, so consecutive beeping frames
+// join without clicks; an XO-CHIP pattern is played as its 128 one bit samples
+// looped at 4000*2^((pitch-64)/48) Hz. Headless runs render the same samples
+// straight into a WAV file.
+
+#include <stdatomic.h>
+
+#define AUDIO_RATE 44100
+#define AUDIO_FRAME_SAMPLES (AUDIO_RATE / 60)   // samples per emulated 60Hz frame
+#define AUDIO_TONE 440                          // beep frequency in Hz
+#define AUDIO_VOLUME 3000
+#define AUDIO_WAVE 256                          // wavetable entries, one period
+#define AUDIO_QUEUE 64                          // frames in flight, power of two
+#define AUDIO_MAX_LAG 4                         // frames queued before the callback skips ahead
+#define AUDIO_PATTERN_RATE 4000                 // XO-CHIP pattern bits per second at pitch 64
+
+// what one emulated frame plays
+typedef struct {
+    bool beeping;
+    uint32_t pattern_step;  // phase advance per sample through the pattern, 0 = plain beep
+    uint8_t pattern[16];
+} audio_tone_t;
+
+typedef struct {
+    int16_t wave[AUDIO_WAVE];       // one period of the beep
+    uint32_t step;                  // phase advance per sample
+    uint32_t phase;                 // callback: position in wave, top 8 bits index it
+    audio_tone_t frames[AUDIO_QUEUE]; // per emulated frame
+    _Alignas(64) atomic_uint head;  // next frame the emulation writes
+    _Alignas(64) atomic_uint tail;  // next frame the callback plays
+    uint32_t frame_pos;             // callback: samples of the current frame played
+    audio_tone_t tone;              // callback: the current frame
+    FILE *wav;                      // WAV output, NULL when not writing
+    uint32_t wav_phase;             // emulation thread's own position in wave
+    uint32_t wav_samples;
+#ifndef HEADLESS
+    SDL_AudioDeviceID device;       // 0 when there is no audio device
+#endif
+} audio_t;
+
+// square wave with short linear edges, softer than a hard square
+void audio_init_wave(audio_t *audio){
+    const int ramp = 8;
+    for(int i = 0; i < AUDIO_WAVE; i++){
+        const int half = i % (AUDIO_WAVE / 2);
+        const int level = half < ramp ? AUDIO_VOLUME * (2 * half - ramp) / ramp : AUDIO_VOLUME;
+        audio->wave[i] = i < AUDIO_WAVE / 2 ? level : -level;
+    }
+    audio->step = (uint32_t)(((uint64_t)AUDIO_TONE << 32) / AUDIO_RATE);
+    audio->frame_pos = AUDIO_FRAME_SAMPLES;
+}
+
+// count samples of tone or silence, the phase keeps running either way
+void audio_render(const audio_t *audio, uint32_t *phase, int16_t *out, uint32_t count, const audio_tone_t *tone){
+    if(tone->beeping && tone->pattern_step){
+        // top 7 bits of the phase pick one of the 128 pattern bits
+        for(uint32_t i = 0; i < count; i++){
+            const uint32_t bit = *phase >> 25;
+            out[i] = (tone->pattern[bit >> 3] >> (7 - (bit & 7))) & 1 ? AUDIO_VOLUME : -AUDIO_VOLUME;
+            *phase += tone->pattern_step;
+        }
+        return;
+    }
+    for(uint32_t i = 0; i < count; i++){
+        out[i] = tone->beeping ? audio->wave[*phase >> 24] : 0;
+        *phase += audio->step;
+    }
+}
+
+// phase step for a pattern at pitch, 48 pitch steps to the octave (no libm, the build does not link it)
+uint32_t audio_pattern_step(uint8_t pitch){
+    double rate = AUDIO_PATTERN_RATE;
+    int steps = pitch - 64;
+    for(; steps >= 48; steps -= 48) rate *= 2;
+    for(; steps < 0; steps += 48) rate /= 2;
+    for(; steps > 0; steps--) rate *= 1.0145453349375237;   // 2^(1/48)
+    return (uint32_t)(rate * (1 << 25) / AUDIO_RATE);
+}
+
+#ifndef HEADLESS
+// SDL audio thread: play queued frames, silence when the emulation has not caught up
+void audio_callback(void *userdata, uint8_t *stream, int len){
+    audio_t *audio = userdata;
+    int16_t *out = (int16_t *)stream;
+    uint32_t samples = len / sizeof(int16_t);
+
+    while(samples > 0){
+        if(audio->frame_pos == AUDIO_FRAME_SAMPLES){
+            const unsigned head = atomic_load_explicit(&audio->head, memory_order_acquire);
+            unsigned tail = atomic_load_explicit(&audio->tail, memory_order_relaxed);
+            if(head == tail){
+                audio_render(audio, &audio->phase, out, samples, &(audio_tone_t){0});
+                return;
+            }
+            // fast-forward queues frames faster than real time, keep only the newest
+            if(head - tail > AUDIO_MAX_LAG) tail = head - 1;
+            audio->tone = audio->frames[tail % AUDIO_QUEUE];
+            atomic_store_explicit(&audio->tail, tail + 1, memory_order_release);
+            audio->frame_pos = 0;
+        }
+
+        uint32_t count = AUDIO_FRAME_SAMPLES - audio->frame_pos;
+        if(count > samples) count = samples;
+        audio_render(audio, &audio->phase, out, count, &audio->tone);
+        out += count;
+        samples -= count;
+        audio->frame_pos += count;
+    }
+}
+
+bool audio_open_device(audio_t *audio){
+    const SDL_AudioSpec want = {
+        .freq = AUDIO_RATE,
+        .format = AUDIO_S16SYS,
+        .channels = 1,
+        .samples = 512,             // ~12ms per callback
+        .callback = audio_callback,
+        .userdata = audio,
+    };
+    audio->device = SDL_OpenAudioDevice(NULL, 0, &want, NULL, 0);
+    if(audio->device == 0){
+        SDL_Log("Unable to open audio device, running without sound: %s", SDL_GetError());
+        return false;
+    }
+    SDL_PauseAudioDevice(audio->device, 0);
+    return true;
+}
+#endif
+
+void audio_write_wav_header(audio_t *audio){
+    const uint32_t data_size = audio->wav_samples * sizeof(int16_t);
+    const uint32_t byte_rate = AUDIO_RATE * sizeof(int16_t);
+    uint8_t header[44];
+    memcpy(header, "RIFF", 4);
+    const uint32_t riff_size = 36 + data_size;
+    memcpy(header + 4, &riff_size, 4);
+    memcpy(header + 8, "WAVEfmt ", 8);
+    const uint32_t fmt_size = 16;
+    const uint16_t format = 1, channels = 1, block_align = 2, bits = 16;
+    const uint32_t rate = AUDIO_RATE;
+    memcpy(header + 16, &fmt_size, 4);
+    memcpy(header + 20, &format, 2);
+    memcpy(header + 22, &channels, 2);
+    memcpy(header + 24, &rate, 4);
+    memcpy(header + 28, &byte_rate, 4);
+    memcpy(header + 32, &block_align, 2);
+    memcpy(header + 34, &bits, 2);
+    memcpy(header + 36, "data", 4);
+    memcpy(header + 40, &data_size, 4);
+    fwrite(header, sizeof header, 1, audio->wav);
+}
+
+// render every emulated frame into a 16 bit mono WAV file as well
+bool audio_open_wav(audio_t *audio, const char *path){
+    audio->wav = fopen(path, "wb");
+    if(audio->wav == NULL){
+        SDL_Log("Unable to open WAV file: %s", path);
+        return false;
+    }
+    // sizes are filled in by audio_close
+    audio_write_wav_header(audio);
+    return true;
+}
+
+void audio_close(audio_t *audio){
+#ifndef HEADLESS
+    if(audio->device) SDL_CloseAudioDevice(audio->device);
+    audio->device = 0;
+#endif
+    if(audio->wav){
+        fseek(audio->wav, 0, SEEK_SET);
+        audio_write_wav_header(audio);
+        fclose(audio->wav);
+        audio->wav = NULL;
+    }
+}
+
+// emulation side, once per emulated frame: did this frame beep, and with what
+void audio_frame(audio_t *audio, const chip8_t *chip8){
+    audio_tone_t tone = { .beeping = chip8->sound_timer > 0 };
+    if(tone.beeping && chip8->has_pattern){
+        tone.pattern_step = audio_pattern_step(chip8->pitch);
+        memcpy(tone.pattern, chip8->pattern, sizeof tone.pattern);
+    }
+
+    if(audio->wav){
+        int16_t samples[AUDIO_FRAME_SAMPLES];
+        audio_render(audio, &audio->wav_phase, samples, AUDIO_FRAME_SAMPLES, &tone);
+        fwrite(samples, sizeof samples, 1, audio->wav);
+        audio->wav_samples += AUDIO_FRAME_SAMPLES;
+    }
+
+#ifndef HEADLESS
+    if(audio->device == 0) return;
+
+    // queue full means the callback stopped pulling, drop the frame rather than wait
+    const unsigned head = atomic_load_explicit(&audio->head, memory_order_relaxed);
+    if(head - atomic_load_explicit(&audio->tail, memory_order_acquire) < AUDIO_QUEUE){
+        audio->frames[head % AUDIO_QUEUE] = tone;
+        atomic_store_explicit(&audio->head, head + 1, memory_order_release);
+    }
+#endif
+}
@@ -0,0 +1,257 @@
+// Benchmarks: per-opcode, synthetic ROM, full ROM and render timings as JSON lines
+//
+// Every result is one JSON object on its own line on stdout, so runs can be
+// diffed or collected by a script. Micro benchmarks drive run_instructions()
+// on one opcode (or call/return pair) in a loop; ROM benchmarks time each
+// frame of a run with the interpreter and the JIT and report percentiles.
+// ROM frames are BENCH_INSTRUCTIONS_PER_SECOND / 60 instructions long so the
+// clock reads stay small next to the work being timed.
+
+#define BENCH_MICRO_ITERATIONS 1000000
+#define BENCH_INSTRUCTIONS_PER_SECOND 60000
+#define BENCH_RENDER_FRAMES 600
+#define BENCH_FRAMES 600                            // ROM and synthetic runs without --frames
+
+typedef struct {
+    const char *name;
+    uint16_t program[2];    // loaded at 0x200, PC goes back to 0x200 after length instructions
+    uint8_t length;
+} bench_op_t;
+
+const bench_op_t bench_ops[] = {
+    {"00E0", {0x00E0}, 1},
+    {"1NNN", {0x1200}, 1},
+    {"2NNN+00EE", {0x2202, 0x00EE}, 2},
+    {"3XNN", {0x3012}, 1},
+    {"4XNN", {0x4012}, 1},
+    {"5XY0", {0x5010}, 1},
+    {"6XNN", {0x6012}, 1},
+    {"7XNN", {0x7001}, 1},
+    {"8XY0", {0x8010}, 1},
+    {"8XY1", {0x8011}, 1},
+    {"8XY4", {0x8014}, 1},
+    {"8XY5", {0x8015}, 1},
+    {"8XY6", {0x8016}, 1},
+    {"8XYE", {0x801E}, 1},
+    {"9XY0", {0x9010}, 1},
+    {"ANNN", {0xA300}, 1},
+    {"BNNN", {0xB200}, 1},
+    {"CXNN", {0xC0FF}, 1},
+    {"DXYN", {0xD015}, 1},
+    {"EX9E", {0xE09E}, 1},
+    {"FX07", {0xF007}, 1},
+    {"FX15", {0xF015}, 1},
+    {"FX1E", {0xF01E}, 1},
+    {"FX29", {0xF029}, 1},
+    {"FX33", {0xF033}, 1},
+    {"FX55", {0xF355}, 1},
+    {"FX65", {0xF365}, 1},
+};
+
+// a DXYN heavy loop: two sprites of 15 and 10 rows per 5 instructions
+const uint16_t bench_dxyn_rom[] = {
+    0xA000,     // I = font
+    0xD01F,     // draw 15 rows at V0, V1
+    0x7003,     // V0 += 3
+    0xD12A,     // draw 10 rows at V1, V2
+    0x7105,     // V1 += 5
+    0x1202,     // loop
+};
+
+// an ALU heavy loop without any memory or display access
+const uint16_t bench_alu_rom[] = {
+    0x6001,     // V0 = 1
+    0x6103,     // V1 = 3
+    0x8014,     // V0 += V1
+    0x8105,     // V1 -= V0
+    0x8206,     // V2 >>= 1
+    0x7207,     // V2 += 7
+    0x8213,     // V2 ^= V1
+    0x3200,     // skip if V2 == 0
+    0x1204,     // loop
+    0x1204,
+};
+
+uint64_t bench_now_ns(void){
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000000000ULL + now.tv_nsec;
+}
+
+int bench_compare_u64(const void *a, const void *b){
+    const uint64_t x = *(const uint64_t *)a;
+    const uint64_t y = *(const uint64_t *)b;
+    return (x > y) - (x < y);
+}
+
+// ROM names go into JSON strings
+void bench_print_string(const char *text){
+    putchar('"');
+    for(; *text; text++){
+        if(*text == '"' || *text == '\\') putchar('\\');
+        putchar(*text);
+    }
+    putchar('"');
+}
+
+// sort frame times and print the percentiles, closing the JSON object
+void bench_print_frames(uint64_t *frame_ns, uint64_t frames){
+    if(frames == 0){
+        printf("}\n");
+        return;
+    }
+    qsort(frame_ns, frames, sizeof frame_ns[0], bench_compare_u64);
+    printf(",\"frame_ns_p50\":%" PRIu64 ",\"frame_ns_p90\":%" PRIu64 ",\"frame_ns_p99\":%" PRIu64 ",\"frame_ns_max\":%" PRIu64 "}\n",
+           frame_ns[frames / 2], frame_ns[frames * 90 / 100], frame_ns[frames * 99 / 100], frame_ns[frames - 1]);
+}
+
+// load a program given as big endian opcodes
+bool bench_load(chip8_t *chip8, const uint16_t *program, size_t length, char *name){
+    uint8_t rom[64];
+    for(size_t i = 0; i < length; i++){
+        rom[i * 2] = program[i] >> 8;
+        rom[i * 2 + 1] = program[i] & 0xFF;
+    }
+    memset(chip8, 0, sizeof *chip8);
+    if(!load_chip8(chip8, rom, length * 2, name, MODE_CHIP8)) return false;
+    chip8_seed(chip8, 1);
+    return true;
+}
+
+void bench_micro(chip8_t *chip8, const config_t *config){
+    for(size_t op = 0; op < sizeof bench_ops / sizeof bench_ops[0]; op++){
+        const bench_op_t *bench = &bench_ops[op];
+        if(!bench_load(chip8, bench->program, bench->length, (char *)bench->name)) return;
+
+        const uint64_t start = bench_now_ns();
+        for(uint32_t i = 0; i < BENCH_MICRO_ITERATIONS; i++){
+            run_instructions(chip8, config, bench->length);
+            chip8->PC = 0x200;
+        }
+        const uint64_t ns = bench_now_ns() - start;
+
+        const double ops = (double)BENCH_MICRO_ITERATIONS * bench->length;
+        printf("{\"bench\":\"micro\",\"name\":\"%s\",\"opcode\":\"0x%04X\",\"instructions\":%.0f,\"ns_per_op\":%.3f,\"mips\":%.2f}\n",
+               bench->name, bench->program[0], ops, ns / ops, ops / (ns / 1000.0));
+    }
+}
+
+// run a loaded machine for config->max_frames frames, timing every frame
+void bench_run(const char *kind, const char *name, const chip8_t *boot, const config_t *config, bool jit){
+    const uint64_t frames = config->max_frames;
+    if(frames == 0) return;
+    chip8_t *chip8 = malloc(sizeof *chip8);
+    uint64_t *frame_ns = malloc(frames * sizeof(uint64_t));
+    if(chip8 == NULL || frame_ns == NULL){
+        SDL_Log("Unable to allocate benchmark machine");
+        free(chip8);
+        free(frame_ns);
+        return;
+    }
+    *chip8 = *boot;
+    chip8->jit = jit ? jit_create(*config) : NULL;
+    if(jit && chip8->jit == NULL){
+        // no JIT on this host, nothing to report
+        free(chip8);
+        free(frame_ns);
+        return;
+    }
+
+    const uint32_t insts_per_frame = config->instructions_per_second / 60;
+    const uint64_t start = bench_now_ns();
+    for(uint64_t f = 0; f < frames; f++){
+        const uint64_t frame_start = bench_now_ns();
+        run_frame(chip8, config, insts_per_frame);
+        update_timers(chip8);
+        frame_ns[f] = bench_now_ns() - frame_start;
+    }
+    const uint64_t ns = bench_now_ns() - start;
+
+    const uint64_t instructions = frames * insts_per_frame;
+    printf("{\"bench\":\"%s\",\"name\":", kind);
+    bench_print_string(name);
+    printf(",\"engine\":\"%s\",\"frames\":%" PRIu64 ",\"instructions_per_frame\":%u,\"instructions\":%" PRIu64
+           ",\"seconds\":%.6f,\"mips\":%.2f,\"framebuffer_hash\":\"0x%016" PRIX64 "\"",
+           jit ? "jit" : "interpreter", frames, insts_per_frame, instructions,
+           ns / 1e9, instructions / (ns / 1000.0), framebuffer_hash(chip8));
+    bench_print_frames(frame_ns, frames);
+
+    jit_destroy(chip8->jit);
+    free(chip8);
+    free(frame_ns);
+}
+
+#ifndef HEADLESS
+// update_screen() on frames that always differ, with every row or a single row dirty
+void bench_render(chip8_t *chip8, const config_t config){
+    sdl_t sdl = {0};
+    if(!init_sdl(&sdl, config)) return;
+
+    const uint64_t dirty_masks[] = {0xFFFFFFFF, 0x00010000};
+    const char *names[] = {"update_screen_full", "update_screen_row"};
+    uint64_t frame_ns[BENCH_RENDER_FRAMES];
+    for(int m = 0; m < 2; m++){
+        const uint64_t start = bench_now_ns();
+        for(uint32_t f = 0; f < BENCH_RENDER_FRAMES; f++){
+            for(int y = 0; y < 32; y++){
+                chip8->display[0][y] = 0x9E3779B97F4A7C15ULL * (f * 32 + y + 1);
+            }
+            chip8->dirty_rows = dirty_masks[m];
+            const uint64_t frame_start = bench_now_ns();
+            update_screen(&sdl, config, chip8);
+            frame_ns[f] = bench_now_ns() - frame_start;
+        }
+        const uint64_t ns = bench_now_ns() - start;
+        printf("{\"bench\":\"render\",\"name\":\"%s\",\"frames\":%u,\"seconds\":%.6f",
+               names[m], BENCH_RENDER_FRAMES, ns / 1e9);
+        bench_print_frames(frame_ns, BENCH_RENDER_FRAMES);
+    }
+    final_cleanup(&sdl);
+}
+#endif
+
+// run every benchmark, config.roms are timed as full ROM runs
+bool run_bench(config_t config){
+    config.instructions_per_second = BENCH_INSTRUCTIONS_PER_SECOND;
+    config.idle = false;    // time every instruction, even a ROM parked on a jump to itself
+    // runs are timed by frame, --instructions alone does not end them
+    if(config.max_frames == 0) config.max_frames = BENCH_FRAMES;
+    chip8_t *chip8 = calloc(1, sizeof *chip8);
+    if(chip8 == NULL){
+        SDL_Log("Unable to allocate benchmark machine");
+        return false;
+    }
+
+    bench_micro(chip8, &config);
+
+    const struct {
+        const char *name;
+        const uint16_t *program;
+        size_t length;
+    } synthetic[] = {
+        {"dxyn", bench_dxyn_rom, sizeof bench_dxyn_rom / sizeof bench_dxyn_rom[0]},
+        {"alu", bench_alu_rom, sizeof bench_alu_rom / sizeof bench_alu_rom[0]},
+    };
+    for(size_t i = 0; i < sizeof synthetic / sizeof synthetic[0]; i++){
+        if(!bench_load(chip8, synthetic[i].program, synthetic[i].length, (char *)synthetic[i].name)) return false;
+        bench_run("synthetic", synthetic[i].name, chip8, &config, false);
+        bench_run("synthetic", synthetic[i].name, chip8, &config, true);
+    }
+
+    for(uint32_t r = 0; r < config.rom_count; r++){
+        memset(chip8, 0, sizeof *chip8);
+        if(!init_chip8(chip8, config.roms[r], config.mode)) return false;
+        chip8_set_quirks(chip8, config.quirks);
+        chip8_seed(chip8, config.seed);
+        bench_run("rom", config.roms[r], chip8, &config, false);
+        // the JIT does not know XO-CHIP's long instructions
+        if(config.mode != MODE_XOCHIP) bench_run("rom", config.roms[r], chip8, &config, true);
+    }
+
+#ifndef HEADLESS
+    memset(chip8, 0, sizeof *chip8);
+    bench_render(chip8, config);
+#endif
+    free(chip8);
+    return true;
+}
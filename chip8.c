@@ -1,13 +1,76 @@
+#define _DEFAULT_SOURCE     // clock_gettime()
 #include<stdio.h>
 #include<stdlib.h>
 #include<stdbool.h>
+#include<stdint.h>
+#include<inttypes.h>
+#include<string.h>
 #include<time.h>
-#include "SDL.h"
+#if defined(__SSE2__)
+    #include<immintrin.h>
+#endif
+
+#ifdef HEADLESS
+    // headless build has no SDL at all, log errors to stderr instead
+    #define SDL_Log(...) (fprintf(stderr, __VA_ARGS__), fputc('\n', stderr))
+#else
+    #include "SDL.h"
 
 typedef struct{
     SDL_Window *window;
     SDL_Renderer *renderer;
+    SDL_Texture *texture;   // 128x64 streaming texture, one texel per chip8 pixel, lores uses the top left 64x32
+    SDL_Texture *grid[2];   // window sized overlays drawing the pixel outlines, lores and hires
+    _Alignas(16) uint64_t presented[2][128]; // display as last presented
+    bool presented_hires;
 }sdl_t;
+#endif
+
+// instruction set a machine runs, fixed when the ROM is loaded
+typedef enum {
+    MODE_CHIP8,
+    MODE_SCHIP,             // SUPER-CHIP 1.1: 128x64, scrolling, 16x16 sprites, big font
+    MODE_XOCHIP,            // XO-CHIP: SCHIP plus 64KB ram, 2 bitplanes, audio patterns
+} chip8_mode_t;
+
+// where interpreters disagree on what an opcode does, QUIRKS_MODE follows the mode
+typedef enum {
+    QUIRKS_MODE,
+    QUIRKS_CHIP8,
+    QUIRKS_SCHIP,
+    QUIRKS_XOCHIP,
+    QUIRKS_MODERN,          // what this emulator always did for CHIP-8, and most current interpreters do
+} quirk_profile_t;
+
+// one row per profile: name, profile, then whether it has each quirk
+//   vf_reset  8XY1/8XY2/8XY3 clear VF
+//   shift_vy  8XY6/8XYE shift VY into VX instead of shifting VX in place
+//   memory_i  FX55/FX65 leave I one past the last register
+//   jump_vx   BNNN is BXNN, a jump to XNN + VX instead of NNN + V0
+//   clip      sprites are cut off at the screen edges instead of wrapping around
+#define QUIRK_PROFILES(PROFILE) \
+    PROFILE(chip8,  QUIRKS_CHIP8,  true,  true,  true,  false, true)  \
+    PROFILE(schip,  QUIRKS_SCHIP,  false, false, false, true,  true)  \
+    PROFILE(xochip, QUIRKS_XOCHIP, false, true,  true,  false, false) \
+    PROFILE(modern, QUIRKS_MODERN, false, false, false, false, true)
+
+typedef struct {
+    bool vf_reset;
+    bool shift_vy;
+    bool memory_i;
+    bool jump_vx;
+    bool clip;
+} quirks_t;
+
+// the profiles as data, for the JIT and lockstep code generators
+#define QUIRKS_ENTRY(name, profile, ...) [profile] = {__VA_ARGS__},
+const quirks_t quirk_table[] = { QUIRK_PROFILES(QUIRKS_ENTRY) };
+
+// the profile a mode runs with unless told otherwise
+quirk_profile_t mode_quirks(chip8_mode_t mode){
+    return mode == MODE_CHIP8 ? QUIRKS_MODERN : QUIRKS_CHIP8 + mode;
+}
+
 typedef struct {
     uint32_t window_width;
     uint32_t window_height;
@@ -15,13 +78,62 @@ typedef struct {
     uint32_t bg_color;
     uint32_t scale_factor; // amount to scale pixels by
     uint16_t instructions_per_second; // CPU clock rate
+    bool headless;              // run without SDL as fast as possible
+    bool jit;                   // translate hot code to x86-64
+    uint64_t max_instructions;  // headless: stop after this many instructions (0 = no limit)
+    uint64_t max_frames;        // headless: stop after this many frames (0 = no limit)
+    char **roms;                // ROM paths given on the command line
+    uint32_t rom_count;
+    uint32_t seed;              // CXNN random seed
+    bool farm;                  // run every ROM headless on a thread pool
+    uint32_t threads;           // farm: worker threads (0 = one per core)
+    uint32_t instances;         // farm/lockstep: machines per ROM
+    bool lockstep;              // run instances of the first ROM on the SIMD lockstep engine
+    char *load_state;           // state file to start from instead of a fresh boot
+    char *save_state;           // state file written when the run ends
+    uint32_t rewind_seconds;    // emulated time Backspace can step back through (0 = off)
+    char *record;               // log seed and per-frame keypad to this file
+    char *replay;               // feed seed and keypad back from this recording
+    uint32_t speed;             // emulated frames per 60Hz tick (0 = as fast as possible)
+    uint32_t turbo_speed;       // same while Tab is held
+    uint32_t frameskip;         // present every Kth emulated frame (0 = once per tick)
+    uint32_t input_slices;      // parts of a real-time frame with the keyboard read before each
+    bool bench;                 // run the benchmark suite, ROMs are timed as full runs
+    char *decode_trace;         // print this trace file as text and exit (debug builds)
+    char *wav;                  // also render the beeper into this WAV file
+    bool idle;                  // jump over wait loops instead of spinning through them
+    chip8_mode_t mode;          // CHIP-8, SCHIP or XO-CHIP
+    uint32_t plane2_color;      // XO-CHIP: pixels only set on the second plane
+    uint32_t mixed_color;       // XO-CHIP: pixels set on both planes
+    char *library;              // ROM library directory, ROMs are named by file name or hash
+    bool remember;              // library: store the settings given on the command line for the ROM
+    char keys[16];              // keyboard key per keypad key 0-F, 0 = default keymap
+    quirk_profile_t quirks;     // QUIRKS_MODE = the mode's own
+    char *video;                // also export the frames to this raw/Y4M/APNG/GIF file
+    uint32_t video_scale;       // video: output pixels per display pixel
+    char *control;              // serve the control protocol on this Unix socket
+    char *aot;                  // run the ROM's blocks from this module built from --aot-emit output
+    char *aot_emit;             // write the ROM as C for --aot to this file and exit
+    uint8_t given;              // GIVEN_* settings named on the command line, they win over the library's
 } config_t;
 
+// settings a library ROM keeps, see config_t.given
+#define GIVEN_MODE 0x1
+#define GIVEN_IPS 0x2
+#define GIVEN_KEYS 0x4
+#define GIVEN_QUIRKS 0x8
+
+// clock rates --ips, recordings and the library accept: at least one instruction per frame
+#define IPS_MIN 60
+#define IPS_MAX UINT16_MAX
+
 // Emulator states
 typedef enum {
     QUIT,
     RUNNING,
     PAUSED,
+    REWINDING,
+    FAST_FORWARDING,
 } emulator_state_t;
 
 // CHIP8 Instruction format
@@ -36,29 +148,147 @@ typedef struct {
 
 } instruction_t;
 
-// CHIP8 Machine object
+typedef struct chip8 chip8_t;
+typedef struct jit jit_t;
+void jit_invalidate(jit_t *jit, uint16_t addr, uint16_t len);
+typedef struct aot aot_t;
+void aot_invalidate(aot_t *aot, uint16_t addr, uint16_t len);
+uint64_t fnv1a(const void *data, size_t size);
+typedef struct chip8_state chip8_state_t;
+typedef struct profile profile_t;
+typedef struct trace trace_t;
+void chip8_save_state(const chip8_t *chip8, chip8_state_t *state);
+void chip8_load_state(chip8_t *chip8, const chip8_state_t *state);
+bool state_valid(const chip8_state_t *state);
+
+// Instruction handler, executes chip8->inst
+typedef void (*op_handler_t)(chip8_t *chip8, const config_t *config);
+
+// Decode cache entry, one per RAM address
 typedef struct {
+    op_handler_t handler;   // NULL until the address is decoded
+    instruction_t inst;     // pre-extracted operands
+} decoded_inst_t;
+
+// CHIP8 Machine object
+struct chip8 {
     emulator_state_t state; 
-    uint8_t ram[4096];
-    bool display[64*32];    // Emulate Original Chip8 resolution pixels ON or OFF pixel 
-    uint16_t stack[12];     // subroutines 12 level of stack
-    uint16_t *stack_ptr;            // stack pointer
+    chip8_mode_t mode;
+    quirk_profile_t quirks; // picks the handlers decoding hands out, never QUIRKS_MODE
+    uint16_t ram_mask;      // 0x0FFF, or 0xFFFF for XO-CHIP's 64KB
+    uint8_t ram[65536];
+    // one packed bitmap per plane: lores rows are 1 word (64 pixels), hires rows 2 words (128 pixels),
+    // bit 63 of a row's first word = leftmost pixel; CHIP-8 and SCHIP only use plane 0
+    // 16 byte aligned like anything malloc'd, the AVX2 paths use unaligned loads
+    _Alignas(16) uint64_t display[2][128];
+    uint64_t dirty_rows;    // display rows touched since the last present, 0 = frame is clean
+    bool hires;             // SCHIP/XO-CHIP 128x64 mode, 00FF/00FE
+    uint8_t planes;         // bitplanes drawn, cleared and scrolled (XO-CHIP FN01), 1 otherwise
+    uint16_t stack[16];     // subroutines 16 level of stack
+    uint8_t stack_ptr;      // index of the next free stack slot, wraps at 16
     uint8_t V[16];          // Data registers V0-VF
     uint16_t I;             // Index register
     uint16_t PC;            // Program Counter
     uint8_t delay_timer;    // Decrements at 60 Hz when > 0 
     uint8_t sound_timer;    // Decrements at 60 Hz when > 0
     bool keypad[16];        // Hexadecimal keypad 0x0-0xF
+    uint32_t rng_state;     // CXNN random generator (xorshift32), never 0
+    uint8_t flags[16];      // SCHIP/XO-CHIP FX75/FX85 registers
+    uint8_t pattern[16];    // XO-CHIP F002 audio pattern, 128 one bit samples
+    uint8_t pitch;          // XO-CHIP FX3A, pattern rate = 4000 * 2^((pitch - 64) / 48) Hz
+    bool has_pattern;       // F002 ran, the beeper plays pattern instead of its tone
     char *rom_name;         // currently running ROM
     instruction_t inst;     // current instruction
-} chip8_t;
+    decoded_inst_t decode_cache[4096]; // decoded instructions by address, cleared on ram writes
+    decoded_inst_t decode_high; // XO-CHIP code past the first 4KB, decoded every time
+    jit_t *jit;             // recompiled blocks, NULL when running interpreted
+    aot_t *aot;             // ahead-of-time compiled blocks, NULL when none are loaded
+    uint8_t idle_period;    // set by a handler that closed a wait loop: instructions per turn
+    uint64_t idle_instructions; // instructions skipped in wait loops
+#ifdef PROFILE
+    profile_t *profile;     // hot spot counters, NULL when not profiled
+#endif
+#ifdef TRACE
+    trace_t *trace;         // instruction trace ring, NULL when not traced
+#endif
+};
 
 #ifdef DEBUG
     #include "debug.h"
 #endif
 
-// init chip8 machine
-bool init_chip8(chip8_t *chip8, char rom_name[]){
+#ifdef PROFILE
+    #include "profile.h"
+#else
+    #define PROFILE_BEGIN()
+    #define PROFILE_END(chip8, addr)
+#endif
+
+#if defined(TRACE) || defined(DEBUG)
+    #include "trace.h"
+#endif
+#ifndef TRACE
+    #define TRACE_BEGIN(chip8)
+    #define TRACE_END(chip8, addr)
+#endif
+
+#include "idle.h"
+
+// Display helpers for the packed framebuffer
+uint32_t display_width(const chip8_t *chip8){ return chip8->hires ? 128 : 64; }
+uint32_t display_height(const chip8_t *chip8){ return chip8->hires ? 64 : 32; }
+uint32_t display_row_words(const chip8_t *chip8){ return chip8->hires ? 2 : 1; }
+
+// plane bits of a pixel, bit 0 = plane 0
+uint8_t display_pixel(const chip8_t *chip8, uint32_t x, uint32_t y){
+    const uint32_t word = y * display_row_words(chip8) + x / 64;
+    const uint32_t shift = 63 - x % 64;
+    return ((chip8->display[0][word] >> shift) & 1) | (((chip8->display[1][word] >> shift) & 1) << 1);
+}
+
+// zero words of a plane, a multiple of 4
+void display_clear(uint64_t *plane, uint32_t words){
+#if defined(__AVX2__)
+    const __m256i zero = _mm256_setzero_si256();
+    for(uint32_t i = 0; i < words; i += 4){
+        _mm256_storeu_si256((__m256i *)&plane[i], zero);
+    }
+#elif defined(__SSE2__)
+    const __m128i zero = _mm_setzero_si128();
+    for(uint32_t i = 0; i < words; i += 2){
+        _mm_store_si128((__m128i *)&plane[i], zero);
+    }
+#else
+    memset(plane, 0, words * sizeof plane[0]);
+#endif
+}
+
+// compare two whole frames, both planes
+bool display_equal(const uint64_t a[2][128], const uint64_t b[2][128]){
+    const uint64_t *pa = a[0], *pb = b[0];
+#if defined(__AVX2__)
+    __m256i diff = _mm256_setzero_si256();
+    for(int i = 0; i < 256; i += 4){
+        diff = _mm256_or_si256(diff, _mm256_xor_si256(_mm256_loadu_si256((const __m256i *)&pa[i]),
+                                                      _mm256_loadu_si256((const __m256i *)&pb[i])));
+    }
+    return _mm256_testz_si256(diff, diff);
+#elif defined(__SSE2__)
+    __m128i diff = _mm_setzero_si128();
+    for(int i = 0; i < 256; i += 2){
+        diff = _mm_or_si128(diff, _mm_xor_si128(_mm_load_si128((const __m128i *)&pa[i]),
+                                                _mm_load_si128((const __m128i *)&pb[i])));
+    }
+    return _mm_movemask_epi8(_mm_cmpeq_epi8(diff, _mm_setzero_si128())) == 0xFFFF;
+#else
+    return memcmp(pa, pb, 256 * sizeof pa[0]) == 0;
+#endif
+}
+
+#define BIG_FONT 0x50     // FX30 digits, 10 bytes each
+
+// init chip8 machine from a ROM image already in memory
+bool load_chip8(chip8_t *chip8, const uint8_t *rom, size_t rom_size, char rom_name[], chip8_mode_t mode){
     const uint32_t entry_point = 0x200;  // CHIP8 ROM will be loaded to 0x200
     const uint8_t font[] = {
         0xF0, 0x90, 0x90, 0x90, 0xF0, // 0
@@ -78,37 +308,120 @@ bool init_chip8(chip8_t *chip8, char rom_name[]){
         0xF0, 0x80, 0xF0, 0x80, 0xF0, // E
         0xF0, 0x80, 0xF0, 0x80, 0x80  // F
     };
+    // SCHIP/XO-CHIP 8x10 digits for FX30, right after the small font
+    const uint8_t big_font[] = {
+        0x3C, 0x7E, 0xE7, 0xC3, 0xC3, 0xC3, 0xC3, 0xE7, 0x7E, 0x3C, // 0
+        0x18, 0x38, 0x58, 0x18, 0x18, 0x18, 0x18, 0x18, 0x18, 0x3C, // 1
+        0x3E, 0x7F, 0xC3, 0x06, 0x0C, 0x18, 0x30, 0x60, 0xFF, 0xFF, // 2
+        0x3C, 0x7E, 0xC3, 0x03, 0x0E, 0x0E, 0x03, 0xC3, 0x7E, 0x3C, // 3
+        0x06, 0x0E, 0x1E, 0x36, 0x66, 0xC6, 0xFF, 0xFF, 0x06, 0x06, // 4
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFC, 0xFE, 0x03, 0xC3, 0x7E, 0x3C, // 5
+        0x3E, 0x7C, 0xC0, 0xC0, 0xFC, 0xFE, 0xC3, 0xC3, 0x7E, 0x3C, // 6
+        0xFF, 0xFF, 0x03, 0x06, 0x0C, 0x18, 0x30, 0x60, 0x60, 0x60, // 7
+        0x3C, 0x7E, 0xC3, 0xC3, 0x7E, 0x7E, 0xC3, 0xC3, 0x7E, 0x3C, // 8
+        0x3C, 0x7E, 0xC3, 0xC3, 0x7F, 0x3F, 0x03, 0x03, 0x3E, 0x7C, // 9
+        0x3C, 0x7E, 0xC3, 0xC3, 0xFF, 0xFF, 0xC3, 0xC3, 0xC3, 0xC3, // A
+        0xFC, 0xFE, 0xC3, 0xC3, 0xFE, 0xFE, 0xC3, 0xC3, 0xFE, 0xFC, // B
+        0x3C, 0x7E, 0xC3, 0xC0, 0xC0, 0xC0, 0xC0, 0xC3, 0x7E, 0x3C, // C
+        0xFC, 0xFE, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xC3, 0xFE, 0xFC, // D
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFE, 0xFE, 0xC0, 0xC0, 0xFF, 0xFF, // E
+        0xFF, 0xFF, 0xC0, 0xC0, 0xFE, 0xFE, 0xC0, 0xC0, 0xC0, 0xC0  // F
+    };
     // load font 
     memcpy(&chip8->ram[0], font, sizeof(font));
+    if(mode != MODE_CHIP8) memcpy(&chip8->ram[BIG_FONT], big_font, sizeof(big_font));
+
+    chip8->mode = mode;
+    chip8->quirks = mode_quirks(mode);
+    chip8->ram_mask = mode == MODE_XOCHIP ? 0xFFFF : 0x0FFF;
+    chip8->planes = 1;
 
-    // Open ROM file
-    FILE *rom = fopen(rom_name, "rb");
-    if(rom == NULL){
-        SDL_Log("Unable to open ROM: %s", rom_name);
-        return 0;
-    }
     // Check ROM size
-    fseek(rom, 0, SEEK_END);
-    const size_t rom_size = ftell(rom);
-    const size_t max_size = sizeof chip8->ram - entry_point;
-    rewind(rom);
-    
+    const size_t max_size = chip8->ram_mask + 1 - entry_point;
     if(rom_size > max_size){
         SDL_Log("ROM too large: %s", rom_name);
-        fclose(rom);
         return 0;
     }
 
-    fread(&chip8->ram[entry_point], rom_size, 1, rom);
+    memcpy(&chip8->ram[entry_point], rom, rom_size);
 
-    fclose(rom);
+    // drop anything decoded from a previously loaded ROM
+    memset(chip8->decode_cache, 0, sizeof chip8->decode_cache);
     // set machine defaults 
     chip8->state = RUNNING;
     chip8->PC = entry_point;
     chip8->rom_name = rom_name;
-    chip8->stack_ptr = &chip8->stack[0];
+    chip8->stack_ptr = 0;
+    chip8->dirty_rows = ~0ULL;
     return 1;
 }
+
+// init chip8 machine from a ROM file
+bool init_chip8(chip8_t *chip8, char rom_name[], chip8_mode_t mode){
+    // Open ROM file
+    FILE *rom = fopen(rom_name, "rb");
+    if(rom == NULL){
+        SDL_Log("Unable to open ROM: %s", rom_name);
+        return 0;
+    }
+
+    // read one byte more than ram holds so load_chip8 sees oversized ROMs
+    uint8_t data[sizeof chip8->ram + 1];
+    const size_t rom_size = fread(data, 1, sizeof data, rom);
+    fclose(rom);
+
+    return load_chip8(chip8, data, rom_size, rom_name, mode);
+}
+
+// run with another profile than the mode's own, before the first instruction
+void chip8_set_quirks(chip8_t *chip8, quirk_profile_t quirks){
+    if(quirks == QUIRKS_MODE) return;
+    chip8->quirks = quirks;
+    memset(chip8->decode_cache, 0, sizeof chip8->decode_cache);
+}
+#ifndef HEADLESS
+// config colors are RGBA, textures are ARGB
+uint32_t rgba_to_argb(uint32_t color){
+    return (color >> 8) | (color << 24);
+}
+
+// for pixelated effect: background colored outline around every pixel of a columns wide display, transparent inside
+SDL_Texture *init_grid(sdl_t *sdl, const config_t config, uint32_t columns){
+    const uint32_t width = config.window_width * config.scale_factor;
+    const uint32_t height = config.window_height * config.scale_factor;
+    const uint32_t cell = width / columns;     // the window is 2:1 like both resolutions
+    uint32_t *pixels = calloc(width * height, sizeof(uint32_t));
+    if(pixels == NULL){
+        SDL_Log("Unable to allocate pixel grid");
+        return NULL;
+    }
+
+    const uint32_t outline = rgba_to_argb(config.bg_color) | 0xFF000000;
+    for(uint32_t y = 0; y < height; y++){
+        for(uint32_t x = 0; x < width; x++){
+            const uint32_t cell_x = x % cell;
+            const uint32_t cell_y = y % cell;
+            if(cell_x == 0 || cell_y == 0 || cell_x == cell - 1 || cell_y == cell - 1){
+                pixels[y * width + x] = outline;
+            }
+        }
+    }
+
+    SDL_Texture *grid = SDL_CreateTexture(
+        sdl->renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STATIC, width, height
+    );
+    if(grid == NULL){
+        SDL_Log("Unable to create grid texture: %s", SDL_GetError());
+        free(pixels);
+        return NULL;
+    }
+    SDL_UpdateTexture(grid, NULL, pixels, width * sizeof(uint32_t));
+    SDL_SetTextureBlendMode(grid, SDL_BLENDMODE_BLEND);
+    free(pixels);
+
+    return grid;
+}
+
 bool init_sdl(sdl_t *sdl, const config_t config){
     if (SDL_Init(SDL_INIT_VIDEO | SDL_INIT_AUDIO | SDL_INIT_TIMER) != 0) {
         SDL_Log("Unable to initialize SDL: %s", SDL_GetError());
@@ -137,8 +450,25 @@ bool init_sdl(sdl_t *sdl, const config_t config){
         return false;
     }
 
+    // chip8 pixels are scaled up by the GPU, keep them sharp
+    SDL_SetHint(SDL_HINT_RENDER_SCALE_QUALITY, "0");
+
+    sdl->texture = SDL_CreateTexture(
+        sdl->renderer, SDL_PIXELFORMAT_ARGB8888, SDL_TEXTUREACCESS_STREAMING,
+        128, 64
+    );
+    if(sdl->texture == NULL){
+        SDL_Log("Unable to create texture: %s", SDL_GetError());
+        return false;
+    }
+
+    sdl->grid[0] = init_grid(sdl, config, 64);
+    sdl->grid[1] = init_grid(sdl, config, 128);
+    if(sdl->grid[0] == NULL || sdl->grid[1] == NULL) return false;
+
     return true;
 }
+#endif
 // set up emulator config from arguments
 bool set_config_from_args(config_t *config, int argc, char *argv[]){
     // set defaults
@@ -148,15 +478,191 @@ bool set_config_from_args(config_t *config, int argc, char *argv[]){
         .fg_color = 0xFFFFFFFF,       //foreground color (WHITE)
         .bg_color = 0x00000000,       //background color
         .scale_factor = 20,         // 1280*640 now
-        .instructions_per_second = 500 // CPU clock rate
+        .instructions_per_second = 500, // CPU clock rate
+        .seed = time(NULL),
+        .instances = 1,
+        .rewind_seconds = 10,
+        .speed = 1,
+        .turbo_speed = 0,
+        .input_slices = 4,
+        .idle = true,
+        .mode = MODE_CHIP8,
+        .plane2_color = 0x808080FF,   // XO-CHIP second plane (GREY)
+        .mixed_color = 0xC0C0C0FF,    // XO-CHIP both planes (LIGHT GREY)
+        .video_scale = 4,
     };
 
-    return true;
+    config->roms = calloc(argc, sizeof(char *));
+    if(config->roms == NULL) return false;
+
+#ifdef HEADLESS
+    config->headless = true;
+#endif
+
+    for(int i = 1; i < argc; i++){
+        if(argv[i][0] != '-'){
+            config->roms[config->rom_count++] = argv[i];
+        }
+        else if(strcmp(argv[i], "--headless") == 0){
+            config->headless = true;
+        }
+        else if(strcmp(argv[i], "--jit") == 0){
+            config->jit = true;
+        }
+        else if(strcmp(argv[i], "--frames") == 0 && i + 1 < argc){
+            config->max_frames = strtoull(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--instructions") == 0 && i + 1 < argc){
+            config->max_instructions = strtoull(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--seed") == 0 && i + 1 < argc){
+            config->seed = strtoul(argv[++i], NULL, 0);
+        }
+        else if(strcmp(argv[i], "--farm") == 0){
+            config->farm = true;
+            config->headless = true;
+        }
+        else if(strcmp(argv[i], "--lockstep") == 0){
+            config->lockstep = true;
+            config->headless = true;
+        }
+        else if(strcmp(argv[i], "--load-state") == 0 && i + 1 < argc){
+            config->load_state = argv[++i];
+        }
+        else if(strcmp(argv[i], "--save-state") == 0 && i + 1 < argc){
+            config->save_state = argv[++i];
+        }
+        else if(strcmp(argv[i], "--rewind") == 0 && i + 1 < argc){
+            config->rewind_seconds = strtoul(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--record") == 0 && i + 1 < argc){
+            config->record = argv[++i];
+        }
+        else if(strcmp(argv[i], "--replay") == 0 && i + 1 < argc){
+            config->replay = argv[++i];
+        }
+        else if(strcmp(argv[i], "--speed") == 0 && i + 1 < argc){
+            config->speed = strtoul(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--turbo") == 0 && i + 1 < argc){
+            config->turbo_speed = strtoul(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--frameskip") == 0 && i + 1 < argc){
+            config->frameskip = strtoul(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--input-slices") == 0 && i + 1 < argc){
+            config->input_slices = strtoul(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--no-idle") == 0){
+            config->idle = false;
+        }
+        else if(strcmp(argv[i], "--bench") == 0){
+            config->bench = true;
+            config->headless = true;
+        }
+        else if(strcmp(argv[i], "--decode-trace") == 0 && i + 1 < argc){
+            config->decode_trace = argv[++i];
+        }
+        else if(strcmp(argv[i], "--wav") == 0 && i + 1 < argc){
+            config->wav = argv[++i];
+        }
+        else if(strcmp(argv[i], "--video") == 0 && i + 1 < argc){
+            config->video = argv[++i];
+        }
+        else if(strcmp(argv[i], "--video-scale") == 0 && i + 1 < argc){
+            config->video_scale = strtoul(argv[++i], NULL, 10);
+            if(config->video_scale < 1 || config->video_scale > 16){
+                fprintf(stderr, "--video-scale must be 1 to 16\n");
+                return false;
+            }
+        }
+        else if(strcmp(argv[i], "--threads") == 0 && i + 1 < argc){
+            config->threads = strtoul(argv[++i], NULL, 10);
+        }
+        else if(strcmp(argv[i], "--mode") == 0 && i + 1 < argc){
+            i++;
+            if(strcmp(argv[i], "chip8") == 0) config->mode = MODE_CHIP8;
+            else if(strcmp(argv[i], "schip") == 0) config->mode = MODE_SCHIP;
+            else if(strcmp(argv[i], "xochip") == 0) config->mode = MODE_XOCHIP;
+            else{
+                fprintf(stderr, "Unknown mode: %s (chip8, schip or xochip)\n", argv[i]);
+                return false;
+            }
+            config->given |= GIVEN_MODE;
+        }
+        else if(strcmp(argv[i], "--quirks") == 0 && i + 1 < argc){
+            i++;
+            if(strcmp(argv[i], "chip8") == 0) config->quirks = QUIRKS_CHIP8;
+            else if(strcmp(argv[i], "schip") == 0) config->quirks = QUIRKS_SCHIP;
+            else if(strcmp(argv[i], "xochip") == 0) config->quirks = QUIRKS_XOCHIP;
+            else if(strcmp(argv[i], "modern") == 0) config->quirks = QUIRKS_MODERN;
+            else{
+                fprintf(stderr, "Unknown quirk profile: %s (chip8, schip, xochip or modern)\n", argv[i]);
+                return false;
+            }
+            config->given |= GIVEN_QUIRKS;
+        }
+        else if(strcmp(argv[i], "--ips") == 0 && i + 1 < argc){
+            const unsigned long ips = strtoul(argv[++i], NULL, 10);
+            if(ips < IPS_MIN || ips > IPS_MAX){
+                fprintf(stderr, "--ips must be between %u and %u\n", IPS_MIN, IPS_MAX);
+                return false;
+            }
+            config->instructions_per_second = ips;
+            config->given |= GIVEN_IPS;
+        }
+        else if(strcmp(argv[i], "--keys") == 0 && i + 1 < argc){
+            // one keyboard key per keypad key, in keypad order 0-F
+            if(strlen(argv[++i]) != 16){
+                fprintf(stderr, "--keys needs 16 keys, for keypad keys 0-F in order\n");
+                return false;
+            }
+            memcpy(config->keys, argv[i], sizeof config->keys);
+            config->given |= GIVEN_KEYS;
+        }
+        else if(strcmp(argv[i], "--library") == 0 && i + 1 < argc){
+            config->library = argv[++i];
+        }
+        else if(strcmp(argv[i], "--remember") == 0){
+            config->remember = true;
+        }
+        else if(strcmp(argv[i], "--aot") == 0 && i + 1 < argc){
+            config->aot = argv[++i];
+        }
+        else if(strcmp(argv[i], "--aot-emit") == 0 && i + 1 < argc){
+            config->aot_emit = argv[++i];
+        }
+        else if(strcmp(argv[i], "--control") == 0 && i + 1 < argc){
+            config->control = argv[++i];
+            config->headless = true;
+        }
+        else if(strcmp(argv[i], "--instances") == 0 && i + 1 < argc){
+            config->instances = strtoul(argv[++i], NULL, 10);
+            if(config->instances == 0) config->instances = 1;
+        }
+        else{
+            fprintf(stderr, "Unknown option: %s\n", argv[i]);
+            return false;
+        }
+    }
+
+    if(config->rom_count == 0 && !config->bench && !config->decode_trace && !config->library && !config->control){
+        fprintf(stderr, "No ROM given\n");
+        return false;
+    }
+
+    // headless runs need an end, default to 10 seconds of emulated time (a replay ends with its recording)
+    if(config->headless && !config->replay && !config->max_frames && !config->max_instructions){
+        config->max_frames = 600;
+    }
 
-    (void) argc;
-    (void) argv;
+    return true;
 }
+#ifndef HEADLESS
 void final_cleanup(sdl_t *sdl){
+    SDL_DestroyTexture(sdl->grid[0]);
+    SDL_DestroyTexture(sdl->grid[1]);
+    SDL_DestroyTexture(sdl->texture);
     SDL_DestroyWindow(sdl->window);
     SDL_DestroyRenderer(sdl->renderer);
     SDL_Quit();
@@ -171,52 +677,83 @@ void clear_screen(sdl_t *sdl, config_t config){
 
     SDL_SetRenderDrawColor(sdl->renderer, r, g, b, a);
     SDL_RenderClear(sdl->renderer);
+    SDL_RenderPresent(sdl->renderer);
 }
 // update screen with current state
-
+// expand the packed display into the streaming texture, then let the GPU scale it in one copy
+// only rows touched by 00E0/DXYN/scrolls are uploaded, clean frames are never presented again
 void update_screen(sdl_t *sdl, const config_t config, chip8_t *chip8){
+    const uint32_t width = display_width(chip8);
+    const uint32_t height = display_height(chip8);
+    const uint32_t words = display_row_words(chip8);
+    const uint64_t dirty = chip8->dirty_rows & (~0ULL >> (64 - height));
+    chip8->dirty_rows = 0;
+    if(dirty == 0) return;
+
+    // redrawn but identical (e.g. clear + redraw every frame), nothing to present
+    if(chip8->hires == sdl->presented_hires && display_equal(chip8->display, sdl->presented)) return;
+
+    // lock the span from the first to the last dirty row
+    const int first = __builtin_ctzll(dirty);
+    const int last = 63 - __builtin_clzll(dirty);
+    const SDL_Rect span = {0, first, width, last - first + 1};
+
+    void *pixels;
+    int pitch;
+    if(SDL_LockTexture(sdl->texture, &span, &pixels, &pitch) != 0){
+        SDL_Log("Unable to lock texture: %s", SDL_GetError());
+        return;
+    }
 
-    // (void) chip8;
-    // (void) config;
-    SDL_Rect rect = {0, 0, config.scale_factor, config.scale_factor};
-    // colors to draw
-    const uint8_t fg_r  = config.fg_color >> 24;
-    const uint8_t fg_g  = config.fg_color >> 16;
-    const uint8_t fg_b  = config.fg_color >> 8;
-    const uint8_t fg_a  = config.fg_color >> 0;
-
-    const uint8_t bg_r  = config.bg_color >> 24;
-    const uint8_t bg_g  = config.bg_color >> 16;
-    const uint8_t bg_b  = config.bg_color >> 8;
-    const uint8_t bg_a  = config.bg_color >> 0;
-
-    // loop through display pixels, draw a rectangle per pixel to the SDL window
-    for(u_int32_t i = 0; i < sizeof chip8->display; i++){
-        rect.x = i % config.window_width * config.scale_factor;
-        rect.y = i / config.window_width * config.scale_factor;
-        if(chip8->display[i]){
-            SDL_SetRenderDrawColor(sdl->renderer, fg_r, fg_g, fg_b, fg_a);
-            SDL_RenderFillRect(sdl->renderer, &rect);
-
-            // for pixelated effect
-            SDL_SetRenderDrawColor(sdl->renderer, bg_r, bg_g, bg_b, bg_a);
-            SDL_RenderDrawRect(sdl->renderer, &rect);
-        }
-        else{
-            SDL_SetRenderDrawColor(sdl->renderer, bg_r, bg_g, bg_b, bg_a);
-            SDL_RenderFillRect(sdl->renderer, &rect);
+    // plane bits -> color: neither, plane 0, plane 1, both
+    const uint32_t palette[4] = {
+        rgba_to_argb(config.bg_color), rgba_to_argb(config.fg_color),
+        rgba_to_argb(config.plane2_color), rgba_to_argb(config.mixed_color),
+    };
+    // locked pixels are write-only, every row in the span is written
+    for(int y = first; y <= last; y++){
+        uint32_t *line = (uint32_t *)((uint8_t *)pixels + (y - first) * pitch);
+        for(uint32_t w = 0; w < words; w++, line += 64){
+            const uint64_t plane0 = chip8->display[0][y * words + w];
+            const uint64_t plane1 = chip8->display[1][y * words + w];
+            for(uint32_t x = 0; x < 64; x++){
+                line[x] = palette[((plane0 >> (63 - x)) & 1) | (((plane1 >> (63 - x)) & 1) << 1)];
+            }
         }
     }
+    SDL_UnlockTexture(sdl->texture);
+    memcpy(sdl->presented, chip8->display, sizeof sdl->presented);
+    sdl->presented_hires = chip8->hires;
+
+    const SDL_Rect visible = {0, 0, width, height};
+    SDL_RenderCopy(sdl->renderer, sdl->texture, &visible, NULL);
+    SDL_RenderCopy(sdl->renderer, sdl->grid[chip8->hires], NULL, NULL);
     SDL_RenderPresent(sdl->renderer);
 }
 
-// handle user input
 // chip8 keypad     mapped to 
 // 123D             1234
-// 456C             qwert        
+// 456C             qwer
 // 789B             asdf
 // A0BF             zxcv
-void handle_input(chip8_t *chip8){
+SDL_Keycode keymap[16] = {
+    SDLK_x, SDLK_1, SDLK_2, SDLK_3,     // 0 1 2 3
+    SDLK_q, SDLK_w, SDLK_e, SDLK_a,     // 4 5 6 7
+    SDLK_s, SDLK_d, SDLK_z, SDLK_c,     // 8 9 A B
+    SDLK_4, SDLK_r, SDLK_f, SDLK_v,     // C D E F
+};
+
+// chip8 key bound to a keyboard key, -1 if none
+int keymap_lookup(SDL_Keycode sym){
+    for(int key = 0; key < 16; key++){
+        if(keymap[key] == sym) return key;
+    }
+    return -1;
+}
+
+// handle user input, keypad keys through keymap[]
+// F5 saves to the quick save slot, F7 restores it, holding Backspace rewinds, holding Tab fast-forwards
+void handle_input(chip8_t *chip8, chip8_state_t *quick_save){
     SDL_Event event;
     
     while(SDL_PollEvent(&event)){
@@ -238,51 +775,44 @@ void handle_input(chip8_t *chip8){
                         }
                         else chip8->state = RUNNING;
                         return;
-                    case SDLK_1: chip8->keypad[0x1] = true; break;
-                    case SDLK_2: chip8->keypad[0x2] = true; break;
-                    case SDLK_3: chip8->keypad[0x3] = true; break;
-                    case SDLK_4: chip8->keypad[0xC] = true; break;
-
-                    case SDLK_q: chip8->keypad[0x4] = true; break;
-                    case SDLK_w: chip8->keypad[0x5] = true; break;
-                    case SDLK_e: chip8->keypad[0x6] = true; break;
-                    case SDLK_r: chip8->keypad[0xD] = true; break;
-
-                    case SDLK_a: chip8->keypad[0x7] = true; break;
-                    case SDLK_s: chip8->keypad[0x8] = true; break;
-                    case SDLK_d: chip8->keypad[0x9] = true; break;
-                    case SDLK_f: chip8->keypad[0xE] = true; break;
-
-                    case SDLK_z: chip8->keypad[0xA] = true; break;
-                    case SDLK_x: chip8->keypad[0x0] = true; break;
-                    case SDLK_c: chip8->keypad[0xB] = true; break;
-                    case SDLK_v: chip8->keypad[0xF] = true; break;
-
-                    default:
+                    case SDLK_F5:
+                        if(quick_save == NULL) break;   // off while recording or replaying
+                        chip8_save_state(chip8, quick_save);
+                        printf("State saved\n");
+                        break;
+                    case SDLK_BACKSPACE:
+                        if(chip8->state == RUNNING) chip8->state = REWINDING;
                         break;
+                    case SDLK_TAB:
+                        if(chip8->state == RUNNING) chip8->state = FAST_FORWARDING;
+                        break;
+                    case SDLK_F7:
+                        if(quick_save && state_valid(quick_save)){
+                            chip8_load_state(chip8, quick_save);
+                            printf("State loaded\n");
+                        }
+                        break;
+                    default:{
+                        const int key = keymap_lookup(event.key.keysym.sym);
+                        if(key >= 0) chip8->keypad[key] = true;
+                        break;
+                    }
                 }
                 break;
             case SDL_KEYUP:
                 switch(event.key.keysym.sym){
-                    case SDLK_1: chip8->keypad[0x1] = false; break;
-                    case SDLK_2: chip8->keypad[0x2] = false; break;
-                    case SDLK_3: chip8->keypad[0x3] = false; break;
-                    case SDLK_4: chip8->keypad[0xC] = false; break;
-
-                    case SDLK_q: chip8->keypad[0x4] = false; break;
-                    case SDLK_w: chip8->keypad[0x5] = false; break;
-                    case SDLK_e: chip8->keypad[0x6] = false; break;
-                    case SDLK_r: chip8->keypad[0xD] = false; break;
-                    
-                    case SDLK_a: chip8->keypad[0x7] = false; break;
-                    case SDLK_s: chip8->keypad[0x8] = false; break;
-                    case SDLK_d: chip8->keypad[0x9] = false; break;
-                    case SDLK_f: chip8->keypad[0xE] = false; break;
-
-                    case SDLK_z: chip8->keypad[0xA] = false; break;
-                    case SDLK_x: chip8->keypad[0x0] = false; break;
-                    case SDLK_c: chip8->keypad[0xB] = false; break;
-                    case SDLK_v: chip8->keypad[0xF] = false; break;
+                    case SDLK_BACKSPACE:
+                        if(chip8->state == REWINDING) chip8->state = RUNNING;
+                        break;
+                    case SDLK_TAB:
+                        if(chip8->state == FAST_FORWARDING) chip8->state = RUNNING;
+                        break;
+
+                    default:{
+                        const int key = keymap_lookup(event.key.keysym.sym);
+                        if(key >= 0) chip8->keypad[key] = false;
+                        break;
+                    }
                 }
                 break;
 
@@ -292,353 +822,1073 @@ void handle_input(chip8_t *chip8){
         }
     }
 }
-// Emulate 1 Chip8 instruction
-void emulate_instruction(chip8_t *chip8, config_t config){
-    // fetch instruction from ram
-    chip8->inst.opcode = (chip8->ram[chip8->PC] << 8) | chip8->ram[chip8->PC + 1];
-    chip8->PC += 2;
-    // fill out current instruction format
-    chip8->inst.NNN = chip8->inst.opcode & 0x0FFF;
-    chip8->inst.NN = chip8->inst.opcode & 0x0FF;
-    chip8->inst.N = chip8->inst.opcode & 0x0F;
-    chip8->inst.X = (chip8->inst.opcode >> 8) & 0x0F;
-    chip8->inst.Y = (chip8->inst.opcode >> 4) & 0x0F;
-
-#ifdef DEBUG
-    print_debug_info(chip8);
 #endif
+// per machine random numbers so instances never share or contend on rand()
+void chip8_seed(chip8_t *chip8, uint32_t seed){
+    // scramble so consecutive seeds give unrelated sequences, xorshift must not start at 0
+    seed = (seed ^ 0x9E3779B9) * 0x85EBCA6B;
+    chip8->rng_state = (seed ^ (seed >> 13)) | 1;
+}
 
+uint8_t chip8_rand(chip8_t *chip8){
+    uint32_t x = chip8->rng_state;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    chip8->rng_state = x;
+    return x >> 24;
+}
 
-    // decode instruction
-    switch ((chip8->inst.opcode >> 12) & 0x0F){
-        case 0x0:
-            if(chip8->inst.NN == 0xE0){
-                // clear screen (0x00E0)
-                memset(&chip8->display[0], 0, sizeof(chip8->display));
-            }
-            else if(chip8->inst.NN == 0xEE){
-                // return from subroutine (0x00EE)
-                // set pc to last address on subroutine stack ("pop" from stack)
-                chip8->PC = *--chip8->stack_ptr;
-            }
-            break;
+// ram[addr, addr+len) was written, drop every cached instruction overlapping it
+// (an instruction at addr-1 has its low byte at addr)
+void invalidate_decoded(chip8_t *chip8, uint16_t addr, uint16_t len){
+    for(uint32_t i = 0; i <= len; i++){
+        const uint16_t at = (addr - 1 + i) & chip8->ram_mask;
+        if(at < 4096) chip8->decode_cache[at].handler = NULL;
+    }
+    if(chip8->jit){
+        jit_invalidate(chip8->jit, addr, len);
+    }
+    if(chip8->aot){
+        aot_invalidate(chip8->aot, addr, len);
+    }
+}
 
-        case 0x1:
-            // jump to address (0x1NNN)
-            chip8->PC = chip8->inst.NNN;
-            break;
-        
-        case 0x2:
-            // call subroutine (0x2NNN)
-            // push current address to return to on subroutine stack
-            // set pc to subroutine address so that next opcode is gotten from there
-            *chip8->stack_ptr++ = chip8->PC; 
-            chip8->PC = chip8->inst.NNN;
-            break;
-        
-        case 0x3:
-            // skip next instruction if V[x] == NN (0x3XNN)
-            if(chip8->V[chip8->inst.X] == chip8->inst.NN){
-                chip8->PC += 2;
-            }
-            break;
+// Instruction handlers, one per opcode
+// each one executes chip8->inst, PC already points at the next instruction
 
-        case 0x4:
-            // skip next instruction if V[x] != NN (0x4XNN)
-            if(chip8->V[chip8->inst.X] != chip8->inst.NN){
-                chip8->PC += 2;
-            }
-            break;
-        
-        case 0x5:
-            // skip next instruction if V[x] == V[y] (0x5XY0)
-            
-            if(chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y]){
-                chip8->PC += 2;
-            }
-            break;
-        
-        case 0x6:
-            // set V[x] = NN  (0x6XNN)
-            chip8->V[chip8->inst.X] = chip8->inst.NN;
-            break;
+// unknown/unimplemented opcodes do nothing
+void op_nop(chip8_t *chip8, const config_t *config){
+    (void) chip8;
+    (void) config;
+}
 
-        case 0x7:
-            // v[x] += NN
-            chip8->V[chip8->inst.X] += chip8->inst.NN;
-            break;
+void op_00E0(chip8_t *chip8, const config_t *config){
+    // clear screen (0x00E0), XO-CHIP only clears the selected planes
+    for(uint8_t plane = 0; plane < 2; plane++){
+        if(chip8->planes & (1 << plane)){
+            display_clear(chip8->display[plane], display_height(chip8) * display_row_words(chip8));
+        }
+    }
+    chip8->dirty_rows = ~0ULL;
+    (void) config;
+}
 
-        case 0x8:
-            switch(chip8->inst.N){
-                case 0x0:
-                    // set V[x] = V[y] (0x8XY0)
-                    chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
-                    break;
-                case 0x1:
-                    // set V[x] = V[x] | V[y] (0x8XY1)
-                    chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
-                    break;
-                case 0x2:
-                    // set V[x] = V[x] & V[y] (0x8XY2)
-                    chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
-                    break;
-                case 0x3:
-                    // set V[x] = V[x] ^ V[y] (0x8XY3)
-                    chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
-                    break;
-                case 0x4:
-                    // set V[x] = V[x] + V[y] (0x8XY4) set v[f] = 1 if carry
-                    // if((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255)
-                    //     chip8->V[0xF] = 1;
-
-                    chip8->V[0xF] = (chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255 ? 1 : 0;
-                    
-                    chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
-                    break;
-                case 0x5:
-                    // set V[x] = V[x] - V[y] (0x8XY5) set v[f] = 1 if no borrow (positive result)
-                    // if(chip8->V[chip8->inst.X] >= chip8->V[chip8->inst.Y])
-                    //     chip8->V[0xF] = 1;
-
-                    chip8->V[0xF] = chip8->V[chip8->inst.X] >= chip8->V[chip8->inst.Y] ? 1 : 0;
-                    
-                    chip8->V[chip8->inst.X] -= chip8->V[chip8->inst.Y];
-                    break;
-                case 0x6:
-                    // set V[x] = V[x] >> 1 (0x8XY6) set v[f] = least significant bit of V[x]
-                    chip8->V[0xF] = chip8->V[chip8->inst.X] & 1;
-                    chip8->V[chip8->inst.X] >>= 1;
-                    break;
-                case 0x7:
-                    // set V[x] = V[y] - V[x] (0x8XY7) set v[f] = 1 if no borrow (positive result)
-                    // if(chip8->V[chip8->inst.Y] >= chip8->V[chip8->inst.X])
-                    //     chip8->V[0xF] = 1;
-
-                    chip8->V[0xF] = chip8->V[chip8->inst.Y] >= chip8->V[chip8->inst.X] ? 1 : 0;
-
-                    chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
-                    break;
-                case 0xE:
-                    // set V[x] = V[x] << 1 (0x8XYE) set v[f] = most significant bit of V[x]
-                    chip8->V[0xF] = (chip8->V[chip8->inst.X] & 0x80) >> 7;
-                    chip8->V[chip8->inst.X] <<= 1;
-                    break;
-                
-                default:
-                    break;
+// move the selected planes rows down (or up when negative), rows scrolled in are blank
+void display_scroll_rows(chip8_t *chip8, int rows){
+    const uint32_t words = display_row_words(chip8);
+    const uint32_t total = display_height(chip8) * words;
+    const uint32_t moved = (rows < 0 ? -rows : rows) * words;
+    if(moved > total) return;
+    for(uint8_t plane = 0; plane < 2; plane++){
+        if(!(chip8->planes & (1 << plane))) continue;
+        uint64_t *bits = chip8->display[plane];
+        if(rows > 0){
+            memmove(bits + moved, bits, (total - moved) * sizeof bits[0]);
+            memset(bits, 0, moved * sizeof bits[0]);
+        }
+        else{
+            memmove(bits, bits + moved, (total - moved) * sizeof bits[0]);
+            memset(bits + total - moved, 0, moved * sizeof bits[0]);
+        }
+    }
+    chip8->dirty_rows = ~0ULL;
+}
+
+// the row layout depends on the resolution, switching starts from a blank screen
+void display_set_hires(chip8_t *chip8, bool hires){
+    chip8->hires = hires;
+    display_clear(chip8->display[0], 128);
+    display_clear(chip8->display[1], 128);
+    chip8->dirty_rows = ~0ULL;
+}
+
+void op_00CN(chip8_t *chip8, const config_t *config){
+    // scroll down N rows (SCHIP 0x00CN)
+    display_scroll_rows(chip8, chip8->inst.N);
+    (void) config;
+}
+
+void op_00DN(chip8_t *chip8, const config_t *config){
+    // scroll up N rows (XO-CHIP 0x00DN)
+    display_scroll_rows(chip8, -chip8->inst.N);
+    (void) config;
+}
+
+void op_00FB(chip8_t *chip8, const config_t *config){
+    // scroll right 4 pixels (SCHIP 0x00FB), hires rows carry bits from the left word into the right one
+    const uint32_t words = display_row_words(chip8);
+    for(uint8_t plane = 0; plane < 2; plane++){
+        if(!(chip8->planes & (1 << plane))) continue;
+        for(uint32_t y = 0; y < display_height(chip8); y++){
+            uint64_t *row = &chip8->display[plane][y * words];
+            if(words == 2) row[1] = row[1] >> 4 | row[0] << 60;
+            row[0] >>= 4;
+        }
+    }
+    chip8->dirty_rows = ~0ULL;
+    (void) config;
+}
+
+void op_00FC(chip8_t *chip8, const config_t *config){
+    // scroll left 4 pixels (SCHIP 0x00FC)
+    const uint32_t words = display_row_words(chip8);
+    for(uint8_t plane = 0; plane < 2; plane++){
+        if(!(chip8->planes & (1 << plane))) continue;
+        for(uint32_t y = 0; y < display_height(chip8); y++){
+            uint64_t *row = &chip8->display[plane][y * words];
+            row[0] <<= 4;
+            if(words == 2){
+                row[0] |= row[1] >> 60;
+                row[1] <<= 4;
             }
-            break;
+        }
+    }
+    chip8->dirty_rows = ~0ULL;
+    (void) config;
+}
 
-        case 0x9:
-            // skip next instruction if V[x] != V[y] (0x9XY0)
-            if(chip8->V[chip8->inst.X] != chip8->V[chip8->inst.Y])
-                chip8->PC += 2;
-            break;
+void op_00FD(chip8_t *chip8, const config_t *config){
+    // exit the interpreter (SCHIP 0x00FD)
+    chip8->state = QUIT;
+    (void) config;
+}
 
-        case 0xA:
-            // set index register (0xANNN)
-            chip8->I = chip8->inst.NNN;
-            break;
-        
-        case 0xB:
-            // jump to address NNN + V[0] (0xBNNN)
-            chip8->PC = chip8->inst.NNN + chip8->V[0];
-            break;
+void op_00FE(chip8_t *chip8, const config_t *config){
+    // 64x32 lores mode (SCHIP 0x00FE)
+    display_set_hires(chip8, false);
+    (void) config;
+}
 
-        case 0xC:
-            // set V[x] = random byte AND NN (0xCXNN)
-            chip8->V[chip8->inst.X] = (rand() % 256) & chip8->inst.NN;
-            break;
-            
-        case 0xD:
-            // draw sprite (0xDXYN) Draw N-Height at coords X, Y : Read from memory loc I;
-            // screen pixels are XOR'd with sprite pixels
-            // VF (Carry Flag) is set if any pixels were erased
-
-            uint8_t X_coord = chip8->V[chip8->inst.X] % config.window_width;
-            uint8_t Y_coord = chip8->V[chip8->inst.Y] % config.window_height;
-            const uint8_t orig_X = X_coord;
-
-            chip8->V[0xF] = 0; // set VF to 0
-
-            // loop over N rows of sprite
-            for(uint8_t i = 0; i < chip8->inst.N; i++){
-                uint8_t sprite = chip8->ram[chip8->I + i];
-                X_coord = orig_X;   // reset x for next row
-
-                for(int8_t j = 7 ; j >= 0 ; j--){
-                    // condition to set carry flag
-                    bool *pixel = &chip8->display[(Y_coord) * config.window_width + (X_coord)];
-                    const bool sprite_bit = sprite & (1 << j);
-                    if((sprite_bit) && *pixel){
-                        
-                        chip8->V[0xF] = 1;
-                    }
+void op_00FF(chip8_t *chip8, const config_t *config){
+    // 128x64 hires mode (SCHIP 0x00FF)
+    display_set_hires(chip8, true);
+    (void) config;
+}
 
-                    *pixel ^= sprite_bit;
+// skip the next instruction, XO-CHIP's F000 NNNN is two words long
+void skip_next(chip8_t *chip8){
+    const bool long_inst = chip8->mode == MODE_XOCHIP &&
+                           chip8->ram[chip8->PC] == 0xF0 && chip8->ram[(uint16_t)(chip8->PC + 1)] == 0x00;
+    chip8->PC += long_inst ? 4 : 2;
+}
 
-                    if(++X_coord >= config.window_width){
-                        break;
-                    }
-                }
+void op_00EE(chip8_t *chip8, const config_t *config){
+    // return from subroutine (0x00EE)
+    // set pc to last address on subroutine stack ("pop" from stack)
+    // the stack is a ring of 16, returning from an empty one pops its top slot
+    chip8->stack_ptr = (chip8->stack_ptr - 1) & 15;
+    chip8->PC = chip8->stack[chip8->stack_ptr];
+    (void) config;
+}
 
-                if(++Y_coord >= config.window_height){
-                    break;
-                }
-            }
+void op_1NNN(chip8_t *chip8, const config_t *config){
+    // jump to address (0x1NNN)
+    const uint16_t addr = chip8->PC - 2;
+    chip8->PC = chip8->inst.NNN;
+    if(config->idle){
+        const uint8_t period = idle_jump_period(chip8, addr);
+        // a delay timer poll only spins while the timer is not at NN
+        if(period == 1 || (period == 3 && chip8->delay_timer != chip8->ram[chip8->PC + 3])){
+            chip8->idle_period = period;
+        }
+    }
+}
+
+void op_2NNN(chip8_t *chip8, const config_t *config){
+    // call subroutine (0x2NNN)
+    // push current address to return to on subroutine stack
+    // set pc to subroutine address so that next opcode is gotten from there
+    // a 17th nested call overwrites the oldest return address rather than what follows the stack
+    chip8->stack[chip8->stack_ptr & 15] = chip8->PC;
+    chip8->stack_ptr = (chip8->stack_ptr + 1) & 15;
+    chip8->PC = chip8->inst.NNN;
+    (void) config;
+}
+
+void op_3XNN(chip8_t *chip8, const config_t *config){
+    // skip next instruction if V[x] == NN (0x3XNN)
+    if(chip8->V[chip8->inst.X] == chip8->inst.NN){
+        skip_next(chip8);
+    }
+    (void) config;
+}
+
+void op_4XNN(chip8_t *chip8, const config_t *config){
+    // skip next instruction if V[x] != NN (0x4XNN)
+    if(chip8->V[chip8->inst.X] != chip8->inst.NN){
+        skip_next(chip8);
+    }
+    (void) config;
+}
+
+void op_5XY0(chip8_t *chip8, const config_t *config){
+    // skip next instruction if V[x] == V[y] (0x5XY0)
+    if(chip8->V[chip8->inst.X] == chip8->V[chip8->inst.Y]){
+        skip_next(chip8);
+    }
+    (void) config;
+}
+
+void op_6XNN(chip8_t *chip8, const config_t *config){
+    // set V[x] = NN  (0x6XNN)
+    chip8->V[chip8->inst.X] = chip8->inst.NN;
+    (void) config;
+}
+
+void op_7XNN(chip8_t *chip8, const config_t *config){
+    // v[x] += NN
+    chip8->V[chip8->inst.X] += chip8->inst.NN;
+    (void) config;
+}
+
+void op_8XY0(chip8_t *chip8, const config_t *config){
+    // set V[x] = V[y] (0x8XY0)
+    chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y];
+    (void) config;
+}
+
+void op_8XY4(chip8_t *chip8, const config_t *config){
+    // set V[x] = V[x] + V[y] (0x8XY4) set v[f] = 1 if carry
+    // if((uint16_t)(chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255)
+    //     chip8->V[0xF] = 1;
+
+    chip8->V[0xF] = (chip8->V[chip8->inst.X] + chip8->V[chip8->inst.Y]) > 255 ? 1 : 0;
+    
+    chip8->V[chip8->inst.X] += chip8->V[chip8->inst.Y];
+    (void) config;
+}
+
+void op_8XY5(chip8_t *chip8, const config_t *config){
+    // set V[x] = V[x] - V[y] (0x8XY5) set v[f] = 1 if no borrow (positive result)
+    // if(chip8->V[chip8->inst.X] >= chip8->V[chip8->inst.Y])
+    //     chip8->V[0xF] = 1;
 
+    chip8->V[0xF] = chip8->V[chip8->inst.X] >= chip8->V[chip8->inst.Y] ? 1 : 0;
+    
+    chip8->V[chip8->inst.X] -= chip8->V[chip8->inst.Y];
+    (void) config;
+}
+
+void op_8XY7(chip8_t *chip8, const config_t *config){
+    // set V[x] = V[y] - V[x] (0x8XY7) set v[f] = 1 if no borrow (positive result)
+    // if(chip8->V[chip8->inst.Y] >= chip8->V[chip8->inst.X])
+    //     chip8->V[0xF] = 1;
+
+    chip8->V[0xF] = chip8->V[chip8->inst.Y] >= chip8->V[chip8->inst.X] ? 1 : 0;
+
+    chip8->V[chip8->inst.X] = chip8->V[chip8->inst.Y] - chip8->V[chip8->inst.X];
+    (void) config;
+}
+
+void op_9XY0(chip8_t *chip8, const config_t *config){
+    // skip next instruction if V[x] != V[y] (0x9XY0)
+    if(chip8->V[chip8->inst.X] != chip8->V[chip8->inst.Y])
+        skip_next(chip8);
+    (void) config;
+}
+
+void op_ANNN(chip8_t *chip8, const config_t *config){
+    // set index register (0xANNN)
+    chip8->I = chip8->inst.NNN;
+    (void) config;
+}
+
+void op_CXNN(chip8_t *chip8, const config_t *config){
+    // set V[x] = random byte AND NN (0xCXNN)
+    chip8->V[chip8->inst.X] = chip8_rand(chip8) & chip8->inst.NN;
+    (void) config;
+}
+
+void op_EX9E(chip8_t *chip8, const config_t *config){
+    // skip next instruction if key with the value of V[x] is pressed (0xEX9E), only the low nibble names a key
+    if(chip8->keypad[chip8->V[chip8->inst.X] & 0xF]){
+        skip_next(chip8);
+    }
+    (void) config;
+}
+
+void op_EXA1(chip8_t *chip8, const config_t *config){
+    // skip next instruction if key with the value of V[x] is not pressed (0xEXA1), only the low nibble names a key
+    if(!chip8->keypad[chip8->V[chip8->inst.X] & 0xF]){
+        skip_next(chip8);
+    }
+    (void) config;
+}
+
+void op_FX0A(chip8_t *chip8, const config_t *config){
+    // wait for keypress and store value in V[x] (0xFX0A)
+    bool key_pressed = false;
+    for(uint8_t i = 0; i < sizeof chip8->keypad; i++){
+        if(chip8->keypad[i]){
+            chip8->V[chip8->inst.X] = i;
+            key_pressed = true;
             break;
+        }
+    }
+    // if no key pressed, set program counter to previous address (again wait for input)
+    if(!key_pressed){
+        chip8->PC -= 2;
+        if(config->idle) chip8->idle_period = 1;
+    }
+}
 
-        case 0xE:
-            if(chip8->inst.NN == 0x9E){
-                // skip next instruction if key with the value of V[x] is pressed (0xEX9E)
-                if(chip8->keypad[chip8->V[chip8->inst.X]]){
-                    chip8->PC += 2;
-                }
+void op_FX1E(chip8_t *chip8, const config_t *config){
+    // add V[x] to I (0xFX1E)
+    chip8->I += chip8->V[chip8->inst.X];
+    (void) config;
+}
+
+void op_FX07(chip8_t *chip8, const config_t *config){
+    // set V[x] = delay timer value (0xFX07)
+    chip8->V[chip8->inst.X] = chip8->delay_timer;
+    (void) config;
+}
+
+void op_FX15(chip8_t *chip8, const config_t *config){
+    // set delay timer = V[x] (0xFX15)
+    chip8->delay_timer = chip8->V[chip8->inst.X];
+    (void) config;
+}
+
+void op_FX18(chip8_t *chip8, const config_t *config){
+    // set sound timer = V[x] (0xFX18)
+    chip8->sound_timer = chip8->V[chip8->inst.X];
+    (void) config;
+}
+
+void op_FX29(chip8_t *chip8, const config_t *config){
+    // set I = location of sprite for char V[x] (0xFX29)
+    chip8->I = chip8->V[chip8->inst.X] * 5;
+    (void) config;
+}
+
+void op_FX33(chip8_t *chip8, const config_t *config){
+    // store BCD representation of V[x] in memory locations I, I+1, I+2 (0xFX33)
+    chip8->ram[chip8->I & chip8->ram_mask] = chip8->V[chip8->inst.X] / 100;
+    chip8->ram[(chip8->I+1) & chip8->ram_mask] = (chip8->V[chip8->inst.X] / 10) % 10;
+    chip8->ram[(chip8->I+2) & chip8->ram_mask] = chip8->V[chip8->inst.X] % 10;
+    invalidate_decoded(chip8, chip8->I & chip8->ram_mask, 3);
+    (void) config;
+}
+
+void op_FX30(chip8_t *chip8, const config_t *config){
+    // set I = location of the big 8x10 sprite for digit V[x] (SCHIP 0xFX30)
+    chip8->I = BIG_FONT + (chip8->V[chip8->inst.X] & 0xF) * 10;
+    (void) config;
+}
+
+void op_FX75(chip8_t *chip8, const config_t *config){
+    // save V0 through V[x] to the flag registers (SCHIP 0xFX75)
+    memcpy(chip8->flags, chip8->V, chip8->inst.X + 1);
+    (void) config;
+}
+
+void op_FX85(chip8_t *chip8, const config_t *config){
+    // load V0 through V[x] from the flag registers (SCHIP 0xFX85)
+    memcpy(chip8->V, chip8->flags, chip8->inst.X + 1);
+    (void) config;
+}
+
+void op_5XY2(chip8_t *chip8, const config_t *config){
+    // store V[x] through V[y] (either direction) in memory starting at I, I unchanged (XO-CHIP 0x5XY2)
+    const uint8_t count = (chip8->inst.X <= chip8->inst.Y ? chip8->inst.Y - chip8->inst.X : chip8->inst.X - chip8->inst.Y) + 1;
+    for(uint8_t i = 0; i < count; i++){
+        const uint8_t reg = chip8->inst.X <= chip8->inst.Y ? chip8->inst.X + i : chip8->inst.X - i;
+        chip8->ram[(chip8->I + i) & chip8->ram_mask] = chip8->V[reg];
+    }
+    invalidate_decoded(chip8, chip8->I & chip8->ram_mask, count);
+    (void) config;
+}
+
+void op_5XY3(chip8_t *chip8, const config_t *config){
+    // load V[x] through V[y] (either direction) from memory starting at I, I unchanged (XO-CHIP 0x5XY3)
+    const uint8_t count = (chip8->inst.X <= chip8->inst.Y ? chip8->inst.Y - chip8->inst.X : chip8->inst.X - chip8->inst.Y) + 1;
+    for(uint8_t i = 0; i < count; i++){
+        const uint8_t reg = chip8->inst.X <= chip8->inst.Y ? chip8->inst.X + i : chip8->inst.X - i;
+        chip8->V[reg] = chip8->ram[(chip8->I + i) & chip8->ram_mask];
+    }
+    (void) config;
+}
+
+void op_F000(chip8_t *chip8, const config_t *config){
+    // set I = the 16 bit address in the next word (XO-CHIP 0xF000 NNNN)
+    chip8->I = (chip8->ram[chip8->PC] << 8) | chip8->ram[(uint16_t)(chip8->PC + 1)];
+    chip8->PC += 2;
+    (void) config;
+}
+
+void op_FN01(chip8_t *chip8, const config_t *config){
+    // select the bitplanes drawn, cleared and scrolled (XO-CHIP 0xFN01)
+    chip8->planes = chip8->inst.X & 3;
+    (void) config;
+}
+
+void op_F002(chip8_t *chip8, const config_t *config){
+    // load the 16 byte audio pattern from memory at I (XO-CHIP 0xF002)
+    for(uint8_t i = 0; i < sizeof chip8->pattern; i++){
+        chip8->pattern[i] = chip8->ram[(chip8->I + i) & chip8->ram_mask];
+    }
+    chip8->has_pattern = true;
+    (void) config;
+}
+
+void op_FX3A(chip8_t *chip8, const config_t *config){
+    // set the audio pattern pitch to V[x] (XO-CHIP 0xFX3A)
+    chip8->pitch = chip8->V[chip8->inst.X];
+    (void) config;
+}
+
+// Quirk-dependent opcodes: each body takes its profile's quirks as a constant and is
+// stamped out once per profile below, so the checks fold away at compile time and
+// decode_handler() hands out the variant for the machine's profile
+
+static inline __attribute__((always_inline)) void quirk_8XY1(chip8_t *chip8, const quirks_t q){
+    // set V[x] = V[x] | V[y] (0x8XY1)
+    chip8->V[chip8->inst.X] |= chip8->V[chip8->inst.Y];
+    if(q.vf_reset) chip8->V[0xF] = 0;
+}
+
+static inline __attribute__((always_inline)) void quirk_8XY2(chip8_t *chip8, const quirks_t q){
+    // set V[x] = V[x] & V[y] (0x8XY2)
+    chip8->V[chip8->inst.X] &= chip8->V[chip8->inst.Y];
+    if(q.vf_reset) chip8->V[0xF] = 0;
+}
+
+static inline __attribute__((always_inline)) void quirk_8XY3(chip8_t *chip8, const quirks_t q){
+    // set V[x] = V[x] ^ V[y] (0x8XY3)
+    chip8->V[chip8->inst.X] ^= chip8->V[chip8->inst.Y];
+    if(q.vf_reset) chip8->V[0xF] = 0;
+}
+
+static inline __attribute__((always_inline)) void quirk_8XY6(chip8_t *chip8, const quirks_t q){
+    // set V[x] = V[x] >> 1 (0x8XY6), or V[y] >> 1; set v[f] = least significant bit of the source
+    const uint8_t src = q.shift_vy ? chip8->inst.Y : chip8->inst.X;
+    chip8->V[0xF] = chip8->V[src] & 1;
+    chip8->V[chip8->inst.X] = chip8->V[src] >> 1;
+}
+
+static inline __attribute__((always_inline)) void quirk_8XYE(chip8_t *chip8, const quirks_t q){
+    // set V[x] = V[x] << 1 (0x8XYE), or V[y] << 1; set v[f] = most significant bit of the source
+    const uint8_t src = q.shift_vy ? chip8->inst.Y : chip8->inst.X;
+    chip8->V[0xF] = (chip8->V[src] & 0x80) >> 7;
+    chip8->V[chip8->inst.X] = chip8->V[src] << 1;
+}
+
+static inline __attribute__((always_inline)) void quirk_BNNN(chip8_t *chip8, const quirks_t q){
+    // jump to address NNN + V[0] (0xBNNN), SCHIP: XNN + V[x]
+    chip8->PC = chip8->inst.NNN + chip8->V[q.jump_vx ? chip8->inst.X : 0];
+}
+
+static inline __attribute__((always_inline)) void quirk_DXYN(chip8_t *chip8, const quirks_t q){
+    // draw sprite (0xDXYN) Draw N-Height at coords X, Y : Read from memory loc I;
+    // screen pixels are XOR'd with sprite pixels
+    // VF (Carry Flag) is set if any pixels were erased
+    // SCHIP/XO-CHIP: DXY0 is 16x16, two bytes a row; XO-CHIP draws each selected plane from consecutive data
+
+    const uint32_t height = display_height(chip8);
+    const uint32_t words = display_row_words(chip8);
+    const uint8_t X_coord = chip8->V[chip8->inst.X] % display_width(chip8);
+    const uint8_t Y_coord = chip8->V[chip8->inst.Y] % height;
+    const bool wide = chip8->inst.N == 0 && chip8->mode != MODE_CHIP8;
+    const uint8_t rows = wide ? 16 : chip8->inst.N;
+    const uint32_t word = X_coord / 64;
+    const uint32_t shift = X_coord % 64;
+    uint16_t addr = chip8->I;
+    uint8_t hits = 0;       // rows with a pixel turned off
+    uint8_t clipped = 0;    // rows below the bottom edge
+
+    for(uint8_t plane = 0; plane < 2; plane++){
+        if(!(chip8->planes & (1 << plane))) continue;
+
+        // loop over the rows of sprite, clipping stops at the bottom edge (the plane's data still takes its rows)
+        for(uint8_t i = 0; i < rows; i++, addr += wide ? 2 : 1){
+            if(q.clip && Y_coord + i >= height){
+                clipped++;
+                continue;
             }
-            else if(chip8->inst.NN == 0xA1){
-                // skip next instruction if key with the value of V[x] is not pressed (0xEXA1)
-                if(!chip8->keypad[chip8->V[chip8->inst.X]]){
-                    chip8->PC += 2;
-                }
+            const uint32_t y = (Y_coord + i) % height;
+            uint64_t sprite = (uint64_t)chip8->ram[addr & chip8->ram_mask] << 56;
+            if(wide) sprite |= (uint64_t)chip8->ram[(addr + 1) & chip8->ram_mask] << 48;
+
+            // line the sprite up with X, bits pushed past the right edge fall off (clipping)
+            // or come back in at the left edge (the row's first word)
+            uint64_t *line = &chip8->display[plane][y * words];
+            const uint32_t next = word + 1 < words ? word + 1 : 0;
+            const uint64_t head = sprite >> shift;
+            const uint64_t tail = shift && (!q.clip || next != 0) ? sprite << (64 - shift) : 0;
+
+            // any pixel turned off sets the carry flag
+            if((line[word] & head) || (line[next] & tail)){
+                hits++;
             }
-            break;
+            line[word] ^= head;
+            line[next] ^= tail;
+            if(head | tail){
+                chip8->dirty_rows |= 1ULL << y;
+            }
+        }
+    }
+    // SCHIP hires counts colliding and clipped rows, everything else just flags a collision
+    chip8->V[0xF] = chip8->mode == MODE_SCHIP && chip8->hires ? hits + clipped : hits != 0;
+}
+
+static inline __attribute__((always_inline)) void quirk_FX55(chip8_t *chip8, const quirks_t q){
+    // store registers V0 through V[x] in memory starting at location I (0xFX55)
+    // CHIP-8 and XO-CHIP leave I past the last register, SCHIP does not move it
+    for(uint8_t i = 0; i <= chip8->inst.X; i++){
+        chip8->ram[(chip8->I + i) & chip8->ram_mask] = chip8->V[i];
+    }
+    invalidate_decoded(chip8, chip8->I & chip8->ram_mask, chip8->inst.X + 1);
+    if(q.memory_i) chip8->I += chip8->inst.X + 1;
+}
 
+static inline __attribute__((always_inline)) void quirk_FX65(chip8_t *chip8, const quirks_t q){
+    // load registers V0 through V[x] from memory starting at location I (0xFX65)
+    // CHIP-8 and XO-CHIP leave I past the last register, SCHIP does not move it
+    for(uint8_t i = 0; i <= chip8->inst.X; i++){
+        chip8->V[i] = chip8->ram[(chip8->I + i) & chip8->ram_mask];
+    }
+    if(q.memory_i) chip8->I += chip8->inst.X + 1;
+}
+
+// op_8XY1_chip8, op_8XY1_schip, ...: one handler per opcode and profile
+#define QUIRK_HANDLER(op, name, ...) \
+    void op_##op##_##name(chip8_t *chip8, const config_t *config){ \
+        quirk_##op(chip8, (quirks_t){__VA_ARGS__}); \
+        (void) config; \
+    }
+#define QUIRK_HANDLERS(name, profile, ...) \
+    QUIRK_HANDLER(8XY1, name, __VA_ARGS__) \
+    QUIRK_HANDLER(8XY2, name, __VA_ARGS__) \
+    QUIRK_HANDLER(8XY3, name, __VA_ARGS__) \
+    QUIRK_HANDLER(8XY6, name, __VA_ARGS__) \
+    QUIRK_HANDLER(8XYE, name, __VA_ARGS__) \
+    QUIRK_HANDLER(BNNN, name, __VA_ARGS__) \
+    QUIRK_HANDLER(DXYN, name, __VA_ARGS__) \
+    QUIRK_HANDLER(FX55, name, __VA_ARGS__) \
+    QUIRK_HANDLER(FX65, name, __VA_ARGS__)
+QUIRK_PROFILES(QUIRK_HANDLERS)
+
+typedef struct {
+    op_handler_t op_8XY1, op_8XY2, op_8XY3, op_8XY6, op_8XYE, op_BNNN, op_DXYN, op_FX55, op_FX65;
+} quirk_handlers_t;
+
+#define QUIRK_HANDLER_ENTRY(name, profile, ...) \
+    [profile] = { op_8XY1_##name, op_8XY2_##name, op_8XY3_##name, op_8XY6_##name, op_8XYE_##name, \
+                  op_BNNN_##name, op_DXYN_##name, op_FX55_##name, op_FX65_##name },
+const quirk_handlers_t quirk_handlers[] = { QUIRK_PROFILES(QUIRK_HANDLER_ENTRY) };
+
+// pick the handler for an opcode, only runs when an address is not in the decode cache
+op_handler_t decode_handler(const instruction_t inst, chip8_mode_t mode, quirk_profile_t quirks){
+    const quirk_handlers_t *quirky = &quirk_handlers[quirks];
+    switch((inst.opcode >> 12) & 0x0F){
+        case 0x0:
+            if(inst.NN == 0xE0) return op_00E0;
+            if(inst.NN == 0xEE) return op_00EE;
+            // SCHIP/XO-CHIP display control, machine code calls on CHIP-8
+            if(mode == MODE_CHIP8 || inst.X != 0) return op_nop;
+            if(inst.Y == 0xC) return op_00CN;
+            if(inst.Y == 0xD && mode == MODE_XOCHIP) return op_00DN;
+            switch(inst.NN){
+                case 0xFB: return op_00FB;
+                case 0xFC: return op_00FC;
+                case 0xFD: return op_00FD;
+                case 0xFE: return op_00FE;
+                case 0xFF: return op_00FF;
+                default: return op_nop;
+            }
+        case 0x1: return op_1NNN;
+        case 0x2: return op_2NNN;
+        case 0x3: return op_3XNN;
+        case 0x4: return op_4XNN;
+        case 0x5:
+            if(mode == MODE_XOCHIP && inst.N == 0x2) return op_5XY2;
+            if(mode == MODE_XOCHIP && inst.N == 0x3) return op_5XY3;
+            return op_5XY0;
+        case 0x6: return op_6XNN;
+        case 0x7: return op_7XNN;
+        case 0x8:
+            switch(inst.N){
+                case 0x0: return op_8XY0;
+                case 0x1: return quirky->op_8XY1;
+                case 0x2: return quirky->op_8XY2;
+                case 0x3: return quirky->op_8XY3;
+                case 0x4: return op_8XY4;
+                case 0x5: return op_8XY5;
+                case 0x6: return quirky->op_8XY6;
+                case 0x7: return op_8XY7;
+                case 0xE: return quirky->op_8XYE;
+                default: return op_nop;
+            }
+        case 0x9: return op_9XY0;
+        case 0xA: return op_ANNN;
+        case 0xB: return quirky->op_BNNN;
+        case 0xC: return op_CXNN;
+        case 0xD: return quirky->op_DXYN;
+        case 0xE:
+            if(inst.NN == 0x9E) return op_EX9E;
+            if(inst.NN == 0xA1) return op_EXA1;
+            return op_nop;
         case 0xF:
-            switch(chip8->inst.NN){
-                case 0x0A:
-                   // wait for keypress and store value in V[x] (0xFX0A)
-                   bool key_pressed = false;
-                   for(uint8_t i = 0; i < sizeof chip8->keypad; i++){
-                       if(chip8->keypad[i]){
-                           chip8->V[chip8->inst.X] = i;
-                           key_pressed = true;
-                           break;
-                       }
-                   }
-                   // if no key pressed, set program counter to previous address (again wait for input)
-                   if(!key_pressed){
-                       chip8->PC -= 2;
-                   }
-
-                   break;
-
-                case 0x1E:
-                    // add V[x] to I (0xFX1E)
-                    chip8->I += chip8->V[chip8->inst.X];
-                    break;
-
-                case 0x07:
-                    // set V[x] = delay timer value (0xFX07)
-                    chip8->V[chip8->inst.X] = chip8->delay_timer;
-                    break;
-
-                case 0x15:
-                    // set delay timer = V[x] (0xFX15)
-                    chip8->delay_timer = chip8->V[chip8->inst.X];
-                    break;
-                
-                case 0x18:
-                    // set sound timer = V[x] (0xFX18)
-                    chip8->sound_timer = chip8->V[chip8->inst.X];
-                    break;
-                
-                case 0x29:
-                    // set I = location of sprite for char V[x] (0xFX29)
-                    chip8->I = chip8->V[chip8->inst.X] * 5;
-                    break;
-
-                case 0x33:
-                    // store BCD representation of V[x] in memory locations I, I+1, I+2 (0xFX33)
-                    chip8->ram[chip8->I] = chip8->V[chip8->inst.X] / 100;
-                    chip8->ram[chip8->I+1] = (chip8->V[chip8->inst.X] / 10) % 10;
-                    chip8->ram[chip8->I+2] = chip8->V[chip8->inst.X] % 10;
-                    break;
-
-                case 0x55:
-                    // store registers V0 through V[x] in memory starting at location I (0xFX55)
-                    // SCHIP does not incrememnt I, but CHIP-8 does
-                    for(uint8_t i = 0; i <= chip8->inst.X; i++){
-                        chip8->ram[chip8->I + i] = chip8->V[i];
-                    }
-                    // chip8->I = chip8->I + chip8->inst.X + 1;
-                    break;
-
-                case 0x65:
-                    // load registers V0 through V[x] from memory starting at location I (0xFX65)
-                    // SCHIP does not incrememnt I, but CHIP-8 does
-                    for(uint8_t i = 0; i <= chip8->inst.X; i++){
-                        chip8->V[i] = chip8->ram[chip8->I + i];
-                    }
-                    // chip8->I = chip8->I + chip8->inst.X + 1;
-                    break;
-                
-                default:
-                    break;
+            if(mode == MODE_XOCHIP){
+                if(inst.opcode == 0xF000) return op_F000;
+                if(inst.opcode == 0xF002) return op_F002;
+                if(inst.NN == 0x01) return op_FN01;
+                if(inst.NN == 0x3A) return op_FX3A;
             }
-        
-        default :
-            break;
+            if(mode != MODE_CHIP8){
+                if(inst.NN == 0x30) return op_FX30;
+                if(inst.NN == 0x75) return op_FX75;
+                if(inst.NN == 0x85) return op_FX85;
+            }
+            switch(inst.NN){
+                case 0x0A: return op_FX0A;
+                case 0x1E: return op_FX1E;
+                case 0x07: return op_FX07;
+                case 0x15: return op_FX15;
+                case 0x18: return op_FX18;
+                case 0x29: return op_FX29;
+                case 0x33: return op_FX33;
+                case 0x55: return quirky->op_FX55;
+                case 0x65: return quirky->op_FX65;
+                default: return op_nop;
+            }
+        default:
+            return op_nop;
+    }
+}
+
+// fetch and decode the instruction at addr into entry
+void decode_instruction(const chip8_t *chip8, uint16_t addr, decoded_inst_t *entry){
+    instruction_t *inst = &entry->inst;
+
+    // fetch instruction from ram
+    inst->opcode = (chip8->ram[addr] << 8) | chip8->ram[(addr + 1) & chip8->ram_mask];
+    // fill out instruction format
+    inst->NNN = inst->opcode & 0x0FFF;
+    inst->NN = inst->opcode & 0x0FF;
+    inst->N = inst->opcode & 0x0F;
+    inst->X = (inst->opcode >> 8) & 0x0F;
+    inst->Y = (inst->opcode >> 4) & 0x0F;
+
+    entry->handler = decode_handler(*inst, chip8->mode, chip8->quirks);
+}
+
+// decoded instruction at addr, from the cache for the first 4KB
+decoded_inst_t *decoded_at(chip8_t *chip8, uint16_t addr){
+    if(addr >= 4096){
+        decode_instruction(chip8, addr, &chip8->decode_high);
+        return &chip8->decode_high;
     }
+    decoded_inst_t *entry = &chip8->decode_cache[addr];
+    if(entry->handler == NULL){
+        decode_instruction(chip8, addr, entry);
+    }
+    return entry;
+}
+
+// Emulate 1 Chip8 instruction
+void emulate_instruction(chip8_t *chip8, config_t config){
+    const uint16_t addr = chip8->PC & chip8->ram_mask;
+    const decoded_inst_t *entry = decoded_at(chip8, addr);
+
+    chip8->inst = entry->inst;
+    chip8->PC = addr + 2;
+
+#ifdef DEBUG
+    print_debug_info(chip8);
+#endif
+
+    PROFILE_BEGIN();
+    TRACE_BEGIN(chip8);
+    entry->handler(chip8, &config);
+    TRACE_END(chip8, addr);
+    PROFILE_END(chip8, addr);
+}
+
+// Emulate count instructions back to back, dispatching straight from the decode cache
+// returns the instructions run, fewer than count only if 00FD exited
+uint32_t run_instructions(chip8_t *chip8, const config_t *config, uint32_t count){
+    chip8->idle_period = 0;
+    for(uint32_t i = 0; i < count; i++){
+        const uint16_t addr = chip8->PC & chip8->ram_mask;
+        const decoded_inst_t *entry = decoded_at(chip8, addr);
+
+        chip8->inst = entry->inst;
+        chip8->PC = addr + 2;
+
+#ifdef DEBUG
+        print_debug_info(chip8);
+#endif
+
+        PROFILE_BEGIN();
+        TRACE_BEGIN(chip8);
+        entry->handler(chip8, config);
+        TRACE_END(chip8, addr);
+        PROFILE_END(chip8, addr);
+
+        if(chip8->state == QUIT) return i + 1;
+        // a wait loop that only the next frame can end, the last instruction leaves it to the caller
+        if(chip8->idle_period && i + 1 < count){
+            i += idle_skip(chip8, count - i - 1);
+        }
+    }
+    return count;
+}
+#include "jit.h"
+#include "aot.h"
+#include "state.h"
+#include "rewind.h"
+#include "audio.h"
+#include "video.h"
+
+// Emulate one frame worth of instructions with whichever engine is enabled, returns the instructions run
+uint32_t run_frame(chip8_t *chip8, const config_t *config, uint32_t count){
+    if(chip8->aot){
+        return aot_run(chip8, config, count);
+    }
+    if(chip8->jit){
+        return jit_run(chip8, config, count);
+    }
+    return run_instructions(chip8, config, count);
 }
 void update_timers(chip8_t *chip8){
     if(chip8->delay_timer > 0) chip8->delay_timer--;
     if(chip8->sound_timer > 0) chip8->sound_timer--;
-    //TODO: play sound
+    // the beep itself is played by audio_frame() from the main loop
+}
+// FNV-1a hash, used to compare runs without a window
+uint64_t fnv1a(const void *data, size_t size){
+    const uint8_t *bytes = data;
+    uint64_t hash = 0xCBF29CE484222325;
+    for(size_t i = 0; i < size; i++){
+        hash ^= bytes[i];
+        hash *= 0x100000001B3;
+    }
+    return hash;
 }
+
+uint64_t framebuffer_hash(const chip8_t *chip8){
+    // only the words in use, a 64x32 CHIP-8 screen hashes the same 256 bytes it always has
+    const size_t bytes = display_height(chip8) * display_row_words(chip8) * sizeof(uint64_t);
+    const uint64_t hash = fnv1a(chip8->display[0], bytes);
+    if(chip8->mode != MODE_XOCHIP) return hash;
+    return hash ^ fnv1a(chip8->display[1], bytes) * 0x100000001B3ULL;
+}
+double elapsed_seconds(const struct timespec start, const struct timespec end){
+    return (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+}
+#include "replay.h"
+// run without SDL as fast as the host allows
+// timers tick once every instructions_per_second/60 instructions (emulated clock, not wall clock)
+// replay and recording are NULL unless --replay / --record were given, audio only writes --wav
+void run_headless(chip8_t *chip8, const config_t config, replay_t *replay, replay_t *recording, audio_t *audio, video_t *video){
+    const uint32_t insts_per_frame = config.instructions_per_second / 60;
+    uint64_t instructions = 0;
+    uint64_t frames = 0;
+    const uint64_t idle_before = chip8->idle_instructions;
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    while(chip8->state != QUIT){
+        if(config.max_frames && frames >= config.max_frames) break;
+        if(config.max_instructions && instructions >= config.max_instructions) break;
+
+        uint32_t count = insts_per_frame;
+        if(config.max_instructions && config.max_instructions - instructions < count){
+            count = config.max_instructions - instructions;
+        }
+        if(replay && !replay_frame(replay, chip8)) break;
+        const uint32_t ran = run_frame(chip8, &config, count);
+        if(recording) record_frame(recording, chip8);
+        instructions += ran;
+
+        // only a completed frame advances the emulated 60Hz clock
+        if(ran == insts_per_frame){
+            audio_frame(audio, chip8);
+            video_frame(video, chip8);
+            update_timers(chip8);
+            frames++;
+        }
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // throughput counts what actually ran, idle skipping's jumps past wait loops are listed apart
+    const double seconds = elapsed_seconds(start, end);
+    const uint64_t idle = chip8->idle_instructions - idle_before;
+    printf("frames: %" PRIu64 "\n", frames);
+    printf("instructions: %" PRIu64 "\n", instructions);
+    printf("idle_instructions: %" PRIu64 "\n", idle);
+    printf("framebuffer_hash: 0x%016" PRIX64 "\n", framebuffer_hash(chip8));
+    printf("seconds: %.6f\n", seconds);
+    printf("instructions_per_second: %.0f\n", seconds > 0 ? (instructions - idle) / seconds : 0);
+    printf("emulated_instructions_per_second: %.0f\n", seconds > 0 ? instructions / seconds : 0);
+}
+#ifndef HEADLESS
+// sleep until ms after start, a machine waiting on FX0A carries on as soon as a key goes down
+void wait_until(chip8_t *chip8, uint64_t start, double ms, chip8_state_t *quick_save){
+    for(;;){
+        const double elapsed = (SDL_GetPerformanceCounter() - start)*1000 / (double) SDL_GetPerformanceFrequency();
+        if(elapsed >= ms) return;
+        if(!waiting_for_key(chip8)){
+            SDL_Delay(ms - elapsed);
+            return;
+        }
+        // any event wakes us, mouse motion and the like go back to sleep
+        if(SDL_WaitEventTimeout(NULL, ms - elapsed)){
+            handle_input(chip8, quick_save);
+            if(chip8->state != RUNNING || !waiting_for_key(chip8)) return;
+        }
+    }
+}
+#endif
+#include "library.h"
+#include "farm.h"
+#include "lockstep.h"
+#include "bench.h"
+#include "control.h"
+
+#ifdef FUZZ
+    #include "fuzz.h"
+#else
+
 int main(int argc, char *argv[]){
     // Defualt usage message
     if(argc < 2){
-        fprintf(stderr, "Usage: %s <ROM>\n", argv[0]);
+        fprintf(stderr, "Usage: %s <ROM> [--headless] [--jit] [--frames N] [--instructions N] [--seed N] [--load-state FILE] [--save-state FILE] [--record FILE] [--replay FILE]\n"
+                        "       %s <ROM> [--speed N] [--turbo N] [--frameskip K] [--input-slices N] [--rewind N] [--wav FILE] [--mode chip8|schip|xochip] [--quirks chip8|schip|xochip]\n"
+                        "       %s <ROM> [--video FILE.rgb|.y4m|.png|.gif] [--video-scale N]\n"
+                        "       %s <ROM> [--ips N] [--keys KEYS] [--library DIR [--remember]]\n"
+                        "       %s <ROM> [--aot-emit FILE.c] [--aot MODULE.so]\n"
+                        "       %s --library DIR\n"
+                        "       %s --farm <ROM>... [--threads N] [--instances N] [--frames N] [--instructions N] [--load-state FILE] [--library DIR]\n"
+                        "       %s --lockstep <ROM> [--instances N] [--frames N] [--instructions N]\n"
+                        "       %s --bench [ROM]... [--frames N] [--seed N]\n"
+                        "       %s --control SOCKET [--jit] [--ips N] [--seed N]\n"
+                        "       %s --decode-trace FILE\n",
+                argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0], argv[0]);
         return 0;
     }
 
-    srand(time(NULL));
-
     // initialize emulator config
     config_t config = {0};
     if(!set_config_from_args(&config, argc, argv)) exit(0);
 
+#if defined(DEBUG) || defined(PROFILE) || defined(TRACE)
+    // debug output, profiling and tracing come from the interpreter only, every instruction of it
+    config.jit = false;
+    config.aot = NULL;
+    config.idle = false;
+#endif
+
+    // a ROM from the library runs with its stored settings, or stores this run's with --remember
+    library_t library = {0};
+    library_entry_t *entry = NULL;
+    if(config.library){
+        if(!library_open(&library, config.library, &config)) exit(1);
+        if(config.rom_count == 0 && !config.farm){
+            library_print(&library);
+            exit(0);
+        }
+        if(config.rom_count == 0 && !library_all(&library, &config)) exit(1);
+        if(!config.farm){
+            entry = library_find(&library, config.roms[0]);
+            if(entry == NULL) exit(1);
+            if(config.remember && !library_remember(&library, entry, &config)) exit(1);
+            library_apply(entry, &config);
+        }
+    }
+    if(config.mode == MODE_XOCHIP && config.jit){
+        SDL_Log("The JIT does not know XO-CHIP's 4 byte instructions, interpreting");
+        config.jit = false;
+    }
+
+    if(config.farm){
+        exit(run_farm(config, config.library ? &library : NULL) ? 0 : 1);
+    }
+    if(config.lockstep){
+        exit(run_lockstep(config) ? 0 : 1);
+    }
+    if(config.bench){
+        exit(run_bench(config) ? 0 : 1);
+    }
+    if(config.control){
+        exit(run_control(config) ? 0 : 1);
+    }
+    if(config.decode_trace){
+#ifdef DEBUG
+        exit(trace_decode(config.decode_trace) ? 0 : 1);
+#else
+        fprintf(stderr, "--decode-trace needs a debug build (make trace-decode)\n");
+        exit(1);
+#endif
+    }
+
+    // a replay brings its own seed and clock rate
+    replay_t replay = {0};
+    replay_t recording = {0};
+    if(config.replay && !replay_open(&replay, config.replay, &config)) exit(1);
+
+    // initialise CHIP8 machine
+    chip8_t chip8 = {0};
+    char *rom_name = config.roms[0];
+    if(entry ? !library_load(&library, entry, &chip8, config.mode) : !init_chip8(&chip8, rom_name, config.mode)) exit(0);
+    chip8_set_quirks(&chip8, config.quirks);
+    if(config.aot_emit) exit(aot_emit(&chip8, &config) ? 0 : 1);
+    // checked against the ROM as loaded, before a state file changes ram
+    if(config.aot) chip8.aot = aot_load(&chip8, config.aot);
+    chip8_seed(&chip8, config.seed);
+    if(config.load_state && !load_state_file(&chip8, config.load_state)) exit(1);
+
+    if(config.replay && !replay_matches(&replay, &chip8)) exit(1);
+    if(config.record && !record_open(&recording, config.record, &chip8, &config)) exit(1);
+    // jumping around in time would make the recording (or replay) meaningless
+    if(config.record || config.replay) config.rewind_seconds = 0;
+
+    if(config.jit && !chip8.aot){
+        chip8.jit = jit_create(config);
+    }
+#ifdef PROFILE
+    chip8.profile = profile_create(chip8.PC);
+#endif
+#ifdef TRACE
+    chip8.trace = trace_create(TRACE_FILE, &chip8);
+#endif
+
+    static audio_t audio;       // wavetable and frame queue shared with the audio callback
+    audio_init_wave(&audio);
+    if(config.wav && !audio_open_wav(&audio, config.wav)) exit(1);
+    static video_t video;       // frame ring shared with the encoder thread
+    if(config.video && !video_open(&video, config.video, &config)) exit(1);
+
+    if(config.headless){
+        run_headless(&chip8, config, config.replay ? &replay : NULL, config.record ? &recording : NULL, &audio, &video);
+        audio_close(&audio);
+        video_close(&video);
+        if(config.record) record_close(&recording);
+        replay_close(&replay);
+        if(config.save_state) save_state_file(&chip8, config.save_state);
+#ifdef PROFILE
+        profile_report(chip8.profile, &chip8);
+#endif
+#ifdef TRACE
+        trace_destroy(chip8.trace);
+#endif
+        jit_destroy(chip8.jit);
+        aot_destroy(chip8.aot);
+        exit(0);
+    }
 
+#ifndef HEADLESS
     // initialize SDL
     sdl_t sdl = {0};
     if(!init_sdl(&sdl, config)) exit(0);
+    audio_open_device(&audio);
 
-    // initialise CHIP8 machine
-    chip8_t chip8 = {0};
-    char *rom_name = argv[1];
-    if(!init_chip8(&chip8, rom_name)) exit(0);
+    // --keys, or the library's keys for this ROM, rebind keypad keys
+    for(int key = 0; key < 16; key++){
+        if(config.keys[key]) keymap[key] = config.keys[key];
+    }
 
     // initial screen clear
     clear_screen(&sdl, config);
 
     // Main emulator loop
+    chip8_state_t quick_save = {0};
+    static rewind_t rewind;     // a few KB of scratch snapshots, keep it off the stack
+    rewind_init(&rewind, config.rewind_seconds);
+    uint64_t frames = 0;        // emulated frames, for --frameskip
     while(chip8.state != QUIT){
-        handle_input(&chip8);
+        handle_input(&chip8, config.record || config.replay ? NULL : &quick_save);
 
         if (chip8.state == PAUSED) continue;
 
+        if (chip8.state == REWINDING){
+            // step back one recorded frame per 60Hz tick
+            rewind_step(&rewind, &chip8);
+            update_screen(&sdl, config, &chip8);
+            SDL_Delay(16.67f);
+            continue;
+        }
+
 
         uint64_t start = SDL_GetPerformanceCounter();
-        //Emulate instructions in one frame
-        for(uint32_t i = 0; i < config.instructions_per_second/60; i++){
-            emulate_instruction(&chip8, config);
-        }
-        uint64_t end = SDL_GetPerformanceCounter();
-        const double time_elapsed = (end - start)*1000 / (double) SDL_GetPerformanceFrequency();
+        double time_elapsed = 0;
+
+        // emulated frames this 60Hz tick: 1 normally, more when fast-forwarding, 0 = as many as fit
+        const uint32_t speed = chip8.state == FAST_FORWARDING ? config.turbo_speed : config.speed;
+        // recordings hold one keypad per frame, so keys only change between frames then
+        const uint32_t slices = config.record || config.replay ? 1 : config.input_slices;
+        for(uint32_t f = 0; speed == 0 || f < speed; f++){
+            // a replay overrides the keyboard until it runs out
+            if(replay.file && !replay_frame(&replay, &chip8)){
+                replay_close(&replay);
+                keypad_set(&chip8, 0);
+                printf("Replay finished\n");
+            }
 
-        // Delay for 60Hz approximately ~ 16.6 ms
-        SDL_Delay(16.67f > time_elapsed ? 16.67f - time_elapsed : 0);
+            //Emulate instructions in one frame
+            const uint32_t insts_per_frame = config.instructions_per_second/60;
+            if(speed == 1 && slices > 1){
+                // spread the frame over the tick and read the keyboard between the parts,
+                // so EX9E/EXA1/FX0A see a key press within a slice instead of a whole frame
+                for(uint32_t slice = 0; slice < slices; slice++){
+                    if(slice > 0){
+                        wait_until(&chip8, start, 16.67 * slice / slices, &quick_save);
+                        handle_input(&chip8, &quick_save);
+                    }
+                    run_frame(&chip8, &config, insts_per_frame * (slice + 1) / slices - insts_per_frame * slice / slices);
+                }
+            }
+            else run_frame(&chip8, &config, insts_per_frame);
+            if(recording.file) record_frame(&recording, &chip8);
+
+            // Beep for this frame, then update timers; both follow emulated time, not the wall clock
+            audio_frame(&audio, &chip8);
+            video_frame(&video, &chip8);
+            update_timers(&chip8);
 
-        // Update window 
-        update_screen(&sdl, config, &chip8);
+            // Remember the frame for rewinding
+            rewind_push(&rewind, &chip8);
 
-        // Update timers
-        update_timers(&chip8);
+            // --frameskip K: only every Kth emulated frame reaches the window
+            frames++;
+            if(config.frameskip && frames % config.frameskip == 0){
+                update_screen(&sdl, config, &chip8);
+            }
+
+            time_elapsed = (SDL_GetPerformanceCounter() - start)*1000 / (double) SDL_GetPerformanceFrequency();
+            if(speed == 0 && time_elapsed >= 16.67f) break;
+        }
+
+        // Update window, once per tick unless --frameskip picks the frames
+        if(!config.frameskip) update_screen(&sdl, config, &chip8);
+
+        // Delay for 60Hz approximately ~ 16.6 ms, a ROM waiting on FX0A wakes up for a key press
+        wait_until(&chip8, start, 16.67, config.record || config.replay ? NULL : &quick_save);
     }
+    printf("Idle: %.1f s of emulated time skipped in wait loops\n",
+           (double)chip8.idle_instructions / config.instructions_per_second);
 
     // Final cleanup
+    audio_close(&audio);
+    video_close(&video);
     final_cleanup(&sdl);
+    rewind_destroy(&rewind);
+    if(recording.file) record_close(&recording);
+    replay_close(&replay);
+    if(config.save_state) save_state_file(&chip8, config.save_state);
+#endif
+#ifdef PROFILE
+    profile_report(chip8.profile, &chip8);
+#endif
+#ifdef TRACE
+    trace_destroy(chip8.trace);
+#endif
+    jit_destroy(chip8.jit);
+    aot_destroy(chip8.aot);
 
     exit(0);
-}
\ No newline at end of file
+}
+#endif
\ No newline at end of file
@@ -0,0 +1,400 @@
+// Control socket: external programs drive emulators over a Unix domain socket
+//
+// --control PATH listens on PATH; every connection gets a machine of its own
+// and a thread to run it, so one server drives as many emulators as there
+// are cores. The protocol is binary in host byte order, like state files: a
+// 16 byte control_request_t, optionally followed by a payload, answered by a
+// 16 byte control_reply_t, optionally followed by one. Requests are handled
+// in order, and every request that arrived in one read is answered with one
+// write, so a client batches by simply sending several requests before
+// reading the replies.
+//
+// Each machine lives in a shared memory object. CONTROL_SHARE passes its
+// file descriptor to the client along with the offsets of the framebuffer,
+// RAM and registers, so a client can map it once and read the screen after
+// every step without it being copied through the socket. The mapping is only
+// stable between a reply and the next request.
+
+#include <pthread.h>
+#include <stddef.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#define CONTROL_BUFFER (256 * 1024)                 // per connection, each way
+#define CONTROL_MAX_PAYLOAD sizeof(chip8_state_t)   // largest payload either way
+#define CONTROL_MAX_STEP (1u << 24)                 // instructions per STEP, keeps one request from holding the thread
+
+typedef enum {
+    CONTROL_LOAD = 1,       // arg = mode | quirk profile << 8, payload = ROM image
+    CONTROL_SEED,           // arg = CXNN seed
+    CONTROL_KEYS,           // arg = keys held, one bit per key
+    CONTROL_STEP,           // run count (up to CONTROL_MAX_STEP) instructions, timers untouched
+    CONTROL_FRAMES,         // run count frames (up to CONTROL_MAX_STEP instructions), the timers tick after each; value = frames run
+    CONTROL_REGISTERS,      // reply payload = control_registers_t
+    CONTROL_READ,           // reply payload = count bytes of ram from arg
+    CONTROL_WRITE,          // payload goes into ram at arg
+    CONTROL_DISPLAY,        // reply payload = the packed display, value = framebuffer hash
+    CONTROL_SAVE,           // reply payload = the state file format, state_size() bytes
+    CONTROL_RESTORE,        // payload = a SAVE reply from the same mode
+    CONTROL_SHARE,          // reply carries the machine's shared memory fd, payload = control_layout_t
+} control_op_t;
+
+typedef enum {
+    CONTROL_OK,
+    CONTROL_UNKNOWN,        // no such op
+    CONTROL_NO_ROM,         // needs a LOAD first
+    CONTROL_INVALID,        // bad argument or payload
+} control_status_t;
+
+typedef struct {
+    uint32_t op;            // control_op_t
+    uint32_t arg;
+    uint32_t count;
+    uint32_t length;        // payload bytes after the header
+} control_request_t;
+
+typedef struct {
+    uint32_t status;        // control_status_t
+    uint32_t length;        // payload bytes after the header
+    uint64_t value;
+} control_reply_t;
+
+typedef struct {
+    uint8_t V[16];
+    uint16_t stack[16];
+    uint16_t I;
+    uint16_t PC;
+    uint8_t stack_ptr;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t running;        // 0 once SCHIP 00FD exited
+    uint8_t halted;         // parked on a jump to itself
+    uint8_t mode;
+    uint8_t hires;
+    uint8_t planes;
+    uint8_t reserved[4];    // always zero
+    uint64_t frames;        // stepped since the last LOAD
+    uint64_t instructions;
+} control_registers_t;
+_Static_assert(sizeof(control_registers_t) == 80, "control_registers_t must not contain padding");
+
+// where the machine's fields are in the shared memory object
+typedef struct {
+    uint32_t size;          // bytes to map
+    uint32_t display;       // uint64_t[2][128], see chip8_t
+    uint32_t hires;         // bool
+    uint32_t ram;           // uint8_t[65536]
+    uint32_t V;             // uint8_t[16]
+    uint32_t I;             // uint16_t
+    uint32_t PC;            // uint16_t
+    uint32_t reserved;      // always zero
+} control_layout_t;
+
+typedef struct {
+    int socket;
+    const config_t *config;
+    int shared;             // shared memory object holding chip8
+    chip8_t *chip8;
+    bool loaded;
+    uint64_t frames;
+    uint64_t instructions;
+    uint8_t in[CONTROL_BUFFER];
+    uint8_t out[CONTROL_BUFFER];
+    size_t in_length;
+    size_t out_length;
+} control_client_t;
+
+bool control_send(control_client_t *client){
+    for(size_t sent = 0; sent < client->out_length;){
+        const ssize_t n = send(client->socket, client->out + sent, client->out_length - sent, MSG_NOSIGNAL);
+        if(n <= 0) return false;
+        sent += n;
+    }
+    client->out_length = 0;
+    return true;
+}
+
+// queue a reply, the payload (if any) is written by the caller into the returned space
+uint8_t *control_reply(control_client_t *client, control_status_t status, uint64_t value, uint32_t length){
+    if(client->out_length + sizeof(control_reply_t) + length > CONTROL_BUFFER && !control_send(client)) return NULL;
+    const control_reply_t reply = { status, length, value };
+    memcpy(client->out + client->out_length, &reply, sizeof reply);
+    client->out_length += sizeof reply + length;
+    return client->out + client->out_length - length;
+}
+
+// a fresh machine, in a new shared memory object so an old mapping never sees the next ROM
+bool control_new_machine(control_client_t *client){
+    if(client->chip8){
+        jit_destroy(client->chip8->jit);
+        munmap(client->chip8, sizeof(chip8_t));
+        close(client->shared);
+    }
+    client->chip8 = NULL;
+
+    char name[64];
+    static atomic_uint machines;
+    snprintf(name, sizeof name, "/chip8-control-%d-%u", (int)getpid(), atomic_fetch_add(&machines, 1));
+    client->shared = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if(client->shared < 0){
+        SDL_Log("Unable to create shared memory for a control machine");
+        return false;
+    }
+    shm_unlink(name);
+    chip8_t *chip8 = MAP_FAILED;
+    if(ftruncate(client->shared, sizeof(chip8_t)) == 0){
+        chip8 = mmap(NULL, sizeof(chip8_t), PROT_READ | PROT_WRITE, MAP_SHARED, client->shared, 0);
+    }
+    if(chip8 == MAP_FAILED){
+        SDL_Log("Unable to map shared memory for a control machine");
+        close(client->shared);
+        return false;
+    }
+    client->chip8 = chip8;
+    return true;
+}
+
+bool control_load(control_client_t *client, const control_request_t *request, const uint8_t *rom){
+    const chip8_mode_t mode = request->arg & 0xFF;
+    const quirk_profile_t quirks = (request->arg >> 8) & 0xFF;
+    client->loaded = false;
+    if(mode > MODE_XOCHIP || quirks > QUIRKS_MODERN || !control_new_machine(client)) return false;
+
+    chip8_t *chip8 = client->chip8;
+    if(!load_chip8(chip8, rom, request->length, "control", mode)) return false;
+    chip8_set_quirks(chip8, quirks);
+    chip8_seed(chip8, client->config->seed);
+    // the JIT does not know XO-CHIP's long instructions
+    if(client->config->jit && mode != MODE_XOCHIP) chip8->jit = jit_create(*client->config);
+    client->frames = client->instructions = 0;
+    client->loaded = true;
+    return true;
+}
+
+// run count frames, stopping early once 00FD exits
+uint64_t control_frames(control_client_t *client, uint32_t count){
+    chip8_t *chip8 = client->chip8;
+    const uint32_t insts_per_frame = client->config->instructions_per_second / 60;
+    uint32_t f = 0;
+    for(; f < count && chip8->state != QUIT; f++){
+        const uint32_t ran = run_frame(chip8, client->config, insts_per_frame);
+        client->instructions += ran;
+        if(ran < insts_per_frame) break;
+        update_timers(chip8);
+    }
+    client->frames += f;
+    return f;
+}
+
+void control_registers(const control_client_t *client, control_registers_t *registers){
+    const chip8_t *chip8 = client->chip8;
+    memset(registers, 0, sizeof *registers);
+    memcpy(registers->V, chip8->V, sizeof registers->V);
+    memcpy(registers->stack, chip8->stack, sizeof registers->stack);
+    registers->I = chip8->I;
+    registers->PC = chip8->PC;
+    registers->stack_ptr = chip8->stack_ptr;
+    registers->delay_timer = chip8->delay_timer;
+    registers->sound_timer = chip8->sound_timer;
+    registers->running = chip8->state != QUIT;
+    registers->halted = is_halted(chip8);
+    registers->mode = chip8->mode;
+    registers->hires = chip8->hires;
+    registers->planes = chip8->planes;
+    registers->frames = client->frames;
+    registers->instructions = client->instructions;
+}
+
+// hand the shared memory object over with SCM_RIGHTS, after every reply queued before it
+bool control_share(control_client_t *client){
+    if(!control_send(client)) return false;
+    struct {
+        control_reply_t reply;
+        control_layout_t layout;
+    } message = {
+        { CONTROL_OK, sizeof(control_layout_t), 0 },
+        { sizeof(chip8_t), offsetof(chip8_t, display), offsetof(chip8_t, hires), offsetof(chip8_t, ram),
+          offsetof(chip8_t, V), offsetof(chip8_t, I), offsetof(chip8_t, PC), 0 },
+    };
+    struct iovec data = { &message, sizeof message };
+    union {
+        struct cmsghdr header;
+        char space[CMSG_SPACE(sizeof(int))];
+    } control = {0};
+    struct msghdr msg = { .msg_iov = &data, .msg_iovlen = 1, .msg_control = control.space, .msg_controllen = sizeof control.space };
+    struct cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type = SCM_RIGHTS;
+    cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+    memcpy(CMSG_DATA(cmsg), &client->shared, sizeof(int));
+    return sendmsg(client->socket, &msg, MSG_NOSIGNAL) == sizeof message;
+}
+
+// handle one request, false if the connection has to go
+bool control_handle(control_client_t *client, const control_request_t *request, const uint8_t *payload){
+    chip8_t *chip8 = client->chip8;
+    if(request->op != CONTROL_LOAD && request->op != CONTROL_SEED && !client->loaded){
+        return control_reply(client, CONTROL_NO_ROM, 0, 0) != NULL;
+    }
+
+    uint8_t *out;
+    switch(request->op){
+        case CONTROL_LOAD:
+            return control_reply(client, control_load(client, request, payload) ? CONTROL_OK : CONTROL_INVALID, 0, 0) != NULL;
+        case CONTROL_SEED:
+            if(client->loaded) chip8_seed(chip8, request->arg);
+            return control_reply(client, client->loaded ? CONTROL_OK : CONTROL_NO_ROM, 0, 0) != NULL;
+        case CONTROL_KEYS:
+            keypad_set(chip8, request->arg);
+            return control_reply(client, CONTROL_OK, 0, 0) != NULL;
+        case CONTROL_STEP: {
+            if(request->count > CONTROL_MAX_STEP) return control_reply(client, CONTROL_INVALID, 0, 0) != NULL;
+            // value = instructions run, up to and including a 00FD that exits
+            const uint32_t count = chip8->state != QUIT ? run_frame(chip8, client->config, request->count) : 0;
+            client->instructions += count;
+            return control_reply(client, CONTROL_OK, count, 0) != NULL;
+        }
+        case CONTROL_FRAMES:
+            // the same bound as STEP, in instructions
+            if((uint64_t)request->count * (client->config->instructions_per_second / 60) > CONTROL_MAX_STEP){
+                return control_reply(client, CONTROL_INVALID, 0, 0) != NULL;
+            }
+            return control_reply(client, CONTROL_OK, control_frames(client, request->count), 0) != NULL;
+        case CONTROL_REGISTERS: {
+            control_registers_t registers;
+            control_registers(client, &registers);
+            if((out = control_reply(client, CONTROL_OK, 0, sizeof registers)) == NULL) return false;
+            memcpy(out, &registers, sizeof registers);
+            return true;
+        }
+        case CONTROL_READ:
+            if(request->count > 65536) return control_reply(client, CONTROL_INVALID, 0, 0) != NULL;
+            if((out = control_reply(client, CONTROL_OK, 0, request->count)) == NULL) return false;
+            for(uint32_t i = 0; i < request->count; i++){
+                out[i] = chip8->ram[(request->arg + i) & chip8->ram_mask];
+            }
+            return true;
+        case CONTROL_WRITE:
+            for(uint32_t i = 0; i < request->length; i++){
+                chip8->ram[(request->arg + i) & chip8->ram_mask] = payload[i];
+            }
+            // a payload longer than ram wrapped over all of it
+            if(request->length > chip8->ram_mask) invalidate_decoded(chip8, 0, chip8->ram_mask);
+            else invalidate_decoded(chip8, request->arg & chip8->ram_mask, request->length);
+            return control_reply(client, CONTROL_OK, 0, 0) != NULL;
+        case CONTROL_DISPLAY:
+            if((out = control_reply(client, CONTROL_OK, framebuffer_hash(chip8), sizeof chip8->display)) == NULL) return false;
+            memcpy(out, chip8->display, sizeof chip8->display);
+            return true;
+        case CONTROL_SAVE: {
+            // the reply space is not necessarily aligned in the output buffer
+            static _Thread_local chip8_state_t state;
+            chip8_save_state(chip8, &state);
+            if((out = control_reply(client, CONTROL_OK, 0, state_size(&state))) == NULL) return false;
+            memcpy(out, &state, state_size(&state));
+            return true;
+        }
+        case CONTROL_RESTORE: {
+            // the payload is not necessarily aligned in the input buffer
+            static _Thread_local chip8_state_t state;
+            if(request->length < offsetof(chip8_state_t, ram) || request->length > sizeof state){
+                return control_reply(client, CONTROL_INVALID, 0, 0) != NULL;
+            }
+            memcpy(&state, payload, request->length);
+            if(!state_valid(&state) || state.mode != chip8->mode || request->length != state_size(&state)){
+                return control_reply(client, CONTROL_INVALID, 0, 0) != NULL;
+            }
+            chip8_load_state(chip8, &state);
+            return control_reply(client, CONTROL_OK, 0, 0) != NULL;
+        }
+        case CONTROL_SHARE:
+            return control_share(client);
+        default:
+            return control_reply(client, CONTROL_UNKNOWN, 0, 0) != NULL;
+    }
+}
+
+// one connection: read whatever has arrived, answer every complete request in it with one write
+void *control_serve(void *arg){
+    control_client_t *client = arg;
+    for(;;){
+        const ssize_t n = recv(client->socket, client->in + client->in_length, CONTROL_BUFFER - client->in_length, 0);
+        if(n <= 0) break;
+        client->in_length += n;
+
+        size_t at = 0;
+        bool ok = true;
+        while(ok && client->in_length - at >= sizeof(control_request_t)){
+            control_request_t request;
+            memcpy(&request, client->in + at, sizeof request);
+            if(request.length > CONTROL_MAX_PAYLOAD){
+                // the stream cannot be resynchronised past a bad header
+                ok = false;
+                break;
+            }
+            if(client->in_length - at < sizeof request + request.length) break;
+            ok = control_handle(client, &request, client->in + at + sizeof request);
+            at += sizeof request + request.length;
+        }
+        memmove(client->in, client->in + at, client->in_length - at);
+        client->in_length -= at;
+        if(!ok || !control_send(client)) break;
+    }
+
+    close(client->socket);
+    if(client->chip8){
+        jit_destroy(client->chip8->jit);
+        munmap(client->chip8, sizeof(chip8_t));
+        close(client->shared);
+    }
+    free(client);
+    return NULL;
+}
+
+// listen on config.control until killed, one thread per connection
+bool run_control(const config_t config){
+    struct sockaddr_un address = { .sun_family = AF_UNIX };
+    if(strlen(config.control) >= sizeof address.sun_path){
+        SDL_Log("Control socket path too long: %s", config.control);
+        return false;
+    }
+    strcpy(address.sun_path, config.control);
+
+    // a socket left behind by an earlier server is replaced, anything else is not touched
+    struct stat info;
+    if(stat(config.control, &info) == 0 && S_ISSOCK(info.st_mode)) unlink(config.control);
+
+    const int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if(listener < 0 || bind(listener, (struct sockaddr *)&address, sizeof address) != 0 || listen(listener, 64) != 0){
+        SDL_Log("Unable to listen on control socket: %s", config.control);
+        if(listener >= 0) close(listener);
+        return false;
+    }
+    fprintf(stderr, "control: listening on %s\n", config.control);
+
+    for(;;){
+        const int connection = accept(listener, NULL, NULL);
+        if(connection < 0) continue;
+        control_client_t *client = calloc(1, sizeof *client);
+        pthread_t thread;
+        if(client == NULL){
+            SDL_Log("Unable to allocate control connection");
+            close(connection);
+            continue;
+        }
+        client->socket = connection;
+        client->config = &config;
+        client->shared = -1;
+        if(pthread_create(&thread, NULL, control_serve, client) != 0){
+            SDL_Log("Unable to start control connection thread");
+            close(connection);
+            free(client);
+            continue;
+        }
+        pthread_detach(thread);
+    }
+}
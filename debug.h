@@ -13,7 +13,23 @@ void print_debug_info(chip8_t *chip8) {
                 // Set program counter to last address on subroutine stack ("pop" it off the stack)
                 //   so that next opcode will be gotten from that address.
                 printf("Return from subroutine to address 0x%04X\n",
-                       *(chip8->stack_ptr - 1));
+                       chip8->stack[(chip8->stack_ptr - 1) & 15]);
+            } else if (chip8->mode != MODE_CHIP8 && chip8->inst.X == 0 && chip8->inst.Y == 0xC) {
+                // 0x00CN: Scroll the display down N rows (SCHIP)
+                printf("Scroll display down N (%u) rows\n", chip8->inst.N);
+            } else if (chip8->mode == MODE_XOCHIP && chip8->inst.X == 0 && chip8->inst.Y == 0xD) {
+                // 0x00DN: Scroll the display up N rows (XO-CHIP)
+                printf("Scroll display up N (%u) rows\n", chip8->inst.N);
+            } else if (chip8->mode != MODE_CHIP8 && chip8->inst.NNN == 0x0FB) {
+                printf("Scroll display right 4 pixels\n");
+            } else if (chip8->mode != MODE_CHIP8 && chip8->inst.NNN == 0x0FC) {
+                printf("Scroll display left 4 pixels\n");
+            } else if (chip8->mode != MODE_CHIP8 && chip8->inst.NNN == 0x0FD) {
+                printf("Exit interpreter\n");
+            } else if (chip8->mode != MODE_CHIP8 && chip8->inst.NNN == 0x0FE) {
+                printf("Switch to 64x32 lores display\n");
+            } else if (chip8->mode != MODE_CHIP8 && chip8->inst.NNN == 0x0FF) {
+                printf("Switch to 128x64 hires display\n");
             } else {
                 printf("Unimplemented Opcode.\n");
             }
@@ -47,6 +63,12 @@ void print_debug_info(chip8_t *chip8) {
             break;
 
         case 0x05:
+            if (chip8->mode == MODE_XOCHIP && (chip8->inst.N == 0x2 || chip8->inst.N == 0x3)) {
+                // 0x5XY2/0x5XY3: Store/load VX through VY at memory from I, I unchanged (XO-CHIP)
+                printf("Register %s V%X-V%X inclusive at memory from I (0x%04X)\n",
+                       chip8->inst.N == 0x2 ? "dump" : "load", chip8->inst.X, chip8->inst.Y, chip8->I);
+                break;
+            }
             // 0x5XY0: Check if VX == VY, if so, skip the next instruction
             printf("Check if V%X (0x%02X) == V%X (0x%02X), skip next instruction if true\n",
                    chip8->inst.X, chip8->V[chip8->inst.X], 
@@ -116,13 +138,15 @@ void print_debug_info(chip8_t *chip8) {
                            (chip8->V[chip8->inst.Y] <= chip8->V[chip8->inst.X]));
                     break;
 
-                case 6:
-                    // 0x8XY6: Set register VX >>= 1, store shifted off bit in VF
-                    printf("Set register V%X (0x%02X) >>= 1, VF = shifted off bit (%X); Result: 0x%02X\n",
-                           chip8->inst.X, chip8->V[chip8->inst.X],
-                           chip8->V[chip8->inst.X] & 1,
-                           chip8->V[chip8->inst.X] >> 1);
+                case 6: {
+                    // 0x8XY6: Set register VX = VX >> 1 (or VY >> 1, per quirks), store shifted off bit in VF
+                    const uint8_t src = quirk_table[chip8->quirks].shift_vy ? chip8->inst.Y : chip8->inst.X;
+                    printf("Set register V%X = V%X (0x%02X) >> 1, VF = shifted off bit (%X); Result: 0x%02X\n",
+                           chip8->inst.X, src, chip8->V[src],
+                           chip8->V[src] & 1,
+                           chip8->V[src] >> 1);
                     break;
+                }
 
                 case 7:
                     // 0x8XY7: Set register VX = VY - VX, set VF to 1 if there is not a borrow (result is positive/0)
@@ -133,13 +157,15 @@ void print_debug_info(chip8_t *chip8) {
                            (chip8->V[chip8->inst.X] <= chip8->V[chip8->inst.Y]));
                     break;
 
-                case 0xE:
-                    // 0x8XYE: Set register VX <<= 1, store shifted off bit in VF
-                    printf("Set register V%X (0x%02X) <<= 1, VF = shifted off bit (%X); Result: 0x%02X\n",
-                           chip8->inst.X, chip8->V[chip8->inst.X],
-                           (chip8->V[chip8->inst.X] & 0x80) >> 7,
-                           chip8->V[chip8->inst.X] << 1);
+                case 0xE: {
+                    // 0x8XYE: Set register VX = VX << 1 (or VY << 1, per quirks), store shifted off bit in VF
+                    const uint8_t src = quirk_table[chip8->quirks].shift_vy ? chip8->inst.Y : chip8->inst.X;
+                    printf("Set register V%X = V%X (0x%02X) << 1, VF = shifted off bit (%X); Result: 0x%02X\n",
+                           chip8->inst.X, src, chip8->V[src],
+                           (chip8->V[src] & 0x80) >> 7,
+                           (uint8_t)(chip8->V[src] << 1));
                     break;
+                }
 
                 default:
                     // Wrong/unimplemented opcode
@@ -160,11 +186,13 @@ void print_debug_info(chip8_t *chip8) {
                    chip8->inst.NNN);
             break;
 
-        case 0x0B:
-            // 0xBNNN: Jump to V0 + NNN
-            printf("Set PC to V0 (0x%02X) + NNN (0x%04X); Result PC = 0x%04X\n",
-                   chip8->V[0], chip8->inst.NNN, chip8->V[0] + chip8->inst.NNN);
+        case 0x0B: {
+            // 0xBNNN: Jump to V0 + NNN (SCHIP quirks: VX + XNN)
+            const uint8_t reg = quirk_table[chip8->quirks].jump_vx ? chip8->inst.X : 0;
+            printf("Set PC to V%X (0x%02X) + NNN (0x%04X); Result PC = 0x%04X\n",
+                   reg, chip8->V[reg], chip8->inst.NNN, chip8->V[reg] + chip8->inst.NNN);
             break;
+        }
 
         case 0x0C:
             // 0xCXNN: Sets register VX = rand() % 256 & NN (bitwise AND)
@@ -235,6 +263,41 @@ void print_debug_info(chip8_t *chip8) {
                            chip8->inst.X, chip8->V[chip8->inst.X], chip8->V[chip8->inst.X] * 5);
                     break;
 
+                case 0x30:
+                    // 0xFX30: Set I to the big 8x10 font sprite for the digit in VX (SCHIP)
+                    printf("Set I to big sprite location in memory for digit in V%X (0x%02X)\n",
+                           chip8->inst.X, chip8->V[chip8->inst.X]);
+                    break;
+
+                case 0x75:
+                case 0x85:
+                    // 0xFX75/0xFX85: Save/restore V0-VX to the flag registers (SCHIP)
+                    printf("%s V0-V%X inclusive %s flag registers\n",
+                           chip8->inst.NN == 0x75 ? "Save" : "Restore", chip8->inst.X,
+                           chip8->inst.NN == 0x75 ? "to" : "from");
+                    break;
+
+                case 0x00:
+                    // 0xF000 NNNN: Set I to the 16 bit address in the next word (XO-CHIP)
+                    printf("Set I to NNNN (0x%02X%02X)\n", chip8->ram[chip8->PC & chip8->ram_mask],
+                           chip8->ram[(chip8->PC + 1) & chip8->ram_mask]);
+                    break;
+
+                case 0x01:
+                    // 0xFN01: Select bitplanes to draw on (XO-CHIP)
+                    printf("Select bitplanes N (%u)\n", chip8->inst.X & 3);
+                    break;
+
+                case 0x02:
+                    // 0xF002: Load the 16 byte audio pattern from memory at I (XO-CHIP)
+                    printf("Load audio pattern from memory at I (0x%04X)\n", chip8->I);
+                    break;
+
+                case 0x3A:
+                    // 0xFX3A: Set the audio pattern pitch to VX (XO-CHIP)
+                    printf("Set audio pitch = V%X (0x%02X)\n", chip8->inst.X, chip8->V[chip8->inst.X]);
+                    break;
+
                 case 0x33:
                     // 0xFX33: Store BCD representation of VX at memory offset from I;
                     //   I = hundred's place, I+1 = ten's place, I+2 = one's place
@@ -244,14 +307,14 @@ void print_debug_info(chip8_t *chip8) {
 
                 case 0x55:
                     // 0xFX55: Register dump V0-VX inclusive to memory offset from I;
-                    //   SCHIP does not inrement I, CHIP8 does increment I
+                    //   I is left past VX with the memory_i quirk
                     printf("Register dump V0-V%X (0x%02X) inclusive at memory from I (0x%04X)\n",
                            chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
                     break;
 
                 case 0x65:
                     // 0xFX65: Register load V0-VX inclusive from memory offset from I;
-                    //   SCHIP does not inrement I, CHIP8 does increment I
+                    //   I is left past VX with the memory_i quirk
                     printf("Register load V0-V%X (0x%02X) inclusive at memory from I (0x%04X)\n",
                            chip8->inst.X, chip8->V[chip8->inst.X], chip8->I);
                     break;
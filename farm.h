@@ -0,0 +1,265 @@
+// Farm runner: many chip8 machines in one process, spread over all cores
+//
+// Every ROM given on the command line is loaded --instances times. Each
+// worker thread owns a deque of instance indices; it advances an instance by
+// FARM_SLICE_FRAMES frames, then pushes it back on its own deque. A worker
+// whose deque runs dry steals from the head of another worker's deque.
+// Instances share nothing, the CXNN random state lives in each chip8_t.
+// With --library the ROMs come from the library (all of it when none are
+// named), each mapped once for all its instances and run with its own mode
+// and clock rate.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#define FARM_SLICE_FRAMES 60    // frames run per scheduling quantum (1 emulated second)
+
+typedef struct {
+    char *rom_name;
+    uint32_t instance;      // copy number of this ROM
+    config_t config;        // run settings, a library ROM brings its own mode and clock rate
+    chip8_t chip8;
+    uint64_t frames;
+    uint64_t instructions;
+    bool halted;            // stopped on a jump to itself
+    bool done;
+} farm_instance_t;
+
+// one worker's tasks, the owner works at the tail and thieves take from the head
+typedef struct {
+    pthread_mutex_t lock;
+    uint32_t *tasks;        // ring buffer of instance indices
+    uint32_t head;
+    uint32_t tail;
+    uint32_t capacity;
+} farm_deque_t;
+
+typedef struct {
+    farm_instance_t *instances;
+    uint32_t instance_count;
+    farm_deque_t *deques;
+    uint32_t worker_count;
+    atomic_uint remaining;  // instances not done yet
+} farm_t;
+
+typedef struct {
+    farm_t *farm;
+    uint32_t id;
+} farm_worker_t;
+
+void farm_push(farm_deque_t *deque, uint32_t task){
+    pthread_mutex_lock(&deque->lock);
+    deque->tasks[deque->tail++ % deque->capacity] = task;
+    pthread_mutex_unlock(&deque->lock);
+}
+
+bool farm_pop(farm_deque_t *deque, uint32_t *task){
+    bool found = false;
+    pthread_mutex_lock(&deque->lock);
+    if(deque->tail != deque->head){
+        *task = deque->tasks[--deque->tail % deque->capacity];
+        found = true;
+    }
+    pthread_mutex_unlock(&deque->lock);
+    return found;
+}
+
+bool farm_steal(farm_t *farm, uint32_t thief, uint32_t *task){
+    for(uint32_t i = 1; i < farm->worker_count; i++){
+        farm_deque_t *victim = &farm->deques[(thief + i) % farm->worker_count];
+        bool found = false;
+        pthread_mutex_lock(&victim->lock);
+        if(victim->tail != victim->head){
+            *task = victim->tasks[victim->head++ % victim->capacity];
+            found = true;
+        }
+        pthread_mutex_unlock(&victim->lock);
+        if(found) return true;
+    }
+    return false;
+}
+
+// a ROM parked on "jump to self" will never do anything again
+bool is_halted(const chip8_t *chip8){
+    const uint16_t pc = chip8->PC & chip8->ram_mask;
+    const uint16_t opcode = (chip8->ram[pc] << 8) | chip8->ram[(pc + 1) & chip8->ram_mask];
+    return opcode == (0x1000 | pc);
+}
+
+// run one instance for up to FARM_SLICE_FRAMES frames
+void farm_advance(farm_instance_t *instance){
+    const config_t *config = &instance->config;
+    const uint32_t insts_per_frame = config->instructions_per_second / 60;
+
+    for(uint32_t f = 0; f < FARM_SLICE_FRAMES; f++){
+        if((config->max_frames && instance->frames >= config->max_frames) ||
+           (config->max_instructions && instance->instructions >= config->max_instructions)){
+            instance->done = true;
+            return;
+        }
+
+        uint32_t count = insts_per_frame;
+        if(config->max_instructions && config->max_instructions - instance->instructions < count){
+            count = config->max_instructions - instance->instructions;
+        }
+        const uint32_t ran = run_frame(&instance->chip8, config, count);
+        instance->instructions += ran;
+        if(ran == insts_per_frame){
+            update_timers(&instance->chip8);
+            instance->frames++;
+        }
+
+        // parked on a jump to itself, or exited with 00FD
+        if(instance->chip8.state == QUIT || is_halted(&instance->chip8)){
+            instance->halted = true;
+            instance->done = true;
+            return;
+        }
+    }
+}
+
+void *farm_worker(void *arg){
+    farm_worker_t *worker = arg;
+    farm_t *farm = worker->farm;
+    farm_deque_t *own = &farm->deques[worker->id];
+
+    while(atomic_load(&farm->remaining) > 0){
+        uint32_t task;
+        if(!farm_pop(own, &task) && !farm_steal(farm, worker->id, &task)){
+            // everything left is being run by other workers
+            sched_yield();
+            continue;
+        }
+
+        farm_instance_t *instance = &farm->instances[task];
+        farm_advance(instance);
+        if(instance->done){
+            atomic_fetch_sub(&farm->remaining, 1);
+        }
+        else{
+            farm_push(own, task);
+        }
+    }
+    return NULL;
+}
+
+// run every ROM in config.roms config.instances times, print one result line per instance
+// library is NULL unless --library was given, ROM names are then looked up in it
+bool run_farm(const config_t config, library_t *library){
+    farm_t farm = {
+        .instance_count = config.rom_count * config.instances,
+    };
+
+    uint32_t workers = config.threads;
+    if(workers == 0){
+        const long cores = sysconf(_SC_NPROCESSORS_ONLN);
+        workers = cores > 0 ? cores : 1;
+    }
+    if(workers > farm.instance_count) workers = farm.instance_count;
+    farm.worker_count = workers;
+
+    farm.instances = calloc(farm.instance_count, sizeof(farm_instance_t));
+    farm.deques = calloc(workers, sizeof(farm_deque_t));
+    farm_worker_t *worker_args = calloc(workers, sizeof(farm_worker_t));
+    pthread_t *threads = calloc(workers, sizeof(pthread_t));
+    if(!farm.instances || !farm.deques || !worker_args || !threads){
+        SDL_Log("Unable to allocate %u farm instances", farm.instance_count);
+        return false;
+    }
+
+    for(uint32_t w = 0; w < workers; w++){
+        pthread_mutex_init(&farm.deques[w].lock, NULL);
+        farm.deques[w].capacity = farm.instance_count;
+        farm.deques[w].tasks = calloc(farm.instance_count, sizeof(uint32_t));
+        if(farm.deques[w].tasks == NULL){
+            SDL_Log("Unable to allocate farm task queue");
+            return false;
+        }
+    }
+
+    // every instance can start from one mapped state file, each restore is a few memcpys
+    const chip8_state_t *start_state = NULL;
+    if(config.load_state){
+        start_state = map_state_file(config.load_state);
+        if(start_state == NULL) return false;
+    }
+
+    // load every instance and deal them out round robin
+    library_entry_t *entry = NULL;
+    const uint8_t *image = NULL;
+    for(uint32_t i = 0; i < farm.instance_count; i++){
+        farm_instance_t *instance = &farm.instances[i];
+        instance->rom_name = config.roms[i / config.instances];
+        instance->instance = i % config.instances;
+        instance->config = config;
+        if(library){
+            // map each ROM once, its instances all boot from the same mapping
+            if(instance->instance == 0){
+                entry = library_find(library, instance->rom_name);
+                if(entry == NULL || (image = library_map(library, entry)) == NULL) return false;
+            }
+            library_apply(entry, &instance->config);
+            const bool loaded = load_chip8(&instance->chip8, image, entry->size, entry->name, instance->config.mode);
+            if(instance->instance == config.instances - 1) library_unmap(entry, image);
+            if(!loaded) return false;
+            if(instance->config.mode == MODE_XOCHIP) instance->config.jit = false;
+        }
+        else if(!init_chip8(&instance->chip8, instance->rom_name, config.mode)) return false;
+        chip8_set_quirks(&instance->chip8, instance->config.quirks);
+        if(start_state){
+            if(start_state->mode != instance->chip8.mode){
+                SDL_Log("State file was saved in another --mode: %s", config.load_state);
+                return false;
+            }
+            chip8_load_state(&instance->chip8, start_state);
+        }
+        // reseeded after the restore so instances still draw different CXNN numbers
+        chip8_seed(&instance->chip8, config.seed + i);
+        if(instance->config.jit){
+            instance->chip8.jit = jit_create(instance->config);
+        }
+        farm_push(&farm.deques[i % workers], i);
+    }
+    if(start_state) unmap_state_file(start_state);
+    atomic_store(&farm.remaining, farm.instance_count);
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for(uint32_t w = 0; w < workers; w++){
+        worker_args[w] = (farm_worker_t){ .farm = &farm, .id = w };
+        pthread_create(&threads[w], NULL, farm_worker, &worker_args[w]);
+    }
+    for(uint32_t w = 0; w < workers; w++){
+        pthread_join(threads[w], NULL);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    // per-instance result records
+    uint64_t total_instructions = 0;
+    printf("rom,instance,frames,instructions,halted,framebuffer_hash\n");
+    for(uint32_t i = 0; i < farm.instance_count; i++){
+        const farm_instance_t *instance = &farm.instances[i];
+        printf("%s,%u,%" PRIu64 ",%" PRIu64 ",%d,0x%016" PRIX64 "\n",
+               instance->rom_name, instance->instance, instance->frames,
+               instance->instructions, instance->halted, framebuffer_hash(&instance->chip8));
+        total_instructions += instance->instructions;
+        jit_destroy(instance->chip8.jit);
+    }
+
+    const double seconds = elapsed_seconds(start, end);
+    fprintf(stderr, "instances: %u, threads: %u, instructions: %" PRIu64 ", seconds: %.6f, instructions_per_second: %.0f\n",
+            farm.instance_count, workers, total_instructions, seconds,
+            seconds > 0 ? total_instructions / seconds : 0);
+
+    for(uint32_t w = 0; w < workers; w++){
+        pthread_mutex_destroy(&farm.deques[w].lock);
+        free(farm.deques[w].tasks);
+    }
+    free(threads);
+    free(worker_args);
+    free(farm.deques);
+    free(farm.instances);
+    return true;
+}
@@ -0,0 +1,124 @@
+// Fuzzing harness: arbitrary bytes as a ROM, for libFuzzer and AFL++
+//
+// Built with -DFUZZ the emulator's main() is left out and the input is
+//     byte 0      bits 0-1 mode (3 = CHIP-8), bits 2-3 quirk profile, bit 4 idle skipping
+//     bytes 1-2   keys held, one bit per key
+//     the rest    ROM image at 0x200
+// Each input runs for FUZZ_FRAMES frames through run_instructions(), the
+// timers ticking between frames. Nothing is read from disk per input: the
+// booted machine of every mode is kept as a save state, and restoring it
+// only re-decodes the ram the previous input changed. The run is checked
+// against the machine's invariants, and abort()s when one breaks so the
+// fuzzer keeps the input.
+//
+// make fuzz builds for libFuzzer (clang -fsanitize=fuzzer), make fuzz-afl for
+// AFL++ persistent mode; other compilers get a main() that runs the files
+// named on the command line, or stdin, once each to reproduce a crash.
+
+#define FUZZ_FRAMES 16
+#define FUZZ_FRAME_INSTRUCTIONS 64
+
+typedef struct {
+    chip8_t chip8;
+    chip8_state_t boot[3];  // per mode, just after load_chip8 with an empty ROM
+    config_t config;
+} fuzz_t;
+
+fuzz_t *fuzz_init(void){
+    static fuzz_t *fuzz;
+    if(fuzz) return fuzz;
+    fuzz = calloc(1, sizeof *fuzz);
+    if(fuzz == NULL) abort();
+
+    for(chip8_mode_t mode = MODE_CHIP8; mode <= MODE_XOCHIP; mode++){
+        memset(&fuzz->chip8, 0, sizeof fuzz->chip8);
+        load_chip8(&fuzz->chip8, (const uint8_t[1]){0}, 0, "fuzz", mode);
+        chip8_seed(&fuzz->chip8, 1);
+        chip8_save_state(&fuzz->chip8, &fuzz->boot[mode]);
+    }
+    fuzz->config = (config_t){ .instructions_per_second = 500 };
+    return fuzz;
+}
+
+// what no ROM should be able to do to the machine
+void fuzz_check(const chip8_t *chip8, chip8_mode_t mode){
+    const char *broken = chip8->mode != mode ? "mode changed" :
+                         chip8->planes > 3 ? "planes out of range" :
+                         chip8->rng_state == 0 ? "random state stuck at 0" :
+                         chip8->mode == MODE_CHIP8 && chip8->hires ? "hires outside SCHIP/XO-CHIP" : NULL;
+    if(broken){
+        fprintf(stderr, "fuzz: %s at PC 0x%04X\n", broken, chip8->PC);
+        abort();
+    }
+}
+
+void fuzz_one(const uint8_t *data, size_t size){
+    fuzz_t *fuzz = fuzz_init();
+    chip8_t *chip8 = &fuzz->chip8;
+    if(size < 3) return;
+
+    chip8_mode_t mode = data[0] & 3;
+    if(mode > MODE_XOCHIP) mode = MODE_CHIP8;
+    quirk_profile_t quirks = (data[0] >> 2) & 3;
+    if(quirks == QUIRKS_MODE) quirks = mode_quirks(mode);
+    fuzz->config.idle = data[0] & 0x10;
+
+    // the boot state, with only what the last input changed decoded again,
+    // unless it ran another mode or profile and decoded to other handlers
+    const bool same_handlers = chip8->mode == mode && chip8->quirks == quirks;
+    chip8_load_state(chip8, &fuzz->boot[mode]);
+    if(!same_handlers) memset(chip8->decode_cache, 0, sizeof chip8->decode_cache);
+    chip8->state = RUNNING;
+    chip8->quirks = quirks;
+    keypad_set(chip8, data[1] | data[2] << 8);
+    chip8->idle_period = 0;
+
+    size_t rom_size = size - 3;
+    if(rom_size > chip8->ram_mask + 1u - 0x200) rom_size = chip8->ram_mask + 1u - 0x200;
+    memcpy(&chip8->ram[0x200], data + 3, rom_size);
+    invalidate_decoded(chip8, 0x200, rom_size);
+
+    for(int frame = 0; frame < FUZZ_FRAMES && chip8->state != QUIT; frame++){
+        run_instructions(chip8, &fuzz->config, FUZZ_FRAME_INSTRUCTIONS);
+        update_timers(chip8);
+    }
+    fuzz_check(chip8, mode);
+}
+
+int LLVMFuzzerTestOneInput(const uint8_t *data, size_t size){
+    fuzz_one(data, size);
+    return 0;
+}
+
+#ifndef FUZZ_LIBFUZZER
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+__AFL_FUZZ_INIT();
+#endif
+
+int main(int argc, char *argv[]){
+#ifdef __AFL_FUZZ_TESTCASE_LEN
+    // persistent mode: AFL++ hands over inputs in shared memory, no fork or read per input
+    fuzz_init();
+    __AFL_INIT();
+    const uint8_t *data = __AFL_FUZZ_TESTCASE_BUF;
+    while(__AFL_LOOP(100000)){
+        fuzz_one(data, __AFL_FUZZ_TESTCASE_LEN);
+    }
+    return 0;
+#endif
+
+    // one input per file, or stdin
+    static uint8_t data[3 + sizeof(((chip8_t *)0)->ram)];
+    for(int i = argc > 1 ? 1 : 0; i < argc; i++){
+        FILE *file = argc > 1 ? fopen(argv[i], "rb") : stdin;
+        if(file == NULL){
+            SDL_Log("Unable to open fuzz input: %s", argv[i]);
+            return 1;
+        }
+        const size_t size = fread(data, 1, sizeof data, file);
+        if(file != stdin) fclose(file);
+        fuzz_one(data, size);
+    }
+    return 0;
+}
+#endif
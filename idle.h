@@ -0,0 +1,52 @@
+// Idle detection: wait loops that cannot end before the next frame
+//
+// Keys only change and timers only tick between frames, so once a ROM is
+// parked in FX0A with no key held, on a jump to itself, or in the usual
+// delay timer poll
+//     loop: FX07      VX = delay timer
+//           3XNN      skip if VX == NN
+//           1NNN loop
+// with the timer not at NN, the rest of the frame just goes round the loop.
+// The handlers spot these loops and the dispatch loops jump over every whole
+// turn left in the frame, leaving the machine exactly where spinning would.
+// Skipped instructions are counted in idle_instructions.
+
+// 1NNN at addr closes a wait loop: instructions per turn, 0 if it does not
+uint8_t idle_jump_period(const chip8_t *chip8, uint16_t addr){
+    const uint16_t opcode = (chip8->ram[addr] << 8) | chip8->ram[(addr + 1) & chip8->ram_mask];
+    if(opcode >> 12 != 0x1) return 0;
+
+    const uint16_t target = opcode & 0x0FFF;
+    if(target == addr) return 1;
+    if(target + 4 != addr) return 0;
+
+    const uint16_t load = (chip8->ram[target] << 8) | chip8->ram[target + 1];
+    const uint16_t test = (chip8->ram[target + 2] << 8) | chip8->ram[target + 3];
+    if((load & 0xF0FF) != 0xF007 || (test & 0xFF00) != (0x3000 | (load & 0x0F00))) return 0;
+    return 3;
+}
+
+// parked on FX0A with no key held, only input can move it on
+bool waiting_for_key(const chip8_t *chip8){
+    const uint16_t pc = chip8->PC & chip8->ram_mask;
+    if(chip8->ram[pc] >> 4 != 0xF || chip8->ram[(pc + 1) & chip8->ram_mask] != 0x0A) return false;
+    for(int key = 0; key < 16; key++){
+        if(chip8->keypad[key]) return false;
+    }
+    return true;
+}
+
+// a handler found a wait loop: jump over its whole turns in the remaining instructions
+uint32_t idle_skip(chip8_t *chip8, uint32_t remaining){
+    const uint32_t period = chip8->idle_period;
+    chip8->idle_period = 0;
+    if(period == 0) return 0;
+
+    const uint32_t skipped = remaining / period * period;
+    if(skipped && period == 3){
+        // what the FX07 at the loop head would have left in VX
+        chip8->V[chip8->ram[chip8->PC & chip8->ram_mask] & 0x0F] = chip8->delay_timer;
+    }
+    chip8->idle_instructions += skipped;
+    return skipped;
+}
@@ -0,0 +1,361 @@
+// x86-64 dynamic recompiler for straight-line CHIP8 code
+//
+// A block starts at any address the interpreter is about to execute and runs
+// until the first jump, call, skip or unsupported opcode. Inside a block I and
+// PC live in host registers (esi, immediates), V[] is worked on in place via
+// [rdi + offset] operands, rdi holding the chip8_t pointer.
+// Blocks never write ram; FX33/FX55 run in the interpreter and flush the
+// block cache through invalidate_decoded() when they hit translated bytes.
+
+#if defined(__x86_64__)
+#include <stddef.h>
+#include <sys/mman.h>
+
+#define JIT_CODE_SIZE (1 << 20)   // executable arena, flushed when full
+#define JIT_MAX_BLOCK 32          // max chip8 instructions per block
+#define JIT_MAX_BYTES 64          // upper bound of host bytes per chip8 instruction
+
+typedef void (*jit_block_t)(chip8_t *chip8);
+
+struct jit {
+    uint8_t *code;                  // RWX arena
+    size_t used;
+    uint8_t max_block;              // never longer than one frame of instructions
+    jit_block_t block[4096];        // compiled block by start address
+    uint8_t length[4096];           // chip8 instructions in block, 0 = not compiled
+    bool failed[4096];              // first instruction unsupported, always interpret
+    bool covered[4096];             // ram bytes some block was translated from
+};
+
+// emit helpers
+typedef struct {
+    uint8_t *p;
+} jit_emit_t;
+
+void emit8(jit_emit_t *e, uint8_t byte){ *e->p++ = byte; }
+void emit16(jit_emit_t *e, uint16_t word){ memcpy(e->p, &word, 2); e->p += 2; }
+void emit32(jit_emit_t *e, uint32_t dword){ memcpy(e->p, &dword, 4); e->p += 4; }
+
+// <op> [rdi + disp32] with modrm reg field
+void emit_mem(jit_emit_t *e, uint8_t op, uint8_t reg, uint32_t disp){
+    emit8(e, op);
+    emit8(e, 0x80 | (reg << 3) | 7);
+    emit32(e, disp);
+}
+
+#define V_OFF(x)  ((uint32_t)(offsetof(chip8_t, V) + (x)))
+#define I_OFF     ((uint32_t)offsetof(chip8_t, I))
+#define PC_OFF    ((uint32_t)offsetof(chip8_t, PC))
+#define DT_OFF    ((uint32_t)offsetof(chip8_t, delay_timer))
+#define ST_OFF    ((uint32_t)offsetof(chip8_t, sound_timer))
+#define SP_OFF    ((uint32_t)offsetof(chip8_t, stack_ptr))
+#define STACK_OFF ((uint32_t)offsetof(chip8_t, stack))
+
+enum { JIT_BODY, JIT_END_BEFORE, JIT_END_AFTER };
+
+// classify an opcode: part of a block body, block terminator, or not translatable
+int jit_classify(uint16_t opcode){
+    switch(opcode >> 12){
+        case 0x1: case 0x2:
+        case 0x3: case 0x4:
+            return JIT_END_AFTER;
+        case 0x5: case 0x9:
+            return (opcode & 0xF) == 0 ? JIT_END_AFTER : JIT_END_BEFORE;
+        case 0x6: case 0x7: case 0xA:
+            return JIT_BODY;
+        case 0x8:
+            switch(opcode & 0xF){
+                case 0x0: case 0x1: case 0x2: case 0x3: case 0x4:
+                case 0x5: case 0x6: case 0x7: case 0xE:
+                    return JIT_BODY;
+                default:
+                    return JIT_END_BEFORE;
+            }
+        case 0xF:
+            switch(opcode & 0xFF){
+                case 0x07: case 0x15: case 0x18: case 0x1E: case 0x29:
+                    return JIT_BODY;
+                default:
+                    return JIT_END_BEFORE;
+            }
+        default:
+            return JIT_END_BEFORE;
+    }
+}
+
+// PC = cond ? ecx : eax, flags must already hold the comparison
+void emit_skip(jit_emit_t *e, uint8_t cmov_cond){
+    emit8(e, 0x0F); emit8(e, cmov_cond); emit8(e, 0xC1);     // cmovcc eax, ecx
+    emit8(e, 0x66); emit_mem(e, 0x89, 0, PC_OFF);            // mov [PC], ax
+}
+
+// translate one instruction at addr, quirk checks happen here rather than in the emitted code
+void jit_emit_instruction(jit_emit_t *e, uint16_t opcode, uint16_t addr, const quirks_t *quirks){
+    const uint8_t X = (opcode >> 8) & 0xF;
+    const uint8_t Y = (opcode >> 4) & 0xF;
+    const uint8_t NN = opcode & 0xFF;
+    const uint16_t NNN = opcode & 0xFFF;
+    const uint16_t next = addr + 2;
+
+    switch(opcode >> 12){
+        case 0x1:
+            // PC = NNN
+            emit8(e, 0x66); emit_mem(e, 0xC7, 0, PC_OFF); emit16(e, NNN);
+            break;
+        case 0x2:
+            // stack[stack_ptr & 15] = next; stack_ptr = (stack_ptr + 1) & 15; PC = NNN
+            emit8(e, 0x0F); emit_mem(e, 0xB6, 0, SP_OFF);            // movzx eax, byte [stack_ptr]
+            emit8(e, 0x83); emit8(e, 0xE0); emit8(e, 0x0F);         // and eax, 15
+            emit8(e, 0x66); emit8(e, 0xC7); emit8(e, 0x84); emit8(e, 0x47); // mov word [rdi + rax*2 + stack], next
+            emit32(e, STACK_OFF); emit16(e, next);
+            emit_mem(e, 0xFE, 0, SP_OFF);                           // inc byte [stack_ptr]
+            emit_mem(e, 0x80, 4, SP_OFF); emit8(e, 0x0F);           // and byte [stack_ptr], 15
+            emit8(e, 0x66); emit_mem(e, 0xC7, 0, PC_OFF); emit16(e, NNN);
+            break;
+        case 0x3: case 0x4: case 0x5: case 0x9:
+            emit8(e, 0xB8); emit32(e, next);                        // mov eax, next
+            emit8(e, 0xB9); emit32(e, (uint16_t)(next + 2));        // mov ecx, next + 2
+            if((opcode >> 12) == 0x3 || (opcode >> 12) == 0x4){
+                emit_mem(e, 0x80, 7, V_OFF(X)); emit8(e, NN);       // cmp byte [VX], NN
+            }
+            else{
+                emit_mem(e, 0x8A, 2, V_OFF(X));                     // mov dl, [VX]
+                emit_mem(e, 0x3A, 2, V_OFF(Y));                     // cmp dl, [VY]
+            }
+            // 3/5 skip when equal, 4/9 when not equal
+            emit_skip(e, ((opcode >> 12) == 0x3 || (opcode >> 12) == 0x5) ? 0x44 : 0x45);
+            break;
+        case 0x6:
+            emit_mem(e, 0xC6, 0, V_OFF(X)); emit8(e, NN);           // mov byte [VX], NN
+            break;
+        case 0x7:
+            emit_mem(e, 0x80, 0, V_OFF(X)); emit8(e, NN);           // add byte [VX], NN
+            break;
+        case 0x8:
+            switch(opcode & 0xF){
+                case 0x0:
+                    emit_mem(e, 0x8A, 0, V_OFF(Y));                 // mov al, [VY]
+                    emit_mem(e, 0x88, 0, V_OFF(X));                 // mov [VX], al
+                    break;
+                case 0x1: case 0x2: case 0x3:
+                    emit_mem(e, 0x8A, 0, V_OFF(Y));                 // mov al, [VY]
+                    // or / and / xor [VX], al
+                    emit_mem(e, (opcode & 0xF) == 1 ? 0x08 : (opcode & 0xF) == 2 ? 0x20 : 0x30, 0, V_OFF(X));
+                    if(quirks->vf_reset){
+                        emit_mem(e, 0xC6, 0, V_OFF(0xF)); emit8(e, 0); // mov byte [VF], 0
+                    }
+                    break;
+                case 0x4: case 0x5: case 0x7: {
+                    // VF is written before VX like the interpreter, so VX/VY may alias VF
+                    const uint8_t a = (opcode & 0xF) == 0x7 ? Y : X;
+                    const uint8_t b = (opcode & 0xF) == 0x7 ? X : Y;
+                    const uint8_t alu = (opcode & 0xF) == 0x4 ? 0x02 : 0x2A;  // add / sub al, m8
+                    emit_mem(e, 0x8A, 0, V_OFF(a));                 // mov al, [a]
+                    if((opcode & 0xF) == 0x4){
+                        emit_mem(e, 0x02, 0, V_OFF(b));             // add al, [b]
+                        emit8(e, 0x0F); emit8(e, 0x92); emit8(e, 0xC1); // setc cl
+                    }
+                    else{
+                        emit_mem(e, 0x3A, 0, V_OFF(b));             // cmp al, [b]
+                        emit8(e, 0x0F); emit8(e, 0x93); emit8(e, 0xC1); // setae cl
+                    }
+                    emit_mem(e, 0x88, 1, V_OFF(0xF));               // mov [VF], cl
+                    emit_mem(e, 0x8A, 0, V_OFF(a));                 // mov al, [a]
+                    emit_mem(e, alu, 0, V_OFF(b));                  // add/sub al, [b]
+                    emit_mem(e, 0x88, 0, V_OFF(X));                 // mov [VX], al
+                    break;
+                }
+                case 0x6: case 0xE: {
+                    // shift the source (VY or VX) into VX, VF first as in the interpreter
+                    const uint8_t src = quirks->shift_vy ? Y : X;
+                    emit_mem(e, 0x8A, 0, V_OFF(src));               // mov al, [src]
+                    if((opcode & 0xF) == 0x6){
+                        emit8(e, 0x24); emit8(e, 0x01);             // and al, 1
+                    }
+                    else{
+                        emit8(e, 0xC0); emit8(e, 0xE8); emit8(e, 7); // shr al, 7
+                    }
+                    emit_mem(e, 0x88, 0, V_OFF(0xF));               // mov [VF], al
+                    if(src == X){
+                        emit_mem(e, 0xD0, (opcode & 0xF) == 0x6 ? 5 : 4, V_OFF(X)); // shr / shl byte [VX], 1
+                        break;
+                    }
+                    emit_mem(e, 0x8A, 0, V_OFF(src));               // mov al, [src]
+                    emit8(e, 0xD0); emit8(e, (opcode & 0xF) == 0x6 ? 0xE8 : 0xE0); // shr / shl al, 1
+                    emit_mem(e, 0x88, 0, V_OFF(X));                 // mov [VX], al
+                    break;
+                }
+            }
+            break;
+        case 0xA:
+            emit8(e, 0xBE); emit32(e, NNN);                         // mov esi, NNN
+            break;
+        case 0xF:
+            switch(opcode & 0xFF){
+                case 0x07:
+                    emit_mem(e, 0x8A, 0, DT_OFF);                   // mov al, [delay_timer]
+                    emit_mem(e, 0x88, 0, V_OFF(X));                 // mov [VX], al
+                    break;
+                case 0x15: case 0x18:
+                    emit_mem(e, 0x8A, 0, V_OFF(X));                 // mov al, [VX]
+                    emit_mem(e, 0x88, 0, (opcode & 0xFF) == 0x15 ? DT_OFF : ST_OFF);
+                    break;
+                case 0x1E:
+                    emit8(e, 0x0F); emit_mem(e, 0xB6, 0, V_OFF(X)); // movzx eax, byte [VX]
+                    emit8(e, 0x66); emit8(e, 0x01); emit8(e, 0xC6); // add si, ax
+                    break;
+                case 0x29:
+                    emit8(e, 0x0F); emit_mem(e, 0xB6, 6, V_OFF(X)); // movzx esi, byte [VX]
+                    emit8(e, 0x8D); emit8(e, 0x34); emit8(e, 0xB6); // lea esi, [rsi + rsi*4]
+                    break;
+            }
+            break;
+    }
+}
+
+jit_t *jit_create(const config_t config){
+    jit_t *jit = calloc(1, sizeof(jit_t));
+    if(jit == NULL) return NULL;
+
+    const uint32_t insts_per_frame = config.instructions_per_second / 60;
+    jit->max_block = insts_per_frame < JIT_MAX_BLOCK ? insts_per_frame : JIT_MAX_BLOCK;
+
+    jit->code = mmap(NULL, JIT_CODE_SIZE, PROT_READ | PROT_WRITE | PROT_EXEC,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if(jit->code == MAP_FAILED){
+        SDL_Log("Unable to map JIT code memory, using the interpreter");
+        free(jit);
+        return NULL;
+    }
+    return jit;
+}
+
+void jit_destroy(jit_t *jit){
+    if(jit == NULL) return;
+    munmap(jit->code, JIT_CODE_SIZE);
+    free(jit);
+}
+
+// forget every compiled block
+void jit_flush(jit_t *jit){
+    jit->used = 0;
+    memset(jit->block, 0, sizeof jit->block);
+    memset(jit->length, 0, sizeof jit->length);
+    memset(jit->failed, 0, sizeof jit->failed);
+    memset(jit->covered, 0, sizeof jit->covered);
+}
+
+// ram[addr, addr+len) was written by the guest
+void jit_invalidate(jit_t *jit, uint16_t addr, uint16_t len){
+    for(uint32_t i = 0; i < len; i++){
+        if(jit->covered[(addr + i) & 0x0FFF]){
+            jit_flush(jit);
+            return;
+        }
+    }
+}
+
+// translate the block starting at addr
+void jit_compile(jit_t *jit, const chip8_t *chip8, uint16_t addr){
+    // jumps closing a wait loop stay interpreted so op_1NNN can spot the loop
+    if(idle_jump_period(chip8, addr)){
+        jit->failed[addr] = true;
+        return;
+    }
+
+    // scan the block first, so I is only loaded/stored when used
+    uint8_t count = 0;
+    bool ends_with_terminator = false;
+    bool uses_I = false;
+    for(uint16_t pc = addr; count < jit->max_block && pc + 1 < 0x0FFF; pc += 2){
+        const uint16_t opcode = (chip8->ram[pc] << 8) | chip8->ram[pc + 1];
+        const int kind = jit_classify(opcode);
+        if(kind == JIT_END_BEFORE) break;
+
+        count++;
+        if((opcode >> 12) == 0xA || (opcode & 0xF0FF) == 0xF01E || (opcode & 0xF0FF) == 0xF029){
+            uses_I = true;
+        }
+        if(kind == JIT_END_AFTER){
+            ends_with_terminator = true;
+            break;
+        }
+    }
+    if(count == 0){
+        jit->failed[addr] = true;
+        return;
+    }
+
+    if(jit->used + (count + 2) * JIT_MAX_BYTES > JIT_CODE_SIZE){
+        jit_flush(jit);
+    }
+
+    jit_emit_t e = { .p = jit->code + jit->used };
+    uint8_t *start = e.p;
+
+    if(uses_I){
+        emit8(&e, 0x0F); emit_mem(&e, 0xB7, 6, I_OFF);     // movzx esi, word [I]
+    }
+    for(uint8_t i = 0; i < count; i++){
+        const uint16_t pc = addr + i * 2;
+        const uint16_t opcode = (chip8->ram[pc] << 8) | chip8->ram[pc + 1];
+        jit_emit_instruction(&e, opcode, pc, &quirk_table[chip8->quirks]);
+        jit->covered[pc] = jit->covered[pc + 1] = true;
+    }
+    if(uses_I){
+        emit8(&e, 0x66); emit_mem(&e, 0x89, 6, I_OFF);     // mov [I], si
+    }
+    if(!ends_with_terminator){
+        // fall through to the instruction after the block
+        emit8(&e, 0x66); emit_mem(&e, 0xC7, 0, PC_OFF); emit16(&e, addr + count * 2);
+    }
+    emit8(&e, 0xC3);                                        // ret
+
+    jit->used += e.p - start;
+    jit->block[addr] = (jit_block_t)(void *)start;
+    jit->length[addr] = count;
+}
+
+// Emulate count instructions, running compiled blocks where possible
+uint32_t jit_run(chip8_t *chip8, const config_t *config, uint32_t count){
+    jit_t *jit = chip8->jit;
+    const uint32_t total = count;
+    while(count > 0){
+        const uint16_t addr = chip8->PC & 0x0FFF;
+        if(!jit->length[addr] && !jit->failed[addr]){
+            jit_compile(jit, chip8, addr);
+        }
+
+        // a block only runs if it fits in what is left of this frame
+        if(jit->length[addr] && jit->length[addr] <= count){
+            count -= jit->length[addr];
+            jit->block[addr](chip8);
+        }
+        else{
+            // 00FD is never compiled, only the interpreter can exit
+            run_instructions(chip8, config, 1);
+            count--;
+            if(chip8->state == QUIT) return total - count;
+            count -= idle_skip(chip8, count);
+        }
+    }
+    return total;
+}
+
+#else
+
+// no recompiler on this host, --jit falls back to the interpreter
+struct jit {
+    int unused;
+};
+
+jit_t *jit_create(const config_t config){
+    SDL_Log("JIT is only available on x86-64, using the interpreter");
+    (void) config;
+    return NULL;
+}
+void jit_destroy(jit_t *jit){ (void) jit; }
+void jit_invalidate(jit_t *jit, uint16_t addr, uint16_t len){ (void) jit; (void) addr; (void) len; }
+uint32_t jit_run(chip8_t *chip8, const config_t *config, uint32_t count){ return run_instructions(chip8, config, count); }
+
+#endif
@@ -0,0 +1,320 @@
+// ROM library: a directory of ROMs scanned once into a cached index
+//
+// --library DIR keeps DIR/chip8.index, a fixed-layout binary file like a
+// state file: a header and one 256 byte record per ROM, sorted by file name.
+// Each record holds the ROM's size, modification time and FNV-1a hash plus
+// the settings it runs with (mode, clock rate, keys, quirk profile). Opening
+// the library maps the old index and stats the directory; only ROMs that are
+// new or changed since the last scan are read and hashed, everything else is
+// copied from the index. ROM images are memory-mapped when loaded, so a farm
+// run maps each ROM once for all of its instances.
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define LIBRARY_INDEX "chip8.index"
+#define LIBRARY_MAGIC "C8LB"
+#define LIBRARY_VERSION 1
+#define LIBRARY_NAME 200        // longest file name kept, including the NUL
+
+typedef struct {
+    uint64_t hash;              // fnv1a of the ROM image
+    int64_t mtime_ns;           // modification time the hash belongs to
+    uint32_t size;
+    uint16_t instructions_per_second; // clock rate the ROM runs at
+    uint8_t mode;               // chip8_mode_t
+    uint8_t quirks;             // quirk profile, 0 = the mode's own behaviour
+    char keys[16];              // keyboard key per keypad key 0-F, 0 = default keymap
+    char name[LIBRARY_NAME];    // file name inside the library directory
+    uint8_t reserved[16];       // always zero
+} library_entry_t;
+_Static_assert(sizeof(library_entry_t) == 256, "library records are 256 bytes");
+
+typedef struct {
+    char magic[4];              // "C8LB"
+    uint32_t version;           // LIBRARY_VERSION
+    uint32_t record_size;       // sizeof(library_entry_t)
+    uint32_t count;
+} library_header_t;
+
+typedef struct {
+    char *dir;
+    library_entry_t *entries;   // sorted by name
+    uint32_t count;
+    uint32_t capacity;
+    uint32_t hashed;            // ROMs read by the last scan, the rest came from the index
+} library_t;
+
+int library_compare_names(const void *a, const void *b){
+    return strcmp(((const library_entry_t *)a)->name, ((const library_entry_t *)b)->name);
+}
+
+// DIR/name into path, false if it does not fit
+bool library_path(const library_t *library, const char *name, char path[4096]){
+    return (size_t)snprintf(path, 4096, "%s/%s", library->dir, name) < 4096;
+}
+
+// ROM files by extension, .sc8 and .xo8 also say which mode they were written for
+bool library_rom_name(const char *name, chip8_mode_t *mode){
+    const char *ext = strrchr(name, '.');
+    if(name[0] == '.' || ext == NULL || strlen(name) >= LIBRARY_NAME) return false;
+    *mode = MODE_CHIP8;
+    if(strcmp(ext, ".sc8") == 0) *mode = MODE_SCHIP;
+    else if(strcmp(ext, ".xo8") == 0) *mode = MODE_XOCHIP;
+    else if(strcmp(ext, ".ch8") != 0 && strcmp(ext, ".c8") != 0) return false;
+    return true;
+}
+
+// map a ROM image read-only, NULL if it is gone or changed size since the scan
+const uint8_t *library_map(const library_t *library, const library_entry_t *entry){
+    char path[4096];
+    if(!library_path(library, entry->name, path)) return NULL;
+    const int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        SDL_Log("Unable to open ROM: %s", path);
+        return NULL;
+    }
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size != entry->size){
+        SDL_Log("ROM changed since the library was scanned: %s", path);
+        close(fd);
+        return NULL;
+    }
+    const uint8_t *image = mmap(NULL, entry->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(image == MAP_FAILED){
+        SDL_Log("Unable to map ROM: %s", path);
+        return NULL;
+    }
+    return image;
+}
+
+void library_unmap(const library_entry_t *entry, const uint8_t *image){
+    munmap((void *)image, entry->size);
+}
+
+// write the index next to the ROMs, through a temporary file so a reader never sees half of it
+bool library_save(const library_t *library){
+    char path[4096], temp[4096];
+    if(!library_path(library, LIBRARY_INDEX, path) || !library_path(library, LIBRARY_INDEX ".tmp", temp)) return false;
+
+    FILE *file = fopen(temp, "wb");
+    if(file == NULL){
+        SDL_Log("Unable to write library index: %s", path);
+        return false;
+    }
+    const library_header_t header = { LIBRARY_MAGIC, LIBRARY_VERSION, sizeof(library_entry_t), library->count };
+    bool written = fwrite(&header, sizeof header, 1, file) == 1 &&
+                   fwrite(library->entries, sizeof(library_entry_t), library->count, file) == library->count;
+    written = fclose(file) == 0 && written;
+    if(!written || rename(temp, path) != 0){
+        SDL_Log("Unable to write library index: %s", path);
+        remove(temp);
+        return false;
+    }
+    return true;
+}
+
+// map the previous index, NULL (and no records) when there is none or it is stale
+const library_header_t *library_map_index(const library_t *library, size_t *size){
+    char path[4096];
+    if(!library_path(library, LIBRARY_INDEX, path)) return NULL;
+    const int fd = open(path, O_RDONLY);
+    if(fd < 0) return NULL;
+
+    struct stat info;
+    const library_header_t *header = NULL;
+    if(fstat(fd, &info) == 0 && (size_t)info.st_size >= sizeof *header){
+        header = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if(header == MAP_FAILED) header = NULL;
+    }
+    close(fd);
+    if(header == NULL) return NULL;
+
+    *size = info.st_size;
+    if(memcmp(header->magic, LIBRARY_MAGIC, 4) != 0 || header->version != LIBRARY_VERSION ||
+       header->record_size != sizeof(library_entry_t) ||
+       *size != sizeof *header + (size_t)header->count * sizeof(library_entry_t)){
+        // rebuilt from scratch by this scan
+        munmap((void *)header, *size);
+        return NULL;
+    }
+    // names are looked up with strcmp, so every one has to end inside its record
+    const library_entry_t *entries = (const library_entry_t *)(header + 1);
+    for(uint32_t i = 0; i < header->count; i++){
+        if(memchr(entries[i].name, '\0', LIBRARY_NAME) == NULL){
+            munmap((void *)header, *size);
+            return NULL;
+        }
+    }
+    return header;
+}
+
+// settings from an index record are only used when they are ones a run accepts
+bool library_entry_valid(const library_entry_t *entry){
+    // the same bounds --ips takes, the field already stops at IPS_MAX
+    return entry->mode <= MODE_XOCHIP && entry->quirks <= QUIRKS_MODERN && entry->instructions_per_second >= IPS_MIN;
+}
+
+bool library_add(library_t *library, const library_entry_t *entry){
+    if(library->count == library->capacity){
+        const uint32_t capacity = library->capacity ? library->capacity * 2 : 256;
+        library_entry_t *entries = realloc(library->entries, capacity * sizeof(library_entry_t));
+        if(entries == NULL){
+            SDL_Log("Unable to allocate library");
+            return false;
+        }
+        library->entries = entries;
+        library->capacity = capacity;
+    }
+    library->entries[library->count++] = *entry;
+    return true;
+}
+
+// scan dir, reusing the index for every ROM whose size and modification time are unchanged
+// new ROMs start with the mode their extension names and config's clock rate
+bool library_open(library_t *library, char *dir, const config_t *config){
+    memset(library, 0, sizeof *library);
+    library->dir = dir;
+
+    DIR *listing = opendir(dir);
+    if(listing == NULL){
+        SDL_Log("Unable to open library directory: %s", dir);
+        return false;
+    }
+
+    size_t index_size = 0;
+    const library_header_t *index = library_map_index(library, &index_size);
+    const library_entry_t *old = index ? (const library_entry_t *)(index + 1) : NULL;
+    const uint32_t old_count = index ? index->count : 0;
+
+    bool ok = true;
+    struct dirent *file;
+    while(ok && (file = readdir(listing)) != NULL){
+        chip8_mode_t mode;
+        struct stat info;
+        if(!library_rom_name(file->d_name, &mode) ||
+           fstatat(dirfd(listing), file->d_name, &info, 0) != 0 || !S_ISREG(info.st_mode) ||
+           info.st_size == 0 || info.st_size > 65536 - 0x200){
+            continue;
+        }
+
+        library_entry_t entry = {0};
+        strcpy(entry.name, file->d_name);
+        const int64_t mtime_ns = info.st_mtim.tv_sec * 1000000000LL + info.st_mtim.tv_nsec;
+        const library_entry_t *known = old ? bsearch(&entry, old, old_count, sizeof entry, library_compare_names) : NULL;
+        if(known && !library_entry_valid(known)) known = NULL;  // damaged record: scanned as a new ROM
+        if(known && known->size == info.st_size && known->mtime_ns == mtime_ns){
+            ok = library_add(library, known);
+            continue;
+        }
+
+        // new or changed: hash it, a changed ROM keeps the settings it had
+        if(known){
+            entry = *known;
+        }
+        else{
+            entry.mode = mode;
+            entry.instructions_per_second = config->instructions_per_second;
+        }
+        entry.size = info.st_size;
+        entry.mtime_ns = mtime_ns;
+        const uint8_t *image = library_map(library, &entry);
+        if(image == NULL) continue;
+        entry.hash = fnv1a(image, entry.size);
+        library_unmap(&entry, image);
+        library->hashed++;
+        ok = library_add(library, &entry);
+    }
+    closedir(listing);
+    if(index) munmap((void *)index, index_size);
+    if(!ok) return false;
+
+    qsort(library->entries, library->count, sizeof(library_entry_t), library_compare_names);
+    // an unwritable directory still works, it is just scanned in full next time
+    if(library->hashed || library->count != old_count) library_save(library);
+    return true;
+}
+
+void library_close(library_t *library){
+    free(library->entries);
+    library->entries = NULL;
+    library->count = library->capacity = 0;
+}
+
+// ROM by file name (a path's directory is ignored) or by its 0x hash
+library_entry_t *library_find(library_t *library, const char *name){
+    if(strncmp(name, "0x", 2) == 0){
+        const uint64_t hash = strtoull(name, NULL, 16);
+        for(uint32_t i = 0; i < library->count; i++){
+            if(library->entries[i].hash == hash) return &library->entries[i];
+        }
+    }
+    else{
+        const char *base = strrchr(name, '/');
+        library_entry_t key = {0};
+        snprintf(key.name, sizeof key.name, "%s", base ? base + 1 : name);
+        library_entry_t *entry = bsearch(&key, library->entries, library->count, sizeof key, library_compare_names);
+        if(entry) return entry;
+    }
+    SDL_Log("ROM not in library %s: %s", library->dir, name);
+    return NULL;
+}
+
+// boot a ROM straight from its mapping, in the mode library_apply() settled on
+bool library_load(const library_t *library, library_entry_t *entry, chip8_t *chip8, chip8_mode_t mode){
+    const uint8_t *image = library_map(library, entry);
+    if(image == NULL) return false;
+    const bool loaded = load_chip8(chip8, image, entry->size, entry->name, mode);
+    library_unmap(entry, image);
+    return loaded;
+}
+
+// run with the ROM's stored settings, except those given on the command line
+void library_apply(const library_entry_t *entry, config_t *config){
+    if(!(config->given & GIVEN_MODE)) config->mode = entry->mode;
+    if(!(config->given & GIVEN_IPS)) config->instructions_per_second = entry->instructions_per_second;
+    if(!(config->given & GIVEN_KEYS)) memcpy(config->keys, entry->keys, sizeof config->keys);
+    if(!(config->given & GIVEN_QUIRKS)) config->quirks = entry->quirks;
+}
+
+// --remember: store the settings given on the command line as the ROM's own
+bool library_remember(library_t *library, library_entry_t *entry, const config_t *config){
+    if(config->given & GIVEN_MODE) entry->mode = config->mode;
+    if(config->given & GIVEN_IPS) entry->instructions_per_second = config->instructions_per_second;
+    if(config->given & GIVEN_KEYS) memcpy(entry->keys, config->keys, sizeof entry->keys);
+    if(config->given & GIVEN_QUIRKS) entry->quirks = config->quirks;
+    return library_save(library);
+}
+
+// every ROM in the library, for a farm run without ROM names
+bool library_all(const library_t *library, config_t *config){
+    config->roms = calloc(library->count, sizeof(char *));
+    if(config->roms == NULL) return false;
+    for(uint32_t i = 0; i < library->count; i++){
+        config->roms[i] = library->entries[i].name;
+    }
+    config->rom_count = library->count;
+    return true;
+}
+
+// one CSV record per ROM
+void library_print(const library_t *library){
+    const char *modes[] = {"chip8", "schip", "xochip"};
+    const char *quirks[] = {"mode", "chip8", "schip", "xochip", "modern"};
+    printf("name,hash,size,mode,quirks,instructions_per_second,keys\n");
+    for(uint32_t i = 0; i < library->count; i++){
+        const library_entry_t *entry = &library->entries[i];
+        char keys[17] = {0};
+        for(int key = 0; key < 16; key++){
+            keys[key] = entry->keys[key] ? entry->keys[key] : '-';
+        }
+        printf("%s,0x%016" PRIX64 ",%u,%s,%s,%u,%s\n", entry->name, entry->hash, entry->size,
+               entry->mode <= MODE_XOCHIP ? modes[entry->mode] : "?",
+               entry->quirks <= QUIRKS_MODERN ? quirks[entry->quirks] : "?", entry->instructions_per_second, keys);
+    }
+    fprintf(stderr, "library: %u ROMs, %u hashed by this scan\n", library->count, library->hashed);
+}
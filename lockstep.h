@@ -0,0 +1,382 @@
+// Lockstep engine: one ROM in many machines, one opcode executed across all lanes at once
+//
+// Hot registers (V[], I, PC, timers, keypad) are kept as structure-of-arrays
+// vectors with one element per lane, so ALU, skip, jump and timer opcodes run
+// as a handful of vector instructions. gcc lowers the vector types to
+// SSE2/AVX2/AVX-512 depending on -m flags; build with -mavx2 (or
+// -mavx512bw) and -DLOCKSTEP_LANES=32/64 for wider machines.
+//
+// Lanes whose PC diverges are regrouped every step: lanes sharing the leader's
+// PC (and opcode) run together under a mask, the rest go in a later group.
+// Opcodes touching ram, the display or the stack run per lane through the
+// regular interpreter on each lane's chip8_t, which also holds ram/display.
+// make lockstep-avx2 and make lockstep-avx512 build chip8_headless that way.
+
+#ifndef LOCKSTEP_LANES
+    #define LOCKSTEP_LANES 16
+#endif
+
+typedef uint8_t lane_u8_t __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef int8_t lane_s8_t __attribute__((vector_size(LOCKSTEP_LANES)));
+typedef uint16_t lane_u16_t __attribute__((vector_size(LOCKSTEP_LANES * 2)));
+typedef int16_t lane_s16_t __attribute__((vector_size(LOCKSTEP_LANES * 2)));
+
+typedef struct {
+    lane_u8_t V[16];        // V[register][lane]
+    lane_u16_t I;
+    lane_u16_t PC;
+    lane_u8_t delay_timer;
+    lane_u8_t sound_timer;
+    lane_u16_t keypad;      // one bit per key
+    chip8_t *machines;      // per lane ram, display and stack
+    uint32_t lanes;         // lanes in use
+    lane_u16_t active;      // all ones on lanes in use
+    uint16_t diverged_lo;   // ram lanes may hold different bytes in (FX33/FX55 wrote different
+    uint16_t diverged_hi;   // values), [lo, hi) and empty while lo == hi: opcodes there may differ
+    quirks_t quirks;        // of every lane, the vector forms follow them too
+} lockstep_t;
+
+// mask ? a : b per lane
+// macros rather than functions: wide vectors passed by value trip the AVX ABI warning
+#define LANE_SELECT(mask, a, b) (((a) & (mask)) | ((b) & ~(mask)))
+#define LANE_WIDEN(v) __builtin_convertvector((v), lane_u16_t)
+
+// load lanes copies of a ROM, each seeded differently
+bool lockstep_init(lockstep_t *ls, char *rom_name, uint32_t lanes, uint32_t seed, quirk_profile_t quirks){
+    memset(ls, 0, sizeof *ls);
+    ls->lanes = lanes;
+    ls->machines = calloc(LOCKSTEP_LANES, sizeof(chip8_t));
+    if(ls->machines == NULL){
+        SDL_Log("Unable to allocate lockstep machines");
+        return false;
+    }
+
+    for(uint32_t lane = 0; lane < lanes; lane++){
+        chip8_t *chip8 = &ls->machines[lane];
+        if(!init_chip8(chip8, rom_name, MODE_CHIP8)) return false;
+        chip8_set_quirks(chip8, quirks);
+        chip8_seed(chip8, seed + lane);
+        ls->PC[lane] = chip8->PC;
+        ls->I[lane] = chip8->I;
+        ls->active[lane] = 0xFFFF;
+    }
+    ls->quirks = quirk_table[ls->machines[0].quirks];
+    return true;
+}
+
+void lockstep_destroy(lockstep_t *ls){
+    free(ls->machines);
+    ls->machines = NULL;
+}
+
+void lockstep_set_keys(lockstep_t *ls, uint32_t lane, uint16_t keys){
+    ls->keypad[lane] = keys;
+}
+
+// run one instruction on a single lane with the scalar interpreter
+void lockstep_scalar(lockstep_t *ls, uint32_t lane, const config_t *config){
+    chip8_t *chip8 = &ls->machines[lane];
+
+    for(int r = 0; r < 16; r++){
+        chip8->V[r] = ls->V[r][lane];
+        chip8->keypad[r] = (ls->keypad[lane] >> r) & 1;
+    }
+    chip8->I = ls->I[lane];
+    chip8->PC = ls->PC[lane];
+    chip8->delay_timer = ls->delay_timer[lane];
+    chip8->sound_timer = ls->sound_timer[lane];
+
+    run_instructions(chip8, config, 1);
+
+    for(int r = 0; r < 16; r++){
+        ls->V[r][lane] = chip8->V[r];
+    }
+    ls->I[lane] = chip8->I;
+    ls->PC[lane] = chip8->PC;
+    ls->delay_timer[lane] = chip8->delay_timer;
+    ls->sound_timer[lane] = chip8->sound_timer;
+}
+
+// skip the next instruction on lanes in mask where cond is set
+#define LANE_SKIP(ls, cond, m16) ((ls)->PC += LANE_WIDEN((lane_u8_t)(cond)) & (m16) & 2)
+
+// execute opcode on every lane in mask, returns false if it has no vector form
+bool lockstep_vector(lockstep_t *ls, uint16_t opcode, const lane_u16_t *mask){
+    const lane_u16_t m16 = *mask;
+    const lane_u8_t m8 = (lane_u8_t)__builtin_convertvector((lane_s16_t)m16, lane_s8_t);
+    const uint8_t X = (opcode >> 8) & 0xF;
+    const uint8_t Y = (opcode >> 4) & 0xF;
+    const uint8_t NN = opcode & 0xFF;
+    const uint16_t NNN = opcode & 0xFFF;
+    lane_u8_t *V = ls->V;
+
+    switch(opcode >> 12){
+        case 0x1:
+            ls->PC = LANE_SELECT(m16, (lane_u16_t){0} + NNN, ls->PC);
+            return true;
+
+        case 0x3:
+            LANE_SKIP(ls, (V[X] == NN), m16);
+            return true;
+        case 0x4:
+            LANE_SKIP(ls, (V[X] != NN), m16);
+            return true;
+        case 0x5:
+            if((opcode & 0xF) != 0) return false;
+            LANE_SKIP(ls, (V[X] == V[Y]), m16);
+            return true;
+        case 0x9:
+            if((opcode & 0xF) != 0) return false;
+            LANE_SKIP(ls, (V[X] != V[Y]), m16);
+            return true;
+
+        case 0x6:
+            V[X] = LANE_SELECT(m8, (lane_u8_t){0} + NN, V[X]);
+            return true;
+        case 0x7:
+            V[X] += m8 & NN;
+            return true;
+
+        case 0x8: {
+            lane_u8_t flag;
+            // the shifts' source register
+            const uint8_t S = ls->quirks.shift_vy ? Y : X;
+            switch(opcode & 0xF){
+                case 0x0: V[X] = LANE_SELECT(m8, V[Y], V[X]); return true;
+                case 0x1: V[X] = LANE_SELECT(m8, V[X] | V[Y], V[X]); break;
+                case 0x2: V[X] = LANE_SELECT(m8, V[X] & V[Y], V[X]); break;
+                case 0x3: V[X] = LANE_SELECT(m8, V[X] ^ V[Y], V[X]); break;
+                // VF is written first, then VX, exactly like the interpreter (VX/VY may be VF)
+                case 0x4:
+                    flag = (lane_u8_t)((lane_u8_t)(V[X] + V[Y]) < V[X]) & 1;
+                    V[0xF] = LANE_SELECT(m8, flag, V[0xF]);
+                    V[X] = LANE_SELECT(m8, V[X] + V[Y], V[X]);
+                    return true;
+                case 0x5:
+                    flag = (lane_u8_t)(V[X] >= V[Y]) & 1;
+                    V[0xF] = LANE_SELECT(m8, flag, V[0xF]);
+                    V[X] = LANE_SELECT(m8, V[X] - V[Y], V[X]);
+                    return true;
+                case 0x6:
+                    V[0xF] = LANE_SELECT(m8, V[S] & 1, V[0xF]);
+                    V[X] = LANE_SELECT(m8, V[S] >> 1, V[X]);
+                    return true;
+                case 0x7:
+                    flag = (lane_u8_t)(V[Y] >= V[X]) & 1;
+                    V[0xF] = LANE_SELECT(m8, flag, V[0xF]);
+                    V[X] = LANE_SELECT(m8, V[Y] - V[X], V[X]);
+                    return true;
+                case 0xE:
+                    V[0xF] = LANE_SELECT(m8, V[S] >> 7, V[0xF]);
+                    V[X] = LANE_SELECT(m8, V[S] << 1, V[X]);
+                    return true;
+                default:
+                    return false;
+            }
+            // 8XY1/8XY2/8XY3: the logic ops' VF reset
+            if(ls->quirks.vf_reset) V[0xF] = LANE_SELECT(m8, (lane_u8_t){0}, V[0xF]);
+            return true;
+        }
+
+        case 0xA:
+            ls->I = LANE_SELECT(m16, (lane_u16_t){0} + NNN, ls->I);
+            return true;
+
+        case 0xE:
+            if(NN == 0x9E || NN == 0xA1){
+                const lane_u16_t key = (ls->keypad >> LANE_WIDEN(V[X] & 0xF)) & 1;
+                const lane_u16_t skip16 = (lane_u16_t)(key == (uint16_t)(NN == 0x9E));
+                ls->PC += skip16 & m16 & 2;
+                return true;
+            }
+            return false;
+
+        case 0xF:
+            switch(NN){
+                case 0x07: V[X] = LANE_SELECT(m8, ls->delay_timer, V[X]); return true;
+                case 0x15: ls->delay_timer = LANE_SELECT(m8, V[X], ls->delay_timer); return true;
+                case 0x18: ls->sound_timer = LANE_SELECT(m8, V[X], ls->sound_timer); return true;
+                case 0x1E: ls->I += LANE_WIDEN(V[X]) & m16; return true;
+                case 0x29: ls->I = LANE_SELECT(m16, LANE_WIDEN(V[X]) * 5, ls->I); return true;
+                default: return false;
+            }
+
+        default:
+            return false;
+    }
+}
+
+// true if every lane of a comparison result is set
+bool lockstep_all(const lane_u16_t *lanes){
+    uint64_t words[sizeof *lanes / sizeof(uint64_t)];
+    memcpy(words, lanes, sizeof words);
+    uint64_t all = ~0ULL;
+    for(size_t i = 0; i < sizeof words / sizeof words[0]; i++){
+        all &= words[i];
+    }
+    return all == ~0ULL;
+}
+
+// true if every lane in use is at lane 0's PC
+bool lockstep_converged(const lockstep_t *ls){
+    const lane_u16_t same = (lane_u16_t)(ls->PC == ls->PC[0]) | ~ls->active;
+    return lockstep_all(&same);
+}
+
+bool lockstep_diverged_at(const lockstep_t *ls, uint16_t addr){
+    return addr >= ls->diverged_lo && addr < ls->diverged_hi;
+}
+
+// after FX33/FX55 ran on the lanes in mask from I = before, widen the diverged range
+// unless every lane in use stored the same bytes at the same address
+void lockstep_track_writes(lockstep_t *ls, uint16_t opcode, const lane_u16_t *before, const lane_u16_t *mask){
+    const uint16_t length = (opcode & 0xFF) == 0x33 ? 3 : ((opcode >> 8) & 0xF) + 1;
+    const lane_u16_t everyone = (lane_u16_t)(*mask == ls->active) & (lane_u16_t)(*before == (*before)[0]);
+    bool same = lockstep_all(&everyone);
+    const uint8_t *first = ls->machines[0].ram;
+    for(uint32_t lane = 1; same && lane < ls->lanes; lane++){
+        const uint8_t *ram = ls->machines[lane].ram;
+        for(uint16_t i = 0; i < length; i++){
+            const uint16_t addr = ((*before)[0] + i) & 0x0FFF;
+            if(ram[addr] != first[addr]) same = false;
+        }
+    }
+    if(same) return;
+
+    for(uint32_t lane = 0; lane < ls->lanes; lane++){
+        if(!(*mask)[lane]) continue;
+        uint16_t lo = (*before)[lane] & 0x0FFF, hi = lo + length;
+        if(hi > 0x1000){
+            // wrapped past the end of ram
+            lo = 0;
+            hi = 0x1000;
+        }
+        if(ls->diverged_lo == ls->diverged_hi){
+            ls->diverged_lo = lo;
+            ls->diverged_hi = hi;
+        }
+        if(lo < ls->diverged_lo) ls->diverged_lo = lo;
+        if(hi > ls->diverged_hi) ls->diverged_hi = hi;
+    }
+}
+
+// run the group in mask (all at pc, all seeing opcode) for one instruction
+void lockstep_group(lockstep_t *ls, const config_t *config, uint16_t pc, uint16_t opcode, const lane_u16_t *mask){
+    // fetch: every lane in the group moves past the instruction
+    const lane_u16_t saved_pc = ls->PC;
+    ls->PC = LANE_SELECT(*mask, (lane_u16_t){0} + (uint16_t)(pc + 2), ls->PC);
+    if(!lockstep_vector(ls, opcode, mask)){
+        // no vector form, run the group lane by lane from the original PC
+        ls->PC = saved_pc;
+        const lane_u16_t saved_I = ls->I;
+        for(uint32_t lane = 0; lane < ls->lanes; lane++){
+            if((*mask)[lane]) lockstep_scalar(ls, lane, config);
+        }
+        if((opcode & 0xF0FF) == 0xF033 || (opcode & 0xF0FF) == 0xF055) lockstep_track_writes(ls, opcode, &saved_I, mask);
+    }
+}
+
+// advance every lane by one instruction
+void lockstep_step(lockstep_t *ls, const config_t *config){
+    // common case: no lane has diverged, one group covers everything, as long as
+    // no lane may have stored a different opcode where they all are
+    const uint16_t pc = ls->PC[0] & 0x0FFF;
+    if(lockstep_converged(ls) && !lockstep_diverged_at(ls, pc) && !lockstep_diverged_at(ls, (pc + 1) & 0x0FFF)){
+        const uint8_t *ram = ls->machines[0].ram;
+        lockstep_group(ls, config, pc, (ram[pc] << 8) | ram[(pc + 1) & 0x0FFF], &ls->active);
+        return;
+    }
+
+    lane_u16_t pending = ls->active;
+
+    for(uint32_t leader = 0; leader < ls->lanes; leader++){
+        if(!pending[leader]) continue;
+
+        // group every pending lane at the leader's PC that sees the same opcode
+        const uint16_t pc = ls->PC[leader] & 0x0FFF;
+        const chip8_t *lead = &ls->machines[leader];
+        const uint16_t opcode = (lead->ram[pc] << 8) | lead->ram[(pc + 1) & 0x0FFF];
+        lane_u16_t mask = (lane_u16_t)((ls->PC & 0x0FFF) == pc) & pending;
+        for(uint32_t lane = leader + 1; lane < ls->lanes; lane++){
+            if(mask[lane]){
+                const chip8_t *chip8 = &ls->machines[lane];
+                if(chip8->ram[pc] != lead->ram[pc] || chip8->ram[(pc + 1) & 0x0FFF] != lead->ram[(pc + 1) & 0x0FFF]){
+                    mask[lane] = 0;     // self-modified differently, runs in its own group
+                }
+            }
+        }
+        pending &= ~mask;
+        lockstep_group(ls, config, pc, opcode, &mask);
+    }
+}
+
+// one 60Hz frame on every lane
+void lockstep_run_frame(lockstep_t *ls, const config_t *config, uint32_t count){
+    for(uint32_t i = 0; i < count; i++){
+        lockstep_step(ls, config);
+    }
+}
+
+void lockstep_update_timers(lockstep_t *ls){
+    // comparisons give -1 per true lane, adding it decrements non-zero timers
+    ls->delay_timer += (lane_u8_t)(ls->delay_timer != 0);
+    ls->sound_timer += (lane_u8_t)(ls->sound_timer != 0);
+}
+
+// copy the hot registers back into each lane's chip8_t
+void lockstep_sync(lockstep_t *ls){
+    for(uint32_t lane = 0; lane < ls->lanes; lane++){
+        chip8_t *chip8 = &ls->machines[lane];
+        for(int r = 0; r < 16; r++){
+            chip8->V[r] = ls->V[r][lane];
+        }
+        chip8->I = ls->I[lane];
+        chip8->PC = ls->PC[lane];
+        chip8->delay_timer = ls->delay_timer[lane];
+        chip8->sound_timer = ls->sound_timer[lane];
+    }
+}
+
+// run config.instances machines of the first ROM in batches of LOCKSTEP_LANES
+bool run_lockstep(const config_t config){
+    if(config.mode != MODE_CHIP8){
+        // the lanes only implement the CHIP-8 instruction set on a 64x32 display
+        SDL_Log("--lockstep only runs CHIP-8 ROMs");
+        return false;
+    }
+    const uint32_t insts_per_frame = config.instructions_per_second / 60;
+    uint64_t frames = config.max_frames;
+    if(config.max_instructions && (!frames || config.max_instructions / insts_per_frame < frames)){
+        frames = config.max_instructions / insts_per_frame;
+    }
+
+    struct timespec start, end;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    printf("rom,instance,frames,instructions,halted,framebuffer_hash\n");
+    for(uint32_t base = 0; base < config.instances; base += LOCKSTEP_LANES){
+        const uint32_t lanes = config.instances - base < LOCKSTEP_LANES ? config.instances - base : LOCKSTEP_LANES;
+        lockstep_t ls;
+        if(!lockstep_init(&ls, config.roms[0], lanes, config.seed + base, config.quirks)) return false;
+
+        for(uint64_t f = 0; f < frames; f++){
+            lockstep_run_frame(&ls, &config, insts_per_frame);
+            lockstep_update_timers(&ls);
+        }
+
+        lockstep_sync(&ls);
+        for(uint32_t lane = 0; lane < lanes; lane++){
+            const chip8_t *chip8 = &ls.machines[lane];
+            printf("%s,%u,%" PRIu64 ",%" PRIu64 ",%d,0x%016" PRIX64 "\n",
+                   config.roms[0], base + lane, frames, frames * insts_per_frame,
+                   is_halted(chip8), framebuffer_hash(chip8));
+        }
+        lockstep_destroy(&ls);
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    const double seconds = elapsed_seconds(start, end);
+    const uint64_t total = (uint64_t)config.instances * frames * insts_per_frame;
+    fprintf(stderr, "instances: %u, lanes: %d, instructions: %" PRIu64 ", seconds: %.6f, instructions_per_second: %.0f\n",
+            config.instances, LOCKSTEP_LANES, total, seconds, seconds > 0 ? total / seconds : 0);
+    return true;
+}
@@ -0,0 +1,207 @@
+// Profiler, only built with -DPROFILE
+//
+// Counts executions and host cycles per opcode class and per guest PC, and
+// follows 2NNN/00EE to build a call trie of guest subroutines. Without
+// PROFILE the PROFILE_* hooks in the dispatch loops expand to nothing.
+// profile_report() prints the hottest opcode classes and PCs to stderr and
+// writes the call trie as folded stacks (one "caller;callee count" line per
+// routine, weighted by instructions executed) for flamegraph.pl.
+
+#if defined(__x86_64__) || defined(__i386__)
+    #include <x86intrin.h>
+    #define profile_clock() __rdtsc()
+#else
+    #define profile_clock() ((uint64_t)clock())
+#endif
+
+#ifndef PROFILE_FOLDED
+    #define PROFILE_FOLDED "chip8.folded"
+#endif
+#define PROFILE_NODES 65536     // call trie nodes, calls past this stay in the caller
+#define PROFILE_DEPTH 16        // deepest call chain kept, as deep as the guest stack, deeper calls stay in the caller
+#define PROFILE_TOP 20          // PCs listed in the report
+
+typedef struct {
+    uint64_t count;
+    uint64_t cycles;
+} profile_counter_t;
+
+// one guest subroutine reached through a particular chain of calls
+typedef struct {
+    uint16_t addr;          // 2NNN target, entry point for the root
+    uint8_t depth;          // calls from the root, at most PROFILE_DEPTH
+    uint32_t parent;
+    uint32_t first_child;   // 0 = none, node 0 is the root and never a child
+    uint32_t next_sibling;
+    uint64_t count;         // instructions executed in this routine itself
+} profile_node_t;
+
+struct profile {
+    profile_counter_t classes[65536];   // by opcode with operands masked off
+    profile_counter_t pcs[65536];
+    profile_node_t nodes[PROFILE_NODES];
+    uint32_t node_count;
+    uint32_t current;       // routine executing now
+    uint64_t unfollowed;    // calls kept in the caller, their returns do not leave it
+};
+
+profile_t *profile_create(uint16_t entry_point){
+    profile_t *profile = calloc(1, sizeof(profile_t));
+    if(profile == NULL){
+        SDL_Log("Unable to allocate profiler");
+        return NULL;
+    }
+    profile->nodes[0].addr = entry_point;
+    profile->node_count = 1;
+    return profile;
+}
+
+// opcode with its operands masked off, 0NNN folded into one class
+uint16_t profile_class(uint16_t opcode){
+    switch(opcode >> 12){
+        case 0x0:
+            if((opcode & 0xFFE0) == 0x00C0) return opcode & 0xFFF0;   // 00CN, 00DN
+            return (opcode & 0xFF00) == 0x0000 && (opcode & 0xFF) >= 0xE0 ? opcode : 0x0000;
+        case 0x5: case 0x8: return opcode & 0xF00F;
+        case 0xE: case 0xF: return opcode & 0xF0FF;
+        default: return opcode & 0xF000;
+    }
+}
+
+// class name in the usual notation, e.g. 8XY4 or FX33
+void profile_class_name(uint16_t class, char name[5]){
+    const char *operands;
+    switch(class >> 12){
+        case 0x0:
+            if((class & 0xFFE0) == 0x00C0){
+                snprintf(name, 5, "00%XN", (class >> 4) & 0xF);
+                return;
+            }
+            operands = class ? NULL : "NNN";
+            break;
+        case 0x1: case 0x2: case 0xA: case 0xB: operands = "NNN"; break;
+        case 0x3: case 0x4: case 0x6: case 0x7: case 0xC: operands = "XNN"; break;
+        case 0x5: operands = NULL; snprintf(name, 5, "5XY%X", class & 0xF); return;
+        case 0x9: operands = "XY0"; break;
+        case 0xD: operands = "XYN"; break;
+        case 0x8: operands = NULL; snprintf(name, 5, "8XY%X", class & 0xF); return;
+        default: operands = NULL; snprintf(name, 5, "%XX%02X", class >> 12, class & 0xFF); return;
+    }
+    if(operands) snprintf(name, 5, "%X%s", class >> 12, operands);
+    else snprintf(name, 5, "%04X", class);
+}
+
+// account one executed instruction, then follow calls and returns
+void profile_instruction(profile_t *profile, const chip8_t *chip8, uint16_t addr, uint64_t cycles){
+    const uint16_t opcode = chip8->inst.opcode;
+    profile_counter_t *class = &profile->classes[profile_class(opcode)];
+    class->count++;
+    class->cycles += cycles;
+    profile->pcs[addr].count++;
+    profile->pcs[addr].cycles += cycles;
+
+    profile_node_t *node = &profile->nodes[profile->current];
+    node->count++;
+
+    if(opcode >> 12 == 0x2){
+        const uint16_t target = opcode & 0x0FFF;
+        uint32_t child = node->first_child;
+        while(child && profile->nodes[child].addr != target){
+            child = profile->nodes[child].next_sibling;
+        }
+        if(child == 0 && profile->node_count < PROFILE_NODES && node->depth < PROFILE_DEPTH){
+            child = profile->node_count++;
+            profile->nodes[child] = (profile_node_t){
+                .addr = target,
+                .depth = node->depth + 1,
+                .parent = profile->current,
+                .next_sibling = node->first_child,
+            };
+            node->first_child = child;
+        }
+        if(child) profile->current = child;
+        else profile->unfollowed++;
+    }
+    else if(opcode == 0x00EE){
+        if(profile->unfollowed) profile->unfollowed--;
+        else if(profile->current != 0) profile->current = node->parent;
+    }
+}
+
+// caller;callee;... for one trie node
+void profile_print_stack(FILE *out, const profile_t *profile, uint32_t node){
+    uint16_t chain[PROFILE_DEPTH];
+    uint8_t depth = profile->nodes[node].depth;
+    for(uint8_t i = depth; i > 0; i--, node = profile->nodes[node].parent){
+        chain[i - 1] = profile->nodes[node].addr;
+    }
+    fprintf(out, "start_0x%03X", profile->nodes[0].addr);
+    for(uint8_t i = 0; i < depth; i++){
+        fprintf(out, ";sub_0x%03X", chain[i]);
+    }
+}
+
+int profile_compare_cycles(const void *a, const void *b){
+    const profile_counter_t *x = *(const profile_counter_t *const *)a;
+    const profile_counter_t *y = *(const profile_counter_t *const *)b;
+    return (y->cycles > x->cycles) - (y->cycles < x->cycles);
+}
+
+void profile_report(profile_t *profile, const chip8_t *chip8){
+    if(profile == NULL) return;
+
+    uint64_t total_count = 0, total_cycles = 0;
+    for(uint32_t pc = 0; pc < 65536; pc++){
+        total_count += profile->pcs[pc].count;
+        total_cycles += profile->pcs[pc].cycles;
+    }
+    fprintf(stderr, "profile: %" PRIu64 " instructions, %" PRIu64 " host cycles\n", total_count, total_cycles);
+
+    // opcode classes, most expensive first
+    profile_counter_t **order = malloc(65536 * sizeof *order);
+    if(order == NULL) return;
+    uint32_t used = 0;
+    for(uint32_t class = 0; class < 65536; class++){
+        if(profile->classes[class].count) order[used++] = &profile->classes[class];
+    }
+    qsort(order, used, sizeof order[0], profile_compare_cycles);
+    fprintf(stderr, "%-6s %14s %16s %10s\n", "class", "count", "cycles", "cycles/op");
+    for(uint32_t i = 0; i < used; i++){
+        char name[5];
+        profile_class_name(order[i] - profile->classes, name);
+        fprintf(stderr, "%-6s %14" PRIu64 " %16" PRIu64 " %10.1f\n", name, order[i]->count, order[i]->cycles,
+                (double)order[i]->cycles / order[i]->count);
+    }
+
+    // hottest guest addresses
+    used = 0;
+    for(uint32_t pc = 0; pc < 65536; pc++){
+        if(profile->pcs[pc].count) order[used++] = &profile->pcs[pc];
+    }
+    qsort(order, used, sizeof order[0], profile_compare_cycles);
+    fprintf(stderr, "%-6s %-6s %14s %16s\n", "pc", "opcode", "count", "cycles");
+    for(uint32_t i = 0; i < used && i < PROFILE_TOP; i++){
+        const uint16_t pc = order[i] - profile->pcs;
+        fprintf(stderr, "0x%03X  %02X%02X   %14" PRIu64 " %16" PRIu64 "\n", pc,
+                chip8->ram[pc], chip8->ram[(pc + 1) & chip8->ram_mask], order[i]->count, order[i]->cycles);
+    }
+    free(order);
+
+    FILE *folded = fopen(PROFILE_FOLDED, "w");
+    if(folded == NULL){
+        SDL_Log("Unable to open %s", PROFILE_FOLDED);
+        return;
+    }
+    for(uint32_t node = 0; node < profile->node_count; node++){
+        if(profile->nodes[node].count == 0) continue;
+        profile_print_stack(folded, profile, node);
+        fprintf(folded, " %" PRIu64 "\n", profile->nodes[node].count);
+    }
+    fclose(folded);
+    fprintf(stderr, "call stacks written to %s (%u routines)\n", PROFILE_FOLDED, profile->node_count);
+}
+
+// time the handler call in the dispatch loops
+#define PROFILE_BEGIN() const uint64_t profile_start = profile_clock()
+#define PROFILE_END(chip8, addr) \
+    if((chip8)->profile) profile_instruction((chip8)->profile, (chip8), (addr), profile_clock() - profile_start)
@@ -0,0 +1,150 @@
+// Input recording: everything outside the core that can change a run
+//
+// CXNN draws from the per-machine generator seeded by config.seed and the
+// keypad is only sampled between frames, so a run is fully determined by the
+// seed, the clock rate, the quirk profile, the starting ram and the keypad of
+// every frame. A recording is a header followed by (keys, frames) runs,
+// written as frames finish; replaying feeds the same keypads back frame by
+// frame.
+
+#define REPLAY_MAGIC "C8RP"
+#define REPLAY_VERSION 2
+
+typedef struct {
+    char magic[4];          // "C8RP"
+    uint32_t version;       // REPLAY_VERSION
+    uint32_t seed;          // CXNN seed
+    uint32_t instructions_per_second;
+    uint64_t ram_hash;      // FNV-1a of ram when the recording started
+    uint8_t quirks;         // quirk_profile_t the machine ran with
+    uint8_t reserved[7];    // always zero
+} replay_header_t;
+
+// one stretch of frames with the same keys held
+typedef struct {
+    uint16_t keys;          // one bit per key
+    uint16_t frames;
+} replay_run_t;
+
+typedef struct {
+    FILE *file;
+    replay_header_t header;
+    replay_run_t run;       // recording: run being extended, replaying: frames left in it
+} replay_t;
+
+uint16_t keypad_mask(const chip8_t *chip8){
+    uint16_t keys = 0;
+    for(int key = 0; key < 16; key++){
+        keys |= chip8->keypad[key] << key;
+    }
+    return keys;
+}
+
+void keypad_set(chip8_t *chip8, uint16_t keys){
+    for(int key = 0; key < 16; key++){
+        chip8->keypad[key] = (keys >> key) & 1;
+    }
+}
+
+bool record_open(replay_t *replay, const char *path, const chip8_t *chip8, const config_t *config){
+    memset(replay, 0, sizeof *replay);
+    replay->file = fopen(path, "wb");
+    if(replay->file == NULL){
+        SDL_Log("Unable to open recording: %s", path);
+        return false;
+    }
+
+    memcpy(replay->header.magic, REPLAY_MAGIC, sizeof replay->header.magic);
+    replay->header.version = REPLAY_VERSION;
+    replay->header.seed = config->seed;
+    replay->header.instructions_per_second = config->instructions_per_second;
+    replay->header.ram_hash = fnv1a(chip8->ram, chip8->ram_mask + 1);
+    replay->header.quirks = chip8->quirks;
+    if(fwrite(&replay->header, sizeof replay->header, 1, replay->file) != 1){
+        SDL_Log("Unable to write recording: %s", path);
+        fclose(replay->file);
+        replay->file = NULL;
+        return false;
+    }
+    return true;
+}
+
+// log the keypad a frame ran with, a run is only written once the keys change
+void record_frame(replay_t *replay, const chip8_t *chip8){
+    const uint16_t keys = keypad_mask(chip8);
+    if(replay->run.frames && (keys != replay->run.keys || replay->run.frames == UINT16_MAX)){
+        fwrite(&replay->run, sizeof replay->run, 1, replay->file);
+        replay->run.frames = 0;
+    }
+    replay->run.keys = keys;
+    replay->run.frames++;
+}
+
+bool record_close(replay_t *replay){
+    if(replay->run.frames){
+        fwrite(&replay->run, sizeof replay->run, 1, replay->file);
+    }
+    const bool ok = !ferror(replay->file);
+    if(fclose(replay->file) != 0 || !ok){
+        SDL_Log("Unable to write recording");
+        return false;
+    }
+    replay->file = NULL;
+    return true;
+}
+
+// read a recording's header and take its seed, clock rate and quirks, before the machine is seeded
+bool replay_open(replay_t *replay, const char *path, config_t *config){
+    memset(replay, 0, sizeof *replay);
+    replay->file = fopen(path, "rb");
+    if(replay->file == NULL){
+        SDL_Log("Unable to open recording: %s", path);
+        return false;
+    }
+
+    if(fread(&replay->header, sizeof replay->header, 1, replay->file) != 1 ||
+       memcmp(replay->header.magic, REPLAY_MAGIC, sizeof replay->header.magic) != 0 ||
+       replay->header.version != REPLAY_VERSION){
+        SDL_Log("Not a recording or wrong version: %s", path);
+        fclose(replay->file);
+        replay->file = NULL;
+        return false;
+    }
+    if(replay->header.quirks > QUIRKS_MODERN ||
+       replay->header.instructions_per_second < IPS_MIN || replay->header.instructions_per_second > IPS_MAX){
+        SDL_Log("Recording has an invalid quirk profile or clock rate: %s", path);
+        fclose(replay->file);
+        replay->file = NULL;
+        return false;
+    }
+    config->seed = replay->header.seed;
+    config->instructions_per_second = replay->header.instructions_per_second;
+    config->quirks = replay->header.quirks;
+    return true;
+}
+
+// the ROM (and state file) must be the ones the recording was made with
+bool replay_matches(const replay_t *replay, const chip8_t *chip8){
+    if(fnv1a(chip8->ram, chip8->ram_mask + 1) != replay->header.ram_hash){
+        SDL_Log("Recording was made with a different ROM or starting state");
+        return false;
+    }
+    return true;
+}
+
+// set the keypad for the next frame, false at the end of the recording
+bool replay_frame(replay_t *replay, chip8_t *chip8){
+    if(replay->run.frames == 0){
+        if(fread(&replay->run, sizeof replay->run, 1, replay->file) != 1 || replay->run.frames == 0){
+            return false;
+        }
+    }
+    keypad_set(chip8, replay->run.keys);
+    replay->run.frames--;
+    return true;
+}
+
+void replay_close(replay_t *replay){
+    if(replay->file) fclose(replay->file);
+    replay->file = NULL;
+}
@@ -0,0 +1,199 @@
+// Rewind: the last few seconds of emulation as a ring of per-frame deltas
+//
+// Every frame the machine is snapshotted (state.h) and XORed against the
+// previous frame's snapshot, over the part state_size() says is in use. The
+// XOR is mostly zero, so it is stored as runs of (zero words, literal words)
+// in 64-bit words. Deltas are packed into one
+// fixed byte buffer used as a ring; when it or the frame index fills up the
+// oldest deltas are dropped. Rewinding XORs the newest delta back into the
+// newest snapshot, which gives the frame before it, and so on.
+
+#define REWIND_WORDS (sizeof(chip8_state_t) / sizeof(uint64_t))     // at most, XO-CHIP
+#define REWIND_MAX_DELTA (REWIND_WORDS * 12 + 4)   // every other word literal, 4 byte run header each
+#define REWIND_BYTES_PER_FRAME 512                  // average budget, typical deltas are far smaller
+
+typedef struct {
+    uint32_t offset;        // start in data
+    uint32_t length;        // encoded bytes
+} rewind_entry_t;
+
+typedef struct {
+    chip8_state_t latest;   // newest recorded frame, deltas walk backwards from it
+    chip8_state_t scratch;
+    uint8_t encoded[REWIND_MAX_DELTA];
+    uint8_t *data;          // encoded deltas, used as a ring
+    uint32_t data_size;
+    uint32_t head;          // where the next delta is written
+    rewind_entry_t *entries; // oldest delta at entries[first]
+    uint32_t capacity;      // frames kept at most, 0 = rewind is off
+    uint32_t first;
+    uint32_t count;
+    bool primed;            // latest holds a frame
+} rewind_t;
+
+bool rewind_init(rewind_t *rw, uint32_t seconds){
+    memset(rw, 0, sizeof *rw);
+    if(seconds == 0) return true;
+
+    rw->capacity = seconds * 60;
+    rw->data_size = rw->capacity * REWIND_BYTES_PER_FRAME + 2 * REWIND_MAX_DELTA;
+    rw->data = malloc(rw->data_size);
+    rw->entries = calloc(rw->capacity, sizeof(rewind_entry_t));
+    if(rw->data == NULL || rw->entries == NULL){
+        SDL_Log("Unable to allocate rewind buffer");
+        free(rw->data);
+        free(rw->entries);
+        rw->capacity = 0;
+        return false;
+    }
+    return true;
+}
+
+void rewind_destroy(rewind_t *rw){
+    free(rw->data);
+    free(rw->entries);
+    rw->capacity = 0;
+}
+
+// XOR of two snapshots of one mode as (zero words, literal words, literals...) runs, returns bytes written
+uint32_t rewind_encode(const chip8_state_t *a, const chip8_state_t *b, uint8_t *out){
+    const uint8_t *pa = (const uint8_t *)a;
+    const uint8_t *pb = (const uint8_t *)b;
+    const uint32_t words = state_size(a) / 8;
+    uint8_t *p = out;
+    uint32_t w = 0;
+
+    while(w < words){
+        uint64_t x, y;
+        const uint32_t start = w;
+        for(; w < words; w++){
+            memcpy(&x, pa + w * 8, 8);
+            memcpy(&y, pb + w * 8, 8);
+            if(x != y) break;
+        }
+        if(w == words) break;           // trailing zeros are implied
+
+        const uint16_t zeros = w - start;
+        uint8_t *header = p;
+        p += 4;
+        uint16_t literals = 0;
+        for(; w < words; w++){
+            memcpy(&x, pa + w * 8, 8);
+            memcpy(&y, pb + w * 8, 8);
+            if(x == y) break;
+            x ^= y;
+            memcpy(p, &x, 8);
+            p += 8;
+            literals++;
+        }
+        memcpy(header, &zeros, 2);
+        memcpy(header + 2, &literals, 2);
+    }
+    return p - out;
+}
+
+// XOR an encoded delta into a snapshot, false (and the snapshot untouched) if a run falls outside it
+bool rewind_apply(chip8_state_t *state, const uint8_t *delta, uint32_t length){
+    // check every run header before touching the snapshot
+    const uint32_t words = state_size(state) / 8;
+    const uint8_t *p = delta;
+    uint32_t w = 0;
+    while(p < delta + length){
+        uint16_t zeros, literals;
+        if(delta + length - p < 4) return false;
+        memcpy(&zeros, p, 2);
+        memcpy(&literals, p + 2, 2);
+        p += 4;
+        if(w + zeros + literals > words || (size_t)(delta + length - p) < literals * 8u) return false;
+        w += zeros + literals;
+        p += literals * 8;
+    }
+
+    uint8_t *ps = (uint8_t *)state;
+    p = delta;
+    w = 0;
+    while(p < delta + length){
+        uint16_t zeros, literals;
+        memcpy(&zeros, p, 2);
+        memcpy(&literals, p + 2, 2);
+        p += 4;
+        w += zeros;
+        for(uint16_t i = 0; i < literals; i++, w++){
+            uint64_t x, y;
+            memcpy(&x, ps + w * 8, 8);
+            memcpy(&y, p, 8);
+            x ^= y;
+            memcpy(ps + w * 8, &x, 8);
+            p += 8;
+        }
+    }
+    return true;
+}
+
+// record the frame that just finished
+void rewind_push(rewind_t *rw, const chip8_t *chip8){
+    if(rw->capacity == 0) return;
+
+    chip8_save_state(chip8, &rw->scratch);
+    if(!rw->primed){
+        rw->latest = rw->scratch;
+        rw->primed = true;
+        return;
+    }
+    if(rw->scratch.mode != rw->latest.mode){
+        // snapshots of another size, the history before this frame cannot be reached
+        rw->latest = rw->scratch;
+        rw->count = 0;
+        rw->head = 0;
+        return;
+    }
+    const uint32_t length = rewind_encode(&rw->latest, &rw->scratch, rw->encoded);
+    rw->latest = rw->scratch;
+
+    // find room at the write head, wrapping to the start and dropping old frames as needed
+    uint32_t offset = rw->head;
+    if(offset + length > rw->data_size){
+        // what is left past the head is the oldest lap, all of it goes before the head wraps
+        while(rw->count > 0 && rw->entries[rw->first].offset >= rw->head){
+            rw->first = (rw->first + 1) % rw->capacity;
+            rw->count--;
+        }
+        offset = 0;
+    }
+    while(rw->count > 0){
+        const rewind_entry_t *oldest = &rw->entries[rw->first];
+        // an empty delta still marks where the rest of its lap starts
+        const bool overlaps = oldest->offset >= offset ? oldest->offset < offset + length
+                                                       : offset < oldest->offset + oldest->length;
+        if(!overlaps && rw->count < rw->capacity) break;
+        rw->first = (rw->first + 1) % rw->capacity;
+        rw->count--;
+    }
+
+    memcpy(rw->data + offset, rw->encoded, length);
+    rw->entries[(rw->first + rw->count) % rw->capacity] = (rewind_entry_t){ offset, length };
+    rw->count++;
+    rw->head = offset + length;
+}
+
+// step the machine back one frame, false once the window is used up
+bool rewind_step(rewind_t *rw, chip8_t *chip8){
+    if(rw->count == 0) return false;
+
+    const rewind_entry_t *newest = &rw->entries[(rw->first + rw->count - 1) % rw->capacity];
+    if(!rewind_apply(&rw->latest, rw->data + newest->offset, newest->length)){
+        SDL_Log("Rewind delta is corrupt, dropping the rewind history");
+        rw->count = 0;
+        rw->head = 0;
+        return false;
+    }
+    rw->head = newest->offset;
+    rw->count--;
+
+    // the keypad follows the keys held now, not the ones held back then
+    bool keypad[16];
+    memcpy(keypad, chip8->keypad, sizeof keypad);
+    chip8_load_state(chip8, &rw->latest);
+    memcpy(chip8->keypad, keypad, sizeof keypad);
+    return true;
+}
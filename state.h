@@ -0,0 +1,181 @@
+// Save states: a fixed-layout snapshot of everything a running ROM can observe
+//
+// chip8_state_t is both the in-memory snapshot and the file format. A state
+// file is the struct written out verbatim in host byte order, so loading one
+// is an mmap plus a header check, no parsing. Fields are ordered so the struct
+// has no implicit padding; bump STATE_VERSION whenever the layout changes.
+// ram comes last and only the mode's ram is in use (state_size()), so 4KB
+// machines save, compare and restore 4KB, and their files end there.
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define STATE_MAGIC "C8SS"
+#define STATE_VERSION 3
+
+struct chip8_state {
+    char magic[4];          // "C8SS"
+    uint32_t version;       // STATE_VERSION
+    uint64_t display[2][128]; // packed bitplanes, same layout as chip8_t
+    uint16_t stack[16];
+    uint16_t I;
+    uint16_t PC;
+    uint32_t rng_state;
+    uint16_t keypad;        // one bit per key
+    uint8_t V[16];
+    uint8_t stack_ptr;
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t mode;           // chip8_mode_t the state was saved in
+    uint8_t hires;
+    uint8_t planes;
+    uint8_t pitch;
+    uint8_t has_pattern;
+    uint8_t flags[16];
+    uint8_t pattern[16];
+    uint8_t reserved[6];    // always zero, rounds the size up to 8 bytes
+    uint8_t ram[65536];     // only the first 4KB is used, and saved, outside XO-CHIP
+};
+_Static_assert(sizeof(chip8_state_t) == 67696, "chip8_state_t must not contain padding");
+_Static_assert(offsetof(chip8_state_t, ram) % 8 == 0, "rewind deltas cover whole 64-bit words");
+
+// bytes of a snapshot in use, everything up to the end of the mode's ram
+uint32_t state_size(const chip8_state_t *state){
+    return offsetof(chip8_state_t, ram) + (state->mode == MODE_XOCHIP ? 65536 : 4096);
+}
+
+// copy the machine into a snapshot, cheap enough to call every frame
+void chip8_save_state(const chip8_t *chip8, chip8_state_t *state){
+    memcpy(state->magic, STATE_MAGIC, sizeof state->magic);
+    state->version = STATE_VERSION;
+    memcpy(state->display, chip8->display, sizeof state->display);
+    memcpy(state->ram, chip8->ram, chip8->ram_mask + 1u);
+    memcpy(state->stack, chip8->stack, sizeof state->stack);
+    state->I = chip8->I;
+    state->PC = chip8->PC;
+    state->rng_state = chip8->rng_state;
+    state->keypad = 0;
+    for(int key = 0; key < 16; key++){
+        state->keypad |= chip8->keypad[key] << key;
+    }
+    memcpy(state->V, chip8->V, sizeof state->V);
+    state->stack_ptr = chip8->stack_ptr;
+    state->delay_timer = chip8->delay_timer;
+    state->sound_timer = chip8->sound_timer;
+    state->mode = chip8->mode;
+    state->hires = chip8->hires;
+    state->planes = chip8->planes;
+    state->pitch = chip8->pitch;
+    state->has_pattern = chip8->has_pattern;
+    memcpy(state->flags, chip8->flags, sizeof state->flags);
+    memcpy(state->pattern, chip8->pattern, sizeof state->pattern);
+    memset(state->reserved, 0, sizeof state->reserved);
+}
+
+// restore a snapshot taken by chip8_save_state or mapped from a state file
+void chip8_load_state(chip8_t *chip8, const chip8_state_t *state){
+    // decoded instructions and JIT blocks stay valid wherever ram is unchanged
+    const uint32_t ram_size = state_size(state) - offsetof(chip8_state_t, ram);
+    for(uint32_t addr = 0; addr < ram_size; addr += 8){
+        if(memcmp(&chip8->ram[addr], &state->ram[addr], 8) != 0){
+            invalidate_decoded(chip8, addr, 8);
+        }
+    }
+    memcpy(chip8->ram, state->ram, ram_size);
+    memcpy(chip8->display, state->display, sizeof chip8->display);
+    memcpy(chip8->stack, state->stack, sizeof chip8->stack);
+    chip8->I = state->I;
+    chip8->PC = state->PC;
+    chip8->rng_state = state->rng_state;
+    for(int key = 0; key < 16; key++){
+        chip8->keypad[key] = (state->keypad >> key) & 1;
+    }
+    memcpy(chip8->V, state->V, sizeof chip8->V);
+    chip8->stack_ptr = state->stack_ptr;
+    chip8->delay_timer = state->delay_timer;
+    chip8->sound_timer = state->sound_timer;
+    chip8->mode = state->mode;
+    chip8->ram_mask = state->mode == MODE_XOCHIP ? 0xFFFF : 0x0FFF;
+    chip8->hires = state->hires;
+    chip8->planes = state->planes;
+    chip8->pitch = state->pitch;
+    chip8->has_pattern = state->has_pattern;
+    memcpy(chip8->flags, state->flags, sizeof chip8->flags);
+    memcpy(chip8->pattern, state->pattern, sizeof chip8->pattern);
+    chip8->dirty_rows = ~0ULL;
+}
+
+bool state_valid(const chip8_state_t *state){
+    return memcmp(state->magic, STATE_MAGIC, sizeof state->magic) == 0 &&
+           state->version == STATE_VERSION &&
+           state->stack_ptr < 16 &&
+           state->mode <= MODE_XOCHIP &&
+           state->rng_state != 0;
+}
+
+bool save_state_file(const chip8_t *chip8, const char *path){
+    chip8_state_t state;
+    chip8_save_state(chip8, &state);
+
+    FILE *file = fopen(path, "wb");
+    if(file == NULL){
+        SDL_Log("Unable to open state file: %s", path);
+        return false;
+    }
+    const bool written = fwrite(&state, state_size(&state), 1, file) == 1;
+    if(fclose(file) != 0 || !written){
+        SDL_Log("Unable to write state file: %s", path);
+        return false;
+    }
+    return true;
+}
+
+// map a state file read-only, NULL if it is not a valid state
+// the mapping can be restored from any number of times, release it with unmap_state_file
+const chip8_state_t *map_state_file(const char *path){
+    const int fd = open(path, O_RDONLY);
+    if(fd < 0){
+        SDL_Log("Unable to open state file: %s", path);
+        return NULL;
+    }
+
+    struct stat info;
+    if(fstat(fd, &info) != 0 || info.st_size < (off_t)offsetof(chip8_state_t, ram) || info.st_size > (off_t)sizeof(chip8_state_t)){
+        SDL_Log("Not a state file: %s", path);
+        close(fd);
+        return NULL;
+    }
+    const chip8_state_t *state = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if(state == MAP_FAILED){
+        SDL_Log("Unable to map state file: %s", path);
+        return NULL;
+    }
+
+    if(!state_valid(state) || info.st_size != state_size(state)){
+        SDL_Log("Not a state file or wrong version: %s", path);
+        munmap((void *)state, info.st_size);
+        return NULL;
+    }
+    return state;
+}
+
+void unmap_state_file(const chip8_state_t *state){
+    munmap((void *)state, state_size(state));
+}
+
+bool load_state_file(chip8_t *chip8, const char *path){
+    const chip8_state_t *state = map_state_file(path);
+    if(state == NULL) return false;
+    if(state->mode != chip8->mode){
+        // opcodes decode differently in another mode, the ROM would not carry on where it was saved
+        SDL_Log("State file was saved in another --mode: %s", path);
+        unmap_state_file(state);
+        return false;
+    }
+    chip8_load_state(chip8, state);
+    unmap_state_file(state);
+    return true;
+}
@@ -0,0 +1,234 @@
+// Instruction trace: fixed-size binary records instead of a printf per instruction
+//
+// Built with -DTRACE, every interpreted instruction appends a 32 byte record
+// (PC, opcode, changed registers, I, ...) to a single-producer single-consumer
+// ring. A background thread drains the ring to TRACE_FILE in large fwrites.
+// The emulator only waits if the writer falls a whole ring behind, so no
+// record is ever lost.
+//
+// Debug builds (-DDEBUG) can turn a trace back into text with --decode-trace,
+// using the same descriptions as print_debug_info().
+
+#define TRACE_MAGIC "C8TR"
+#define TRACE_VERSION 2
+
+typedef struct {
+    uint16_t pc;            // address the instruction was fetched from
+    uint16_t opcode;
+    uint16_t I;             // after the instruction
+    uint16_t changed;       // bit r set if the instruction changed V[r]
+    uint16_t keypad;        // keys held, one bit per key
+    uint16_t sequence;      // instruction number, wraps around
+    uint8_t stack_ptr;      // after the instruction
+    uint8_t delay_timer;
+    uint8_t sound_timer;
+    uint8_t reserved;
+    uint8_t V[16];          // after the instruction
+} trace_record_t;
+_Static_assert(sizeof(trace_record_t) == 32, "trace records are 32 bytes");
+
+typedef struct {
+    char magic[4];          // "C8TR"
+    uint32_t version;       // TRACE_VERSION
+    uint32_t record_size;   // sizeof(trace_record_t)
+    uint8_t mode;           // chip8_mode_t the ROM ran in
+    uint8_t quirks;         // quirk_profile_t, as resolved for the run
+    uint8_t reserved[2];
+} trace_header_t;
+_Static_assert(sizeof(trace_header_t) == 16, "trace headers are 16 bytes");
+
+#ifdef TRACE
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#ifndef TRACE_FILE
+    #define TRACE_FILE "chip8.trace"
+#endif
+#define TRACE_RING_RECORDS (1 << 16)    // 2MB of records, must be a power of two
+
+struct trace {
+    trace_record_t *ring;
+    _Alignas(64) atomic_size_t head;    // next record the emulator fills
+    _Alignas(64) atomic_size_t tail;    // next record the writer saves
+    atomic_bool stop;
+    _Alignas(64) size_t tail_seen;      // emulator's last look at tail, saves touching the writer's line
+    uint16_t sequence;
+    uint64_t stalls;        // times the emulator waited for the writer
+    FILE *file;
+    pthread_t thread;
+};
+
+// background thread: save everything between tail and head, sleep when idle
+void *trace_writer(void *arg){
+    trace_t *trace = arg;
+    for(;;){
+        // stop first: once it is seen, head already holds the last record
+        const bool stopping = atomic_load_explicit(&trace->stop, memory_order_acquire);
+        const size_t head = atomic_load_explicit(&trace->head, memory_order_acquire);
+        const size_t tail = atomic_load_explicit(&trace->tail, memory_order_relaxed);
+        if(head == tail){
+            if(stopping) return NULL;
+            nanosleep(&(struct timespec){ .tv_nsec = 200000 }, NULL);
+            continue;
+        }
+
+        // up to the end of the ring in one write
+        const size_t start = tail & (TRACE_RING_RECORDS - 1);
+        size_t count = head - tail;
+        if(count > TRACE_RING_RECORDS - start) count = TRACE_RING_RECORDS - start;
+        fwrite(&trace->ring[start], sizeof(trace_record_t), count, trace->file);
+        atomic_store_explicit(&trace->tail, tail + count, memory_order_release);
+    }
+}
+
+trace_t *trace_create(const char *path, const chip8_t *chip8){
+    trace_t *trace = calloc(1, sizeof(trace_t));
+    if(trace == NULL || (trace->ring = malloc(TRACE_RING_RECORDS * sizeof(trace_record_t))) == NULL){
+        SDL_Log("Unable to allocate trace ring");
+        free(trace);
+        return NULL;
+    }
+
+    trace->file = fopen(path, "wb");
+    if(trace->file == NULL){
+        SDL_Log("Unable to open trace file: %s", path);
+        free(trace->ring);
+        free(trace);
+        return NULL;
+    }
+    const trace_header_t header = { TRACE_MAGIC, TRACE_VERSION, sizeof(trace_record_t), chip8->mode, chip8->quirks, {0} };
+    fwrite(&header, sizeof header, 1, trace->file);
+
+    if(pthread_create(&trace->thread, NULL, trace_writer, trace) != 0){
+        SDL_Log("Unable to start trace writer");
+        fclose(trace->file);
+        free(trace->ring);
+        free(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+// flush every record and close the file
+void trace_destroy(trace_t *trace){
+    if(trace == NULL) return;
+    atomic_store_explicit(&trace->stop, true, memory_order_release);
+    pthread_join(trace->thread, NULL);
+
+    const size_t records = atomic_load(&trace->head);
+    fprintf(stderr, "trace: %zu records written to %s, emulator waited %" PRIu64 " times\n",
+            records, TRACE_FILE, trace->stalls);
+    fclose(trace->file);
+    free(trace->ring);
+    free(trace);
+}
+
+// append the instruction that just ran, before holds V[] as it was before the handler
+void trace_instruction(trace_t *trace, const chip8_t *chip8, uint16_t addr, const uint8_t before[16]){
+    const size_t head = atomic_load_explicit(&trace->head, memory_order_relaxed);
+    if(head - trace->tail_seen == TRACE_RING_RECORDS){
+        // full: wait for the writer rather than drop records
+        while(head - (trace->tail_seen = atomic_load_explicit(&trace->tail, memory_order_acquire)) == TRACE_RING_RECORDS){
+            trace->stalls++;
+            sched_yield();
+        }
+    }
+
+    trace_record_t *record = &trace->ring[head & (TRACE_RING_RECORDS - 1)];
+    record->pc = addr;
+    record->opcode = chip8->inst.opcode;
+    record->I = chip8->I;
+    record->changed = 0;
+    record->keypad = 0;
+    for(int r = 0; r < 16; r++){
+        record->changed |= (chip8->V[r] != before[r]) << r;
+        record->keypad |= chip8->keypad[r] << r;
+    }
+    record->sequence = trace->sequence++;
+    record->stack_ptr = chip8->stack_ptr;
+    record->delay_timer = chip8->delay_timer;
+    record->sound_timer = chip8->sound_timer;
+    record->reserved = 0;
+    memcpy(record->V, chip8->V, sizeof record->V);
+    atomic_store_explicit(&trace->head, head + 1, memory_order_release);
+}
+
+// snapshot V[] before the handler, record the instruction after it
+#define TRACE_BEGIN(chip8) uint8_t trace_before[16]; memcpy(trace_before, (chip8)->V, sizeof trace_before)
+#define TRACE_END(chip8, addr) \
+    if((chip8)->trace) trace_instruction((chip8)->trace, (chip8), (addr), trace_before)
+#endif
+
+#ifdef DEBUG
+// print a trace file as print_debug_info() text, with the registers each instruction changed
+bool trace_decode(const char *path){
+    FILE *file = fopen(path, "rb");
+    if(file == NULL){
+        SDL_Log("Unable to open trace file: %s", path);
+        return false;
+    }
+    trace_header_t header;
+    if(fread(&header, sizeof header, 1, file) != 1 || memcmp(header.magic, TRACE_MAGIC, 4) != 0 ||
+       header.version != TRACE_VERSION || header.record_size != sizeof(trace_record_t) ||
+       header.mode > MODE_XOCHIP || header.quirks > QUIRKS_MODERN){
+        SDL_Log("Not a trace file or wrong version: %s", path);
+        fclose(file);
+        return false;
+    }
+
+    // registers before an instruction are the previous record's values after it
+    chip8_t *chip8 = calloc(1, sizeof(chip8_t));
+    if(chip8 == NULL){
+        fclose(file);
+        return false;
+    }
+    // opcode descriptions depend on both
+    chip8->mode = header.mode;
+    chip8->quirks = header.quirks;
+    trace_record_t record, next;
+    bool have_next = fread(&next, sizeof next, 1, file) == 1;
+    while(have_next){
+        record = next;
+        have_next = fread(&next, sizeof next, 1, file) == 1;
+
+        chip8->PC = record.pc + 2;
+        chip8->inst = (instruction_t){
+            .opcode = record.opcode,
+            .NNN = record.opcode & 0x0FFF,
+            .NN = record.opcode & 0x0FF,
+            .N = record.opcode & 0x0F,
+            .X = (record.opcode >> 8) & 0x0F,
+            .Y = (record.opcode >> 4) & 0x0F,
+        };
+        for(int key = 0; key < 16; key++){
+            chip8->keypad[key] = (record.keypad >> key) & 1;
+        }
+        if(record.opcode == 0x00EE){
+            // the address returned to is where the next record was fetched from
+            chip8->stack_ptr = (record.stack_ptr + 1) & 15;
+            chip8->stack[record.stack_ptr & 15] = have_next ? next.pc : 0;
+        }
+        print_debug_info(chip8);
+
+        if(record.changed || record.I != chip8->I){
+            printf("    ->");
+            for(int r = 0; r < 16; r++){
+                if(record.changed & (1 << r)) printf(" V%X=0x%02X", r, record.V[r]);
+            }
+            if(record.I != chip8->I) printf(" I=0x%04X", record.I);
+            printf("\n");
+        }
+
+        memcpy(chip8->V, record.V, sizeof chip8->V);
+        chip8->I = record.I;
+        chip8->stack_ptr = record.stack_ptr;
+        chip8->delay_timer = record.delay_timer;
+        chip8->sound_timer = record.sound_timer;
+    }
+
+    free(chip8);
+    fclose(file);
+    return true;
+}
+#endif
@@ -0,0 +1,542 @@
+// Video export: emulated frames into a raw RGB, Y4M, animated PNG or GIF file
+//
+// The emulation loop calls video_frame() once per emulated frame, which only
+// copies the packed framebuffer into a single-producer single-consumer ring.
+// An encoder thread takes frames off the ring, scales them up to one palette
+// index per output pixel and encodes them, so a headless or fast-forwarded run
+// only waits on the encoder if it gets a whole ring ahead; no frame is ever
+// dropped. Files hold 60 frames per emulated second at the mode's largest
+// display size times --video-scale (lores frames on a SUPER-CHIP or XO-CHIP
+// machine are doubled to fill it). Raw and Y4M files hold every frame, APNG
+// and GIF show a run of identical frames as one longer frame. Neither needs
+// zlib: PNG data is deflated here with the fixed Huffman codes and greedy
+// matching against the previous byte, the row above and a hash of the last
+// 3 bytes; GIF data is LZW coded.
+
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+
+#define VIDEO_QUEUE 64          // frames in flight, power of two
+#define VIDEO_FPS 60
+#define VIDEO_MAX_REPEAT 30000  // frames one APNG/GIF frame may stand for, keeps the delay fields in range
+
+typedef enum {
+    VIDEO_RAW,                  // RGB24 frames back to back, no header
+    VIDEO_Y4M,                  // YUV4MPEG2, 4:4:4
+    VIDEO_APNG,
+    VIDEO_GIF,
+} video_format_t;
+
+// what one emulated frame showed
+typedef struct {
+    uint64_t display[2][128];
+    bool hires;
+} video_frame_t;
+
+typedef struct {
+    video_frame_t *ring;
+    _Alignas(64) atomic_uint head;  // next frame the emulation writes
+    _Alignas(64) atomic_uint tail;  // next frame the encoder takes
+    atomic_bool stop;
+    _Alignas(64) uint64_t stalls;   // times the emulation waited for the encoder
+    video_format_t format;
+    const char *path;
+    FILE *file;                     // NULL when not exporting
+    uint32_t width;                 // output size in pixels
+    uint32_t height;
+    uint8_t rgb[4][3];              // palette: neither plane, plane 0, plane 1, both
+    pthread_t thread;
+
+    // encoder thread only
+    uint8_t *image;                 // one palette index per output pixel
+    uint8_t *work;                  // the format's encoding buffers
+    int32_t *match;                 // APNG: last position of each 3 byte hash
+    video_frame_t shown;            // the frame image holds
+    uint32_t repeats;               // frames image has been shown for and not written yet
+    uint64_t frames;                // frames taken off the ring
+    uint64_t written;               // frames written, runs of identical frames count once in APNG/GIF
+    uint32_t crc[256];              // APNG: chunk CRC table
+    long actl;                      // APNG: where the frame count goes once it is known
+    uint32_t sequence;              // APNG: chunk sequence number
+    uint64_t gif_shown;             // GIF: frames covered by the delays written so far
+} video_t;
+
+void video_put32(uint8_t *out, uint32_t value){
+    out[0] = value >> 24;
+    out[1] = value >> 16;
+    out[2] = value >> 8;
+    out[3] = value;
+}
+
+// one frame into image, scaled up to the output size
+void video_render(video_t *video, const video_frame_t *frame){
+    const uint32_t words = frame->hires ? 2 : 1;
+    const uint32_t rows = frame->hires ? 64 : 32;
+    const uint32_t cell = video->height / rows;     // output pixels per display pixel
+    for(uint32_t y = 0; y < rows; y++){
+        uint8_t *line = &video->image[y * cell * video->width];
+        for(uint32_t w = 0; w < words; w++){
+            const uint64_t plane0 = frame->display[0][y * words + w];
+            const uint64_t plane1 = frame->display[1][y * words + w];
+            for(uint32_t x = 0; x < 64; x++){
+                const uint8_t index = ((plane0 >> (63 - x)) & 1) | (((plane1 >> (63 - x)) & 1) << 1);
+                memset(&line[(w * 64 + x) * cell], index, cell);
+            }
+        }
+        for(uint32_t copy = 1; copy < cell; copy++){
+            memcpy(&line[copy * video->width], line, video->width);
+        }
+    }
+}
+
+// -- raw and Y4M: every frame as it is
+
+void video_write_raw(video_t *video){
+    uint8_t *out = video->work;
+    for(uint32_t i = 0; i < video->width * video->height; i++, out += 3){
+        memcpy(out, video->rgb[video->image[i]], 3);
+    }
+    fwrite(video->work, 3, video->width * video->height, video->file);
+}
+
+void video_write_y4m(video_t *video){
+    // BT.601 studio range, per palette entry
+    uint8_t yuv[4][3];
+    for(int c = 0; c < 4; c++){
+        const int r = video->rgb[c][0], g = video->rgb[c][1], b = video->rgb[c][2];
+        yuv[c][0] = ((66 * r + 129 * g + 25 * b + 128) >> 8) + 16;
+        yuv[c][1] = ((-38 * r - 74 * g + 112 * b + 128) >> 8) + 128;
+        yuv[c][2] = ((112 * r - 94 * g - 18 * b + 128) >> 8) + 128;
+    }
+    const uint32_t pixels = video->width * video->height;
+    for(uint32_t i = 0; i < pixels; i++){
+        for(int p = 0; p < 3; p++){
+            video->work[p * pixels + i] = yuv[video->image[i]][p];
+        }
+    }
+    fputs("FRAME\n", video->file);
+    fwrite(video->work, 3, pixels, video->file);
+}
+
+// -- APNG: indexed 8 bit PNG frames, deflated with the fixed Huffman codes
+
+typedef struct {
+    uint8_t *out;
+    size_t length;
+    uint64_t bits;
+    uint32_t count;
+} video_bits_t;
+
+// least significant bit first, as deflate and GIF both pack their codes
+void video_bits_put(video_bits_t *b, uint32_t value, uint32_t count){
+    b->bits |= (uint64_t)value << b->count;
+    b->count += count;
+    while(b->count >= 8){
+        b->out[b->length++] = b->bits;
+        b->bits >>= 8;
+        b->count -= 8;
+    }
+}
+
+void video_bits_flush(video_bits_t *b){
+    if(b->count) video_bits_put(b, 0, 8 - b->count);
+}
+
+// Huffman codes go in most significant bit first
+void deflate_code(video_bits_t *b, uint32_t code, uint32_t count){
+    uint32_t reversed = 0;
+    for(uint32_t i = 0; i < count; i++){
+        reversed = (reversed << 1) | ((code >> i) & 1);
+    }
+    video_bits_put(b, reversed, count);
+}
+
+// literal/length symbol in the fixed code
+void deflate_symbol(video_bits_t *b, uint32_t symbol){
+    if(symbol < 144) deflate_code(b, 0x30 + symbol, 8);
+    else if(symbol < 256) deflate_code(b, 0x190 + symbol - 144, 9);
+    else if(symbol < 280) deflate_code(b, symbol - 256, 7);
+    else deflate_code(b, 0xC0 + symbol - 280, 8);
+}
+
+void deflate_match(video_bits_t *b, uint32_t length, uint32_t distance){
+    static const uint16_t length_base[29] = {3, 4, 5, 6, 7, 8, 9, 10, 11, 13, 15, 17, 19, 23, 27, 31,
+                                             35, 43, 51, 59, 67, 83, 99, 115, 131, 163, 195, 227, 258};
+    static const uint8_t length_extra[29] = {0, 0, 0, 0, 0, 0, 0, 0, 1, 1, 1, 1, 2, 2, 2, 2,
+                                             3, 3, 3, 3, 4, 4, 4, 4, 5, 5, 5, 5, 0};
+    static const uint16_t distance_base[30] = {1, 2, 3, 4, 5, 7, 9, 13, 17, 25, 33, 49, 65, 97, 129, 193,
+                                               257, 385, 513, 769, 1025, 1537, 2049, 3073, 4097, 6145,
+                                               8193, 12289, 16385, 24577};
+    static const uint8_t distance_extra[30] = {0, 0, 0, 0, 1, 1, 2, 2, 3, 3, 4, 4, 5, 5, 6, 6,
+                                               7, 7, 8, 8, 9, 9, 10, 10, 11, 11, 12, 12, 13, 13};
+    int l = 28;
+    while(length_base[l] > length) l--;
+    deflate_symbol(b, 257 + l);
+    video_bits_put(b, length - length_base[l], length_extra[l]);
+    int d = 29;
+    while(distance_base[d] > distance) d--;
+    deflate_code(b, d, 5);
+    video_bits_put(b, distance - distance_base[d], distance_extra[d]);
+}
+
+// longest match for in[at] at distance, up to 258 bytes
+uint32_t deflate_match_length(const uint8_t *in, size_t length, size_t at, size_t distance){
+    if(distance == 0 || distance > at || distance > 32768) return 0;
+    const size_t limit = length - at < 258 ? length - at : 258;
+    uint32_t n = 0;
+    while(n < limit && in[at + n] == in[at + n - distance]) n++;
+    return n;
+}
+
+// zlib stream of in into out, stride is the distance to the row above
+size_t video_deflate(video_t *video, const uint8_t *in, size_t length, uint8_t *out, size_t stride){
+    video_bits_t b = { .out = out };
+    out[b.length++] = 0x78;                 // deflate, 32KB window
+    out[b.length++] = 0x01;                 // no dictionary, fastest
+    video_bits_put(&b, 1, 1);               // final block
+    video_bits_put(&b, 1, 2);               // fixed Huffman codes
+
+    for(uint32_t h = 0; h < (1 << 15); h++) video->match[h] = -1;
+    for(size_t i = 0; i < length;){
+        uint32_t best = 0;
+        size_t distance = 0;
+        if(i + 3 <= length){
+            const uint32_t hash = ((in[i] << 10) ^ (in[i + 1] << 5) ^ in[i + 2]) & 0x7FFF;
+            const size_t candidates[3] = {1, stride, video->match[hash] >= 0 ? i - video->match[hash] : 0};
+            for(int c = 0; c < 3; c++){
+                const uint32_t n = deflate_match_length(in, length, i, candidates[c]);
+                if(n > best){
+                    best = n;
+                    distance = candidates[c];
+                }
+            }
+            video->match[hash] = i;
+        }
+        if(best < 3){
+            deflate_symbol(&b, in[i++]);
+            continue;
+        }
+        deflate_match(&b, best, distance);
+        // remember where the matched bytes start too
+        const size_t end = i + best;
+        for(i++; i < end; i++){
+            if(i + 3 <= length) video->match[((in[i] << 10) ^ (in[i + 1] << 5) ^ in[i + 2]) & 0x7FFF] = i;
+        }
+    }
+    deflate_symbol(&b, 256);                // end of block
+    video_bits_flush(&b);
+
+    uint32_t a = 1, s = 0;
+    for(size_t i = 0; i < length; i++){
+        a = (a + in[i]) % 65521;
+        s = (s + a) % 65521;
+    }
+    video_put32(&out[b.length], (s << 16) | a);
+    return b.length + 4;
+}
+
+void video_png_chunk(video_t *video, const char *type, const uint8_t *data, uint32_t length){
+    uint8_t header[8];
+    video_put32(header, length);
+    memcpy(header + 4, type, 4);
+    uint32_t crc = 0xFFFFFFFF;
+    for(int i = 4; i < 8; i++) crc = video->crc[(crc ^ header[i]) & 0xFF] ^ (crc >> 8);
+    for(uint32_t i = 0; i < length; i++) crc = video->crc[(crc ^ data[i]) & 0xFF] ^ (crc >> 8);
+    uint8_t trailer[4];
+    video_put32(trailer, crc ^ 0xFFFFFFFF);
+    fwrite(header, sizeof header, 1, video->file);
+    fwrite(data, 1, length, video->file);
+    fwrite(trailer, sizeof trailer, 1, video->file);
+}
+
+void video_png_actl(video_t *video, uint32_t frames){
+    uint8_t actl[8];
+    video_put32(actl, frames);
+    video_put32(actl + 4, 0);               // loop forever
+    video_png_chunk(video, "acTL", actl, sizeof actl);
+}
+
+void video_open_png(video_t *video){
+    for(uint32_t n = 0; n < 256; n++){
+        uint32_t c = n;
+        for(int k = 0; k < 8; k++) c = c & 1 ? 0xEDB88320 ^ (c >> 1) : c >> 1;
+        video->crc[n] = c;
+    }
+    fwrite("\x89PNG\r\n\x1A\n", 8, 1, video->file);
+    uint8_t ihdr[13] = {0};
+    video_put32(ihdr, video->width);
+    video_put32(ihdr + 4, video->height);
+    ihdr[8] = 8;                            // bits per index
+    ihdr[9] = 3;                            // indexed colour
+    video_png_chunk(video, "IHDR", ihdr, sizeof ihdr);
+    // the frame count is filled in by video_close
+    video->actl = ftell(video->file);
+    video_png_actl(video, 0);
+    video_png_chunk(video, "PLTE", &video->rgb[0][0], sizeof video->rgb);
+}
+
+// image shown for frames frames
+void video_write_png(video_t *video, uint32_t frames){
+    uint8_t fctl[26] = {0};
+    video_put32(fctl, video->sequence++);
+    video_put32(fctl + 4, video->width);
+    video_put32(fctl + 8, video->height);
+    fctl[20] = frames >> 8;                 // delay frames/60 seconds
+    fctl[21] = frames;
+    fctl[22] = VIDEO_FPS >> 8;
+    fctl[23] = VIDEO_FPS & 0xFF;
+    video_png_chunk(video, "fcTL", fctl, sizeof fctl);
+
+    // every row starts with its filter type, 0 = none
+    const size_t stride = video->width + 1;
+    uint8_t *rows = video->work;
+    for(uint32_t y = 0; y < video->height; y++){
+        rows[y * stride] = 0;
+        memcpy(&rows[y * stride + 1], &video->image[y * video->width], video->width);
+    }
+    // the first frame is the PNG's own image, the rest carry a sequence number
+    uint8_t *data = rows + stride * video->height;
+    const size_t length = video_deflate(video, rows, stride * video->height, data + 4, stride);
+    if(video->written == 0){
+        video_png_chunk(video, "IDAT", data + 4, length);
+    }
+    else{
+        video_put32(data, video->sequence++);
+        video_png_chunk(video, "fdAT", data, length + 4);
+    }
+}
+
+// -- GIF: LZW coded frames, delays in hundredths of a second
+
+void video_open_gif(video_t *video){
+    uint8_t header[13] = {'G', 'I', 'F', '8', '9', 'a'};
+    header[6] = video->width;
+    header[7] = video->width >> 8;
+    header[8] = video->height;
+    header[9] = video->height >> 8;
+    header[10] = 0xF1;                      // 4 entry global palette
+    fwrite(header, sizeof header, 1, video->file);
+    fwrite(video->rgb, sizeof video->rgb, 1, video->file);
+    fwrite("\x21\xFF\x0BNETSCAPE2.0\x03\x01\x00\x00\x00", 19, 1, video->file);  // loop forever
+}
+
+size_t video_lzw(video_t *video, uint8_t *out){
+    enum { MIN_SIZE = 2, CLEAR = 1 << MIN_SIZE, END = CLEAR + 1, TABLE = 8192 };
+    // (prefix code << 8 | index) -> code, open addressing
+    int32_t *keys = video->match;
+    uint16_t *codes = (uint16_t *)(keys + TABLE);
+    video_bits_t b = { .out = out };
+    uint32_t size = MIN_SIZE + 1;
+    uint32_t next = END + 1;
+    for(int i = 0; i < TABLE; i++) keys[i] = -1;
+    video_bits_put(&b, CLEAR, size);
+
+    const uint32_t pixels = video->width * video->height;
+    uint32_t prefix = video->image[0];
+    for(uint32_t i = 1; i < pixels; i++){
+        const int32_t key = prefix << 8 | video->image[i];
+        uint32_t slot = (key * 2654435761u) >> 19;
+        while(keys[slot] >= 0 && keys[slot] != key) slot = (slot + 1) & (TABLE - 1);
+        if(keys[slot] == key){
+            prefix = codes[slot];
+            continue;
+        }
+
+        video_bits_put(&b, prefix, size);
+        if(next < 4096){
+            keys[slot] = key;
+            codes[slot] = next++;
+            // the decoder adds this code one step later, it widens when its next code needs the bit
+            if(next > (1u << size) && size < 12) size++;
+        }
+        else{
+            video_bits_put(&b, CLEAR, size);
+            for(int t = 0; t < TABLE; t++) keys[t] = -1;
+            size = MIN_SIZE + 1;
+            next = END + 1;
+        }
+        prefix = video->image[i];
+    }
+    video_bits_put(&b, prefix, size);
+    // the decoder adds one more code on reading the last one
+    if(next == (1u << size) && size < 12) size++;
+    video_bits_put(&b, END, size);
+    video_bits_flush(&b);
+    return b.length;
+}
+
+void video_write_gif(video_t *video, uint32_t frames){
+    // delays are whole hundredths, keep the rounding error from adding up
+    const uint64_t before = video->gif_shown * 100 / VIDEO_FPS;
+    video->gif_shown += frames;
+    const uint32_t delay = video->gif_shown * 100 / VIDEO_FPS - before;
+    const uint8_t control[8] = {0x21, 0xF9, 4, 0, delay, delay >> 8, 0, 0};
+    fwrite(control, sizeof control, 1, video->file);
+    const uint8_t descriptor[11] = {0x2C, 0, 0, 0, 0, video->width, video->width >> 8,
+                                    video->height, video->height >> 8, 0, 2};   // no local palette, 2 bit codes
+    fwrite(descriptor, sizeof descriptor, 1, video->file);
+
+    // data goes out in sub-blocks of up to 255 bytes
+    const size_t length = video_lzw(video, video->work);
+    for(size_t at = 0; at < length; at += 255){
+        const uint8_t block = length - at < 255 ? length - at : 255;
+        fputc(block, video->file);
+        fwrite(&video->work[at], 1, block, video->file);
+    }
+    fputc(0, video->file);
+}
+
+// -- encoder thread
+
+// write image as frames frames
+void video_write(video_t *video, uint32_t frames){
+    switch(video->format){
+        case VIDEO_RAW: video_write_raw(video); break;
+        case VIDEO_Y4M: video_write_y4m(video); break;
+        case VIDEO_APNG: video_write_png(video, frames); break;
+        case VIDEO_GIF: video_write_gif(video, frames); break;
+    }
+    video->written++;
+}
+
+void video_encode(video_t *video, const video_frame_t *frame){
+    const bool runs = video->format == VIDEO_APNG || video->format == VIDEO_GIF;
+    const bool same = video->frames > 0 && frame->hires == video->shown.hires &&
+                      memcmp(frame->display, video->shown.display, sizeof frame->display) == 0;
+    video->frames++;
+    if(!same){
+        if(runs && video->repeats) video_write(video, video->repeats);
+        video->shown = *frame;
+        video_render(video, frame);
+        video->repeats = 0;
+    }
+    if(!runs){
+        video_write(video, 1);
+        return;
+    }
+    if(++video->repeats == VIDEO_MAX_REPEAT){
+        video_write(video, video->repeats);
+        video->repeats = 0;
+    }
+}
+
+// background thread: encode everything between tail and head, sleep when idle
+void *video_encoder(void *arg){
+    video_t *video = arg;
+    for(;;){
+        // stop first: once it is seen, head already holds the last frame
+        const bool stopping = atomic_load_explicit(&video->stop, memory_order_acquire);
+        const unsigned head = atomic_load_explicit(&video->head, memory_order_acquire);
+        unsigned tail = atomic_load_explicit(&video->tail, memory_order_relaxed);
+        if(head == tail){
+            if(stopping) return NULL;
+            nanosleep(&(struct timespec){ .tv_nsec = 200000 }, NULL);
+            continue;
+        }
+        for(; tail != head; tail++){
+            video_encode(video, &video->ring[tail % VIDEO_QUEUE]);
+            atomic_store_explicit(&video->tail, tail + 1, memory_order_release);
+        }
+    }
+}
+
+void video_free(video_t *video){
+    if(video->file) fclose(video->file);
+    video->file = NULL;
+    free(video->ring);
+    free(video->image);
+    free(video->work);
+    free(video->match);
+}
+
+// export to path, the format goes by its extension: .y4m, .png/.apng, .gif, anything else is raw RGB24
+bool video_open(video_t *video, const char *path, const config_t *config){
+    memset(video, 0, sizeof *video);
+    const char *ext = strrchr(path, '.');
+    video->format = VIDEO_RAW;
+    if(ext && strcmp(ext, ".y4m") == 0) video->format = VIDEO_Y4M;
+    else if(ext && (strcmp(ext, ".png") == 0 || strcmp(ext, ".apng") == 0)) video->format = VIDEO_APNG;
+    else if(ext && strcmp(ext, ".gif") == 0) video->format = VIDEO_GIF;
+
+    video->path = path;
+    video->width = (config->mode == MODE_CHIP8 ? 64 : 128) * config->video_scale;
+    video->height = (config->mode == MODE_CHIP8 ? 32 : 64) * config->video_scale;
+    const uint32_t colors[4] = { config->bg_color, config->fg_color, config->plane2_color, config->mixed_color };
+    for(int c = 0; c < 4; c++){
+        video->rgb[c][0] = colors[c] >> 24;
+        video->rgb[c][1] = colors[c] >> 16;
+        video->rgb[c][2] = colors[c] >> 8;
+    }
+
+    // APNG needs the filtered rows plus their deflated copy, the rest fit in 3 bytes per pixel
+    const size_t pixels = (size_t)video->width * video->height;
+    const size_t rows = pixels + video->height;
+    const size_t work = video->format == VIDEO_APNG ? rows + rows + rows / 8 + 64 : pixels * 3;
+    video->file = fopen(path, "wb");
+    if(video->file == NULL){
+        SDL_Log("Unable to open video file: %s", path);
+        return false;
+    }
+    video->ring = malloc(VIDEO_QUEUE * sizeof(video_frame_t));
+    video->image = calloc(pixels, 1);
+    video->work = malloc(work);
+    video->match = malloc((1 << 15) * sizeof(int32_t));
+    if(video->ring == NULL || video->image == NULL || video->work == NULL || video->match == NULL){
+        SDL_Log("Unable to allocate video buffers");
+        video_free(video);
+        return false;
+    }
+    if(video->format == VIDEO_Y4M){
+        fprintf(video->file, "YUV4MPEG2 W%u H%u F%u:1 Ip A1:1 C444\n", video->width, video->height, VIDEO_FPS);
+    }
+    else if(video->format == VIDEO_APNG) video_open_png(video);
+    else if(video->format == VIDEO_GIF) video_open_gif(video);
+
+    if(pthread_create(&video->thread, NULL, video_encoder, video) != 0){
+        SDL_Log("Unable to start video encoder");
+        video_free(video);
+        return false;
+    }
+    return true;
+}
+
+// emulation side, once per emulated frame
+void video_frame(video_t *video, const chip8_t *chip8){
+    if(video->file == NULL) return;
+    const unsigned head = atomic_load_explicit(&video->head, memory_order_relaxed);
+    // full: wait for the encoder rather than drop a frame
+    while(head - atomic_load_explicit(&video->tail, memory_order_acquire) == VIDEO_QUEUE){
+        video->stalls++;
+        sched_yield();
+    }
+    video_frame_t *frame = &video->ring[head % VIDEO_QUEUE];
+    memcpy(frame->display, chip8->display, sizeof frame->display);
+    frame->hires = chip8->hires;
+    atomic_store_explicit(&video->head, head + 1, memory_order_release);
+}
+
+// encode every queued frame and finish the file
+void video_close(video_t *video){
+    if(video->file == NULL) return;
+    atomic_store_explicit(&video->stop, true, memory_order_release);
+    pthread_join(video->thread, NULL);
+
+    if(video->format == VIDEO_APNG || video->format == VIDEO_GIF){
+        // the last run of frames, or a blank frame so the file is never empty
+        if(video->repeats || video->written == 0) video_write(video, video->repeats ? video->repeats : 1);
+    }
+    if(video->format == VIDEO_APNG){
+        video_png_chunk(video, "IEND", NULL, 0);
+        fseek(video->file, video->actl, SEEK_SET);
+        video_png_actl(video, video->written);
+    }
+    else if(video->format == VIDEO_GIF){
+        fputc(0x3B, video->file);
+    }
+    if(fclose(video->file) != 0) SDL_Log("Unable to write video file: %s", video->path);
+    video->file = NULL;
+    fprintf(stderr, "video: %" PRIu64 " frames, %" PRIu64 " written to %s, emulator waited %" PRIu64 " times\n",
+            video->frames, video->written, video->path, video->stalls);
+    video_free(video);
+}